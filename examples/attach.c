@@ -0,0 +1,158 @@
+/*
+ * Copyright 2019 Iguazio.io Systems Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License") with
+ * an addition restriction as set forth herein. You may not use this
+ * file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * In addition, you may not use the software for any purposes that are
+ * illegal under applicable law, and the grant of the foregoing license
+ * under the Apache 2.0 license is conditioned upon your compliance with
+ * such restriction.
+ */
+
+/*
+ * icli-attach - attach terminal to session server of an application
+ * (icli_server_params.sessions), e.g. icli-attach /run/app.sock
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static volatile sig_atomic_t resized = 1;
+
+static void on_resize(int sig)
+{
+    (void)sig;
+    resized = 1;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    return 0;
+}
+
+/* Report terminal size to the server */
+static int send_size(int sock)
+{
+    struct winsize ws;
+    char buf[32];
+    int len;
+
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) || !ws.ws_row)
+        return 0;
+
+    len = snprintf(buf, sizeof(buf), "\x1b[8;%d;%dt", ws.ws_row, ws.ws_col);
+    return write_all(sock, buf, (size_t)len);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct sigaction sa = {.sa_handler = on_resize};
+    struct termios orig_term, raw_term;
+    struct pollfd fds[2];
+    bool tty = isatty(STDIN_FILENO);
+    int ret = EXIT_FAILURE;
+    char buf[4096];
+    int sock;
+
+    if (2 != argc || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Usage: %s <socket>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Unable to connect to %s:%m\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    if (tty) {
+        tcgetattr(STDIN_FILENO, &orig_term);
+        raw_term = orig_term;
+        cfmakeraw(&raw_term);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw_term);
+    }
+
+    /* no SA_RESTART, so that poll() is interrupted to report the new size */
+    sigaction(SIGWINCH, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fds[0] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+    fds[1] = (struct pollfd){.fd = sock, .events = POLLIN};
+
+    for (;;) {
+        ssize_t n;
+
+        if (resized && tty) {
+            resized = 0;
+            if (send_size(sock))
+                break;
+        }
+
+        if (poll(fds, 2, -1) < 0) {
+            if (EINTR == errno)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents) {
+            n = read(sock, buf, sizeof(buf));
+            if (n <= 0) {
+                ret = n ? EXIT_FAILURE : EXIT_SUCCESS;
+                break;
+            }
+            if (write_all(STDOUT_FILENO, buf, (size_t)n))
+                break;
+        }
+
+        if (fds[0].revents) {
+            n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n <= 0) {
+                /* the server closes the session once its output is sent */
+                shutdown(sock, SHUT_WR);
+                fds[0].fd = -1;
+            } else if (write_all(sock, buf, (size_t)n)) {
+                break;
+            }
+        }
+    }
+
+    if (tty)
+        tcsetattr(STDIN_FILENO, TCSANOW, &orig_term);
+    close(sock);
+
+    return ret;
+}
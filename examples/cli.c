@@ -18,11 +18,16 @@
  * such restriction.
  */
 
+#define _GNU_SOURCE
 #include "icli.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include <linux/limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 
 struct my_context {
     int something;
@@ -31,25 +36,54 @@ struct my_context {
 
 static enum icli_ret cli_list_jobs(char *argv[], int argc, void *context)
 {
-    for (int i = 1; i < 200; ++i)
-        icli_printf("Jobs: %d\n", i);
+    static const struct icli_column cols[] = {{"id", ICLI_COL_NUM}, {"name", ICLI_COL_STR}, {"done", ICLI_COL_BOOL}};
+    char id[16], name[32];
+    const char *row[] = {id, name, NULL};
 
+    if (icli_table_begin(cols, 3))
+        return ICLI_ERR;
+
+    for (int i = 1; i < 200; ++i) {
+        snprintf(id, sizeof(id), "%d", i);
+        snprintf(name, sizeof(name), "job-%d", i);
+        row[2] = i % 3 ? "false" : "true";
+        icli_table_row(row);
+    }
+
+    icli_table_end();
     return ICLI_OK;
 }
 
 static int cli_show_containers(void)
 {
-    icli_printf("Container: %d\n", 1);
-    icli_printf("Container: %d\n", 2);
-    icli_printf("Container: %d\n", 3);
-    icli_printf("Container: %d\n", 4);
+    static const struct icli_column cols[] = {{"id", ICLI_COL_NUM}, {"name", ICLI_COL_STR}, {"image", ICLI_COL_STR}};
+    const char *containers[][3] = {{"1", "container-1", "nginx:latest"},
+                                   {"2", "container-2", "redis:7"},
+                                   {"3", "container-3", "postgres:16"},
+                                   {"4", "container-4", "busybox"}};
+
+    if (icli_table_begin(cols, 3))
+        return -1;
+
+    for (int i = 0; i < 4; ++i)
+        icli_table_row(containers[i]);
+
+    icli_table_end();
     return 0;
 }
 
 static int cli_show_services(void)
 {
-    icli_printf("Service: %d\n", 1);
-    icli_printf("Service: %d\n", 2);
+    static const struct icli_column cols[] = {{"id", ICLI_COL_NUM}, {"name", ICLI_COL_STR}, {"running", ICLI_COL_BOOL}};
+    const char *services[][3] = {{"1", "web", "true"}, {"2", "db", "false"}};
+
+    if (icli_table_begin(cols, 3))
+        return -1;
+
+    for (int i = 0; i < 2; ++i)
+        icli_table_row(services[i]);
+
+    icli_table_end();
     return 0;
 }
 
@@ -72,15 +106,199 @@ static enum icli_ret cli_containers_list(char *argv[], int argc, void *context)
     return ICLI_OK;
 }
 
+#define CLI_CONTAINERS_MAX 16
+
+/* Containers known to the application. Their names are values of arguments of several commands */
+static struct {
+    char names[CLI_CONTAINERS_MAX][32];
+    int n;
+    struct icli_value_set *set; /* the names, shared by the arguments */
+} cli_containers = {.names = {"container-1", "container-2", "container-3"}, .n = 3};
+
+/* Publish names of the containers to all commands taking a container name */
+static int cli_update_container_names(void)
+{
+    struct icli_arg_val vals[CLI_CONTAINERS_MAX + 1] = {{0}};
+
+    for (int i = 0; i < cli_containers.n; ++i)
+        vals[i].val = cli_containers.names[i];
+
+    if (!cli_containers.set) {
+        cli_containers.set = icli_value_set_create(vals);
+        return cli_containers.set ? 0 : -1;
+    }
+
+    return icli_value_set_update(cli_containers.set, vals);
+}
+
+static enum icli_ret cli_containers_create(char *argv[], int argc, void *context)
+{
+    for (int i = 0; i < cli_containers.n; ++i) {
+        if (strcmp(cli_containers.names[i], argv[0]) == 0) {
+            icli_err_printf("Container %s already exists\n", argv[0]);
+            return ICLI_ERR;
+        }
+    }
+
+    if (CLI_CONTAINERS_MAX == cli_containers.n) {
+        icli_err_printf("Too many containers\n");
+        return ICLI_ERR;
+    }
+
+    snprintf(cli_containers.names[cli_containers.n++], sizeof(cli_containers.names[0]), "%s", argv[0]);
+    if (cli_update_container_names()) {
+        --cli_containers.n;
+        return ICLI_ERR;
+    }
+
+    icli_printf("Created %s\n", argv[0]);
+    return ICLI_OK;
+}
+
+static enum icli_ret cli_containers_start(char *argv[], int argc, void *context)
+{
+    icli_printf("Starting %s\n", argv[0]);
+    return ICLI_OK;
+}
+
+static enum icli_ret cli_containers_stop(char *argv[], int argc, void *context)
+{
+    icli_printf("Stopping %s\n", argv[0]);
+    return ICLI_OK;
+}
+
 static enum icli_ret cli_do(char *argv[], int argc, void *context)
 {
     icli_printf("No problemmo\n");
     return ICLI_OK;
 }
 
-static enum icli_ret cli_interface(char *argv[], int argc, void *context)
+static enum icli_ret cli_interface(struct icli_value argv[], int argc, void *context)
+{
+    icli_printf("Set interface %" PRId64 "\n", argv[0].i);
+
+    return ICLI_OK;
+}
+
+static enum icli_ret cli_echo(char *argv[], int argc, void *context)
+{
+    icli_printf("%s\n", argv[0]);
+
+    return ICLI_OK;
+}
+
+static enum icli_ret cli_route(char *argv[], int argc, void *context)
 {
-    icli_printf("Set interface %s\n", argv[0]);
+    icli_printf("Route %s %s", argv[0], argv[1]);
+    for (int i = 2; i < argc; i += 2)
+        icli_printf(" %s=%s", argv[i], argv[i + 1]);
+    icli_printf("\n");
+
+    return ICLI_OK;
+}
+
+struct cli_wc_count {
+    int lines;
+    size_t bytes;
+};
+
+static void cli_wc_write(const char *buf, size_t len, void *ctx)
+{
+    struct cli_wc_count *count = ctx;
+
+    count->bytes += len;
+    for (size_t i = 0; i < len; ++i)
+        count->lines += '\n' == buf[i];
+}
+
+static enum icli_ret cli_wc(char *argv[], int argc, void *context)
+{
+    struct cli_wc_count count = {0};
+    struct icli_sink sink = {.out = {.write = cli_wc_write, .ctx = &count}};
+    char line[1024] = "";
+    size_t len = 0;
+    int ret;
+
+    for (int i = 0; i < argc && len < sizeof(line); ++i)
+        len += (size_t)snprintf(line + len, sizeof(line) - len, "%s%s", i ? " " : "", argv[i]);
+
+    ret = icli_execute_capture(line, &sink);
+
+    icli_printf("%d lines, %zu bytes, %zu error bytes\n", count.lines, count.bytes, sink.err.len);
+    free(sink.err.buf);
+
+    return ret ? ICLI_ERR : ICLI_OK;
+}
+
+/* Table of sizes of output of other commands, captured while the table is being output */
+static enum icli_ret cli_sizes(char *argv[], int argc, void *context)
+{
+    static const struct icli_column cols[] = {
+        {"command", ICLI_COL_STR}, {"lines", ICLI_COL_NUM}, {"bytes", ICLI_COL_NUM}};
+    const char *cmds[] = {"show services", "show containers"};
+    char line[64], lines[16], bytes[32];
+    const char *row[] = {NULL, lines, bytes};
+
+    if (icli_table_begin(cols, 3))
+        return ICLI_ERR;
+
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i) {
+        struct cli_wc_count count = {0};
+        struct icli_sink sink = {.out = {.write = cli_wc_write, .ctx = &count}};
+
+        snprintf(line, sizeof(line), "%s", cmds[i]);
+        icli_execute_capture(line, &sink);
+        free(sink.err.buf);
+
+        snprintf(lines, sizeof(lines), "%d", count.lines);
+        snprintf(bytes, sizeof(bytes), "%zu", count.bytes);
+        row[0] = cmds[i];
+        icli_table_row(row);
+    }
+
+    icli_table_end();
+    return ICLI_OK;
+}
+
+static struct icli_command *diag;
+
+static enum icli_ret cli_ping(char *argv[], int argc, void *context)
+{
+    icli_printf("pong\n");
+    return ICLI_OK;
+}
+
+/* Add or remove mode of a plugin at run time */
+static enum icli_ret cli_plugin(char *argv[], int argc, void *context)
+{
+    struct icli_command_params param = {.name = "diag", .help = "Diagnostics plugin"};
+    struct icli_command_params ping = {.name = "ping", .help = "Check the plugin responds", .command = cli_ping};
+
+    if (strcmp(argv[0], "unload") == 0) {
+        if (!diag) {
+            icli_err_printf("Plugin is not loaded\n");
+            return ICLI_ERR;
+        }
+
+        icli_unregister_command(diag);
+        diag = NULL;
+        return ICLI_OK;
+    }
+
+    if (diag) {
+        icli_err_printf("Plugin is already loaded\n");
+        return ICLI_ERR;
+    }
+
+    if (icli_register_command(&param, &diag))
+        return ICLI_ERR;
+
+    ping.parent = diag;
+    if (icli_register_command(&ping, NULL)) {
+        icli_unregister_command(diag);
+        diag = NULL;
+        return ICLI_ERR;
+    }
 
     return ICLI_OK;
 }
@@ -129,19 +347,161 @@ static void cli_cmd_hook(const char *cmd, char *argv[], int argc, void *context)
     fprintf(self->log, "\n");
 }
 
-static void cli_out_hook(const char *format, va_list args, void *context)
+static void cli_out_hook(const char *buf, size_t len, void *context)
 {
     struct my_context *self = context;
 
-    vfprintf(self->log, format, args);
+    fwrite(buf, 1, len, self->log);
 }
 
-static void cli_err_hook(const char *format, va_list args, void *context)
+static void cli_err_hook(const char *buf, size_t len, void *context)
 {
     struct my_context *self = context;
     fprintf(self->log, "ERR:");
 
-    vfprintf(self->log, format, args);
+    fwrite(buf, 1, len, self->log);
+}
+
+static volatile sig_atomic_t stop_server;
+
+static void on_stop_signal(int sig)
+{
+    (void)sig;
+    stop_server = 1;
+}
+
+/* Serve requests of clients connected to PATH until SIGINT or SIGTERM */
+static int run_server(const char *path, int sessions)
+{
+    struct icli_server_params params = {.path = path, .sessions = sessions};
+    struct sigaction sa = {.sa_handler = on_stop_signal};
+    struct icli_server *server = icli_server_create(&params);
+
+    if (!server) {
+        fprintf(stderr, "Unable to create server on %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    /* no SA_RESTART, so that waiting for events is interrupted */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!stop_server) {
+        if (icli_server_poll(server, -1) < 0) {
+            fprintf(stderr, "Unable to poll server:%m\n");
+            break;
+        }
+    }
+
+    icli_server_destroy(server);
+    return EXIT_SUCCESS;
+}
+
+static volatile int stop_watch;
+
+/* Alert the user about changes of services, as a monitoring thread of the application would */
+static void *watch_services(void *arg)
+{
+    long interval_ms = *(long *)arg;
+    struct timespec ts = {.tv_sec = interval_ms / 1000, .tv_nsec = interval_ms % 1000 * 1000000};
+
+    for (int i = 0; !__atomic_load_n(&stop_watch, __ATOMIC_RELAXED); ++i) {
+        nanosleep(&ts, NULL);
+        icli_notify("service db is %s", i % 2 ? "up" : "down");
+    }
+
+    return NULL;
+}
+
+struct cli_prober {
+    long n_probes;
+    struct icli_command *show;
+    struct icli_arg *show_args;
+};
+
+/* Register commands and reset arguments while the shell runs, as a plugin loader of the application would */
+static void *register_probes(void *arg)
+{
+    struct cli_prober *prober = arg;
+
+    for (long i = 0; i < prober->n_probes && !__atomic_load_n(&stop_watch, __ATOMIC_RELAXED); ++i) {
+        char name[32];
+        struct icli_command_params param = {.name = name, .help = "Probe registered at run time", .command = cli_do};
+
+        snprintf(name, sizeof(name), "probe-%ld", i);
+        if (icli_register_command(&param, NULL) || icli_reset_arguments(prober->show, prober->show_args))
+            break;
+    }
+
+    return NULL;
+}
+
+/* Print cost of start up phases, to see what the first prompt waits for */
+static void print_phase_stats(void)
+{
+    struct icli_phase_stats stats;
+
+    for (int i = 0; i < ICLI_PHASE_MAX; ++i) {
+        if (icli_get_phase_stats(i, &stats) == 0 && stats.count)
+            fprintf(stderr, "%-20s %4" PRIu64 " %10.3f ms\n", stats.name, stats.count, (double)stats.nsec / 1e6);
+    }
+}
+
+/* Allocator accounting memory of icli apart from the rest of the application, as a pool allocator would */
+struct cli_pool {
+    size_t bytes; /* bytes in use */
+};
+
+/* every block starts with its size, padded to keep the alignment of malloc() */
+#define CLI_POOL_HDR 16
+
+static void *cli_pool_realloc(void *ptr, size_t size, void *ctx)
+{
+    struct cli_pool *pool = ctx;
+    char *block = ptr ? (char *)ptr - CLI_POOL_HDR : NULL;
+    size_t old_size = block ? *(size_t *)block : 0;
+
+    block = realloc(block, CLI_POOL_HDR + size);
+    if (!block)
+        return NULL;
+
+    *(size_t *)block = size;
+    __atomic_add_fetch(&pool->bytes, size - old_size, __ATOMIC_RELAXED);
+    return block + CLI_POOL_HDR;
+}
+
+static void *cli_pool_malloc(size_t size, void *ctx)
+{
+    return cli_pool_realloc(NULL, size, ctx);
+}
+
+static void cli_pool_free(void *ptr, void *ctx)
+{
+    struct cli_pool *pool = ctx;
+    char *block = (char *)ptr - CLI_POOL_HDR;
+
+    __atomic_sub_fetch(&pool->bytes, *(size_t *)block, __ATOMIC_RELAXED);
+    free(block);
+}
+
+/* Print counters of the allocator of icli, live allocations left after icli_cleanup() are leaks */
+static void print_alloc_stats(void)
+{
+    struct icli_alloc_stats stats;
+
+    if (icli_get_alloc_stats(&stats))
+        return;
+
+    fprintf(stderr,
+            "allocs %" PRIu64 " reallocs %" PRIu64 " frees %" PRIu64 " failures %" PRIu64 " live %" PRIu64
+            " bytes %" PRIu64 " peak %" PRIu64 "\n",
+            stats.allocs,
+            stats.reallocs,
+            stats.frees,
+            stats.failures,
+            stats.allocs - stats.frees,
+            stats.bytes,
+            stats.peak_bytes);
 }
 
 int main(int argc, char *argv[])
@@ -162,8 +522,19 @@ int main(int argc, char *argv[])
                                  .prompt = "my_cli",
                                  .hist_file = "/tmp/icli_history",
                                  .cmd_hook = cli_cmd_hook,
-                                 .out_hook = cli_out_hook,
-                                 .err_hook = cli_err_hook};
+                                 .out_write_hook = cli_out_hook,
+                                 .err_write_hook = cli_err_hook,
+                                 .audit_file = "./cli_audit.log"};
+    struct cli_pool pool = {0};
+
+    if (getenv("CLI_HISTORY"))
+        params.hist_file = getenv("CLI_HISTORY");
+
+    if (getenv("CLI_POOL"))
+        params.allocator = (struct icli_allocator){.malloc = cli_pool_malloc,
+                                                   .realloc = cli_pool_realloc,
+                                                   .free = cli_pool_free,
+                                                   .ctx = &pool};
 
     res = icli_init(&params);
     if (res) {
@@ -171,14 +542,19 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    struct icli_command *containers, *services, *jobs, *interface;
+    struct icli_command *containers, *services, *jobs, *interface, *show;
     struct icli_command_params param = {.name = "containers", .help = "Containers"};
 
     struct icli_arg_val show_first_arg[] = {{.val = "containers"}, {.val = "services"}, {.val = NULL}};
     struct icli_arg show_args[] = {{.type = AT_Val, .vals = show_first_arg, .help = "Arguments to show info for"}};
 
     struct icli_arg cat_args[] = {{.type = AT_File, .help = "File to cat"}};
-    struct icli_arg intf_args[] = {{.type = AT_None, .help = "Interface number"}};
+
+    struct icli_arg_val plugin_first_arg[] = {{.val = "load"}, {.val = "unload"}, {.val = NULL}};
+    struct icli_arg plugin_args[] = {{.type = AT_Val, .vals = plugin_first_arg, .help = "Load or unload the plugin"}};
+    struct icli_arg intf_args[] = {
+        {.type = AT_Int, .help = "Interface number", .min = 0, .max = 1023, .range = 1}};
+    struct icli_arg echo_args[] = {{.type = AT_Regex, .help = "Text to print", .regex = "^[[:print:]]+$"}};
 
     struct icli_arg_val do_first_arg[] = {{.val = "something"}, {.val = "nothing"}, {.val = NULL}};
     struct icli_arg_val do_second_arg[] = {{.val = "good"}, {.val = "bad"}, {.val = NULL}};
@@ -221,6 +597,39 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    /* the same set of names is referenced by arguments of both commands, and updated once by create */
+    if (cli_update_container_names()) {
+        fprintf(stderr, "Unable to create set of container names\n");
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
+    struct icli_arg container_args[] = {{.type = AT_Val, .set = cli_containers.set, .help = "Container name"}};
+    struct icli_command_params container_params[] = {{.parent = containers,
+                                                      .name = "create",
+                                                      .help = "Create container",
+                                                      .command = cli_containers_create,
+                                                      .argc = 1},
+                                                     {.parent = containers,
+                                                      .name = "start",
+                                                      .help = "Start container",
+                                                      .command = cli_containers_start,
+                                                      .argc = 1,
+                                                      .argv = container_args},
+                                                     {.parent = containers,
+                                                      .name = "stop",
+                                                      .help = "Stop container",
+                                                      .command = cli_containers_stop,
+                                                      .argc = 1,
+                                                      .argv = container_args}};
+
+    res = icli_register_commands(container_params, NULL, 3);
+    if (res) {
+        fprintf(stderr, "Unable to register container commands\n");
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
     memset(&param, 0, sizeof(param));
     param.help = "Print info";
     param.name = "show";
@@ -228,6 +637,74 @@ int main(int argc, char *argv[])
     param.argc = 1;
     param.argv = show_args;
 
+    res = icli_register_command(&param, &show);
+    if (res) {
+        fprintf(stderr, "Unable to register command: %s\n", param.name);
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.help = "Show sizes of output of show commands";
+    param.name = "sizes";
+    param.command = cli_sizes;
+
+    res = icli_register_command(&param, NULL);
+    if (res) {
+        fprintf(stderr, "Unable to register command: %s\n", param.name);
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.help = "Print text";
+    param.name = "echo";
+    param.command = cli_echo;
+    param.argc = 1;
+    param.argv = echo_args;
+
+    res = icli_register_command(&param, NULL);
+    if (res) {
+        fprintf(stderr, "Unable to register command: %s\n", param.name);
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.help = "Add or delete route";
+    param.name = "route";
+    param.command = cli_route;
+    param.argc = ICLI_ARGS_DYNAMIC;
+    param.grammar = "(add | del) <prefix> [via <gateway:ipv4> | dev <interface>] [metric <metric:int>]";
+
+    res = icli_register_command(&param, NULL);
+    if (res) {
+        fprintf(stderr, "Unable to register command: %s\n", param.name);
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.help = "Count lines of output of a command";
+    param.name = "wc";
+    param.command = cli_wc;
+    param.argc = ICLI_ARGS_DYNAMIC;
+    param.grammar = "<command>...";
+
+    res = icli_register_command(&param, NULL);
+    if (res) {
+        fprintf(stderr, "Unable to register command: %s\n", param.name);
+        ret = EXIT_FAILURE;
+        goto out;
+    }
+
+    memset(&param, 0, sizeof(param));
+    param.help = "Load or unload diagnostics plugin";
+    param.name = "plugin";
+    param.command = cli_plugin;
+    param.argc = 1;
+    param.argv = plugin_args;
+
     res = icli_register_command(&param, NULL);
     if (res) {
         fprintf(stderr, "Unable to register command: %s\n", param.name);
@@ -253,7 +730,7 @@ int main(int argc, char *argv[])
     param.help = "Set interface";
     param.name = "interface";
     param.short_name = "intf";
-    param.command = cli_interface;
+    param.typed_command = cli_interface;
     param.argc = 1;
     param.argv = intf_args;
 
@@ -313,13 +790,58 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    /* control server for automation */
+    if (3 == argc && strcmp(argv[1], "--listen") == 0) {
+        ret = run_server(argv[2], 0);
+        goto out;
+    }
+
+    /* interactive sessions of icli-attach */
+    if (3 == argc && strcmp(argv[1], "--sessions") == 0) {
+        ret = run_server(argv[2], 1);
+        goto out;
+    }
+
+    /* one-shot execution of a command given on command line */
+    if (argc > 1) {
+        ret = icli_main(argc, argv);
+        goto out;
+    }
+
     icli_commands_to_dot("cli.dot");
 
+    /* periodic notifications, to see them printed while typing */
+    pthread_t watcher;
+    long notify_ms = getenv("CLI_NOTIFY_MS") ? atol(getenv("CLI_NOTIFY_MS")) : 0;
+    int watching = notify_ms > 0 && pthread_create(&watcher, NULL, watch_services, &notify_ms) == 0;
+
+    /* commands changing while they are used */
+    pthread_t loader;
+    struct cli_prober prober = {.n_probes = getenv("CLI_PROBES") ? atol(getenv("CLI_PROBES")) : 0,
+                                .show = show,
+                                .show_args = show_args};
+    int loading = prober.n_probes > 0 && pthread_create(&loader, NULL, register_probes, &prober) == 0;
+
     icli_run();
 
+    __atomic_store_n(&stop_watch, 1, __ATOMIC_RELAXED);
+    if (watching)
+        pthread_join(watcher, NULL);
+    if (loading)
+        pthread_join(loader, NULL);
+
 out:
+    if (getenv("CLI_PHASE_STATS"))
+        print_phase_stats();
+
     fclose(context.log);
+    icli_value_set_put(cli_containers.set);
     icli_cleanup();
 
+    if (getenv("CLI_ALLOC_STATS"))
+        print_alloc_stats();
+    if (getenv("CLI_POOL"))
+        fprintf(stderr, "pool bytes in use %zu\n", pool.bytes);
+
     return ret;
 }
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2019 Iguazio.io Systems Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License") with
+ * an addition restriction as set forth herein. You may not use this
+ * file except in compliance with the License. You may obtain a copy of
+ * the License at http://www.apache.org/licenses/LICENSE-2.0.
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+ * implied. See the License for the specific language governing
+ * permissions and limitations under the License.
+ *
+ * In addition, you may not use the software for any purposes that are
+ * illegal under applicable law, and the grant of the foregoing license
+ * under the Apache 2.0 license is conditioned upon your compliance with
+ * such restriction.
+ */
+
+/*
+ * tree-bench - memory and lookup cost of a large command tree
+ *
+ * Registers FANOUT modes, each with FANOUT modes, each with FANOUT commands (1,010,100 commands by default), then
+ * executes lines selecting a random command through the three levels. Reports heap bytes per command, and time and
+ * cache misses (when the kernel allows counting them) per executed line.
+ *
+ * usage: tree-bench [fanout] [lines]
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <icli.h>
+
+static enum icli_ret bench_leaf(char *argv[], int argc, void *context)
+{
+    return ICLI_OK;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Open counter of CONFIG of TYPE for the calling thread, -1 if not permitted */
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr = {.type = type,
+                                   .size = sizeof(attr),
+                                   .config = config,
+                                   .disabled = 1,
+                                   .exclude_kernel = 1,
+                                   .exclude_hv = 1};
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_counter(int fd)
+{
+    uint64_t val = 0;
+
+    if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val))
+        return 0;
+    return val;
+}
+
+static int add_node(struct icli_command *parent, unsigned i, int leaf, struct icli_command **out)
+{
+    char name[16];
+    struct icli_command_params params = {.parent = parent,
+                                         .name = name,
+                                         .help = "Benchmark node",
+                                         .command = leaf ? bench_leaf : NULL};
+
+    snprintf(name, sizeof(name), "node%u", i);
+    return icli_register_command(&params, out);
+}
+
+int main(int argc, char *argv[])
+{
+    struct icli_params params = {.prompt = "bench", .app_name = "tree-bench"};
+    unsigned fanout = argc > 1 ? (unsigned)atoi(argv[1]) : 100;
+    unsigned lines = argc > 2 ? (unsigned)atoi(argv[2]) : 200000;
+    int l1d = open_counter(PERF_TYPE_HW_CACHE,
+                           PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                               PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    int llc = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    uint64_t n_nodes = 0, start, elapsed;
+    struct mallinfo2 before, after;
+    uint32_t seed = 1;
+    char line[64];
+
+    if (!fanout || !lines) {
+        fprintf(stderr, "Usage: %s [fanout] [lines]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (icli_init(&params)) {
+        fprintf(stderr, "Unable to init icli\n");
+        return EXIT_FAILURE;
+    }
+
+    before = mallinfo2();
+    start = now_ns();
+
+    for (unsigned i = 0; i < fanout; ++i) {
+        struct icli_command *mode;
+
+        if (add_node(NULL, i, 0, &mode))
+            goto err;
+        ++n_nodes;
+
+        for (unsigned j = 0; j < fanout; ++j) {
+            struct icli_command *submode;
+
+            if (add_node(mode, j, 0, &submode))
+                goto err;
+            ++n_nodes;
+
+            for (unsigned k = 0; k < fanout; ++k) {
+                if (add_node(submode, k, 1, NULL))
+                    goto err;
+                ++n_nodes;
+            }
+        }
+    }
+
+    elapsed = now_ns() - start;
+    after = mallinfo2();
+
+    printf("commands                 %10" PRIu64 "\n", n_nodes);
+    printf("registration             %10.1f ns/command\n", (double)elapsed / (double)n_nodes);
+    printf("heap                     %10.1f bytes/command\n",
+           (double)(after.uordblks - before.uordblks) / (double)n_nodes);
+
+    /* every line looks up a command at each of the three levels */
+    for (int pass = 0; pass < 2; ++pass) {
+        /* the first pass registers built-in commands of the modes it enters */
+        if (pass) {
+            if (l1d >= 0)
+                ioctl(l1d, PERF_EVENT_IOC_ENABLE, 0);
+            if (llc >= 0)
+                ioctl(llc, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        start = now_ns();
+
+        for (unsigned i = 0; i < lines; ++i) {
+            seed = seed * 1103515245 + 12345;
+            snprintf(line,
+                     sizeof(line),
+                     "node%u; node%u; node%u; end 2",
+                     (seed >> 8) % fanout,
+                     (seed >> 16) % fanout,
+                     (seed * 7 >> 12) % fanout);
+            if (icli_execute_line(line))
+                goto err;
+        }
+
+        elapsed = now_ns() - start;
+    }
+
+    if (l1d >= 0)
+        ioctl(l1d, PERF_EVENT_IOC_DISABLE, 0);
+    if (llc >= 0)
+        ioctl(llc, PERF_EVENT_IOC_DISABLE, 0);
+
+    printf("lookup line              %10.1f ns/line\n", (double)elapsed / lines);
+    if (l1d >= 0)
+        printf("L1D read misses          %10.1f /line\n", (double)read_counter(l1d) / lines);
+    if (llc >= 0)
+        printf("LLC misses               %10.1f /line\n", (double)read_counter(llc) / lines);
+    if (l1d < 0 && llc < 0)
+        printf("cache misses             %10s (perf events not permitted)\n", "n/a");
+
+    icli_cleanup();
+    return EXIT_SUCCESS;
+err:
+    fprintf(stderr, "Benchmark failed after %" PRIu64 " commands\n", n_nodes);
+    icli_cleanup();
+    return EXIT_FAILURE;
+}
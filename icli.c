@@ -18,10 +18,10 @@
  * such restriction.
  */
 
-#include "icli.h"
-
 #define _GNU_SOURCE
 
+#include "icli.h"
+
 #include <string.h>
 #include <ctype.h>
 #include <stdint.h>
@@ -32,6 +32,26 @@
 #include <sys/queue.h>
 #include <termios.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <inttypes.h>
+#include <regex.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <malloc.h>
 
 #include <editline/readline.h>
 
@@ -45,23 +65,286 @@
 #define ANSI_WHITE_NORMAL "\x1b[37m"
 #define ANSI_RESET "\x1b[0m"
 
+/* Entry of sorted index of names. KEY holds the first 4 bytes of the name, the first one most significant, so that
+   a binary search compares mostly keys without touching the names */
+struct icli_index_ent {
+    uint32_t key;
+    uint32_t off; /* offset of the name in the pool */
+};
+
+/* Immutable sorted index of names, used to resolve unique-prefix abbreviations with a binary search over contiguous
+   memory. Allocated as a single block: the entries, then values of the entries, then the names in sorted order. It is
+   replaced as a whole when the names change */
+struct icli_index {
+    struct icli_bktree *bk; /* suggestions for mistyped names, built on the first miss */
+    int n; /* number of names */
+    uint32_t pool_len; /* bytes of names stored so far */
+    struct icli_index_ent ents[];
+};
+
+/* Node of BK-tree, children of a node are linked through next */
+struct icli_bk_node {
+    const char *name;
+    unsigned dist; /* edit distance to the parent */
+    int child; /* index of the first child, -1 if none */
+    int next; /* index of the next sibling, -1 if none */
+};
+
+/* BK-tree over names of a trie, used to suggest names close to a mistyped one. Built on the first miss and
+   dropped whenever the names change. Immutable once published, so it is searched by concurrent readers */
+struct icli_bktree {
+    struct icli_bk_node *nodes;
+    int n_nodes;
+};
+
+/* Immutable values of a value set, replaced as a whole when the set is updated. Allocated as a single block: the
+   values terminated by NULL value, then their strings */
+struct icli_vals {
+    struct icli_index *index; /* values by name */
+    int n_vals;
+    struct icli_arg_val vals[];
+};
+
+/* Values of AT_Val and AT_Enum arguments, shared by the arguments referencing it */
+struct icli_value_set {
+    struct icli_vals *vals; /* published to readers */
+    int refs; /* changed with writer lock held */
+    bool shared; /* created by icli_value_set_create(), rather than copied from vals of a single argument */
+};
+
+/* Internal state of command argument prepared at registration */
+struct icli_arg_priv {
+    regex_t *regex; /* compiled regular expression of AT_Regex argument */
+    struct icli_value_set *set; /* values of AT_Val and AT_Enum argument, NULL if not provided */
+};
+
+/* Arguments of a command, published as a whole, so that readers see types and internal state of the same
+   arguments. Allocated as a single block: the structure, argv, then priv */
+struct icli_args {
+    int argc;
+    struct icli_arg *argv;
+    struct icli_arg_priv *priv;
+};
+
+/* Usage statistics of a command, used to rank completion candidates */
+struct icli_usage {
+    uint32_t count; /* number of executions */
+    uint32_t last; /* value of icli.usage_tick at the last execution */
+};
+
 /* A structure which contains information on the commands this program
    can understand. */
+/* Fields used to resolve and execute a command come first, so that a lookup touches a single cache line. Name, doc
+   and short name are allocated in the same block, after the command */
 struct icli_command {
-    LIST_ENTRY(icli_command) cmd_list_entry;
     char *name; /* User printable name of the function. */
-    char *short_name;
+    struct icli_index *names; /* index of names of cmd_list, NULL if empty */
     icli_cmd_func_t func; /* Function to call to do the job. */
-    char *doc; /* Documentation for this function.  */
-    LIST_HEAD(, icli_command) cmd_list;
-    size_t n_cmds;
+    icli_typed_cmd_func_t typed_func; /* Function to call with parsed arguments. */
+    struct icli_args *args; /* definitions of arguments, NULL if not provided. Replaced by icli_reset_arguments() */
     struct icli_command *parent;
     int argc;
-    struct icli_arg *argv;
-    int max_name_len;
     int name_len;
-    char *prompt_line;
     bool internal;
+    bool builtins_pending; /* built-in commands of the mode are registered on first lookup */
+    bool removed; /* unregistered, freed once no mode in its subtree is in use */
+    int mode_refs; /* number of users (the shell and sessions) in this mode or below it */
+    LIST_ENTRY(icli_command) cmd_list_entry;
+    LIST_HEAD(, icli_command) cmd_list;
+    size_t n_cmds;
+    int max_name_len;
+    char *short_name;
+    char *doc; /* Documentation for this function.  */
+    struct icli_grammar *grammar; /* arguments grammar of ICLI_ARGS_DYNAMIC command */
+    struct icli_usage usage;
+};
+
+/* Append-only history journal. Every history entry is appended to the history file as a single line when it is
+   added, so concurrent sessions merge their entries and nothing is lost on a crash. */
+struct icli_hist_journal {
+    int fd; /* history file opened for append, -1 if history is not saved */
+    int n_lines; /* (approximate) number of lines in the history file */
+    int n_unsynced; /* number of appends since last fdatasync() */
+    bool opened; /* opening was attempted, on first history addition */
+};
+
+/* Distinct history line with its usage statistics */
+struct icli_hist_entry {
+    char *mode; /* path of the mode the line was executed in, NULL for root */
+    char *line;
+    uint32_t count; /* how many times the line was added */
+    uint32_t last_seq; /* sequence number of the last addition */
+};
+
+/* Posting list of a trigram - ids of entries containing the trigram in increasing order */
+struct icli_hist_posting {
+    uint32_t gram; /* 0 for unused slot */
+    uint32_t n_ids;
+    uint32_t size;
+    uint32_t *ids;
+};
+
+/* Trigram index over distinct history lines */
+struct icli_hist_index {
+    struct icli_hist_entry *entries;
+    uint32_t n_entries;
+    uint32_t size;
+    uint32_t *lines; /* open addressing hash of line -> entry id + 1 */
+    uint32_t lines_size;
+    struct icli_hist_posting *grams; /* open addressing hash of trigram -> posting list */
+    uint32_t n_grams;
+    uint32_t grams_size;
+    uint32_t seq; /* sequence number of the last added line */
+    const char *search_mode; /* mode path entries of which are preferred by the current search */
+
+    /* state of reverse search key binding */
+    uint32_t *search_ids;
+    uint32_t n_search_ids;
+    uint32_t search_pos;
+};
+
+/* Context and candidates of the last completion */
+struct icli_completion_cache {
+    bool valid;
+    struct icli_command *mode; /* mode the completion was done in */
+    uint32_t tree_gen; /* icli.tree_gen at the time candidates were collected */
+    uint32_t usage_tick; /* icli.usage_tick at the time candidates were collected */
+    char *line; /* line preceding the completed word */
+    size_t line_len;
+    size_t line_size;
+    char *scratch; /* copy of line for parsing */
+    size_t scratch_size;
+    char *text; /* the completed word */
+    size_t text_len;
+    size_t text_size;
+    struct icli_command *cmd; /* command the arguments of which are completed, NULL for command names */
+    int arg; /* position of the completed argument */
+    bool file; /* argument is completed with file names */
+    const char **cands; /* candidates starting with text, in order they are returned */
+    size_t n_cands;
+    size_t size;
+    size_t pos; /* next candidate to return */
+};
+
+/* Growable string buffer */
+struct icli_strbuf {
+    char *data;
+    size_t len;
+    size_t size;
+    bool caller_owned; /* data is returned to the caller, so it is grown with realloc() */
+};
+
+/* Maximal number of rows, and maximal size of rows, used to measure widths of text table columns */
+#define ICLI_TABLE_SAMPLE_ROWS 64
+#define ICLI_TABLE_SAMPLE_SIZE 16384
+/* Maximal number of columns of text table which are aligned */
+#define ICLI_TABLE_COLS_MAX 32
+
+/* State of text table renderer */
+struct icli_text_table {
+    bool exact; /* rows beyond the sample window are spilled to a temporary file until widths of all rows are known */
+    bool streaming; /* widths are fixed and rows are printed as they come */
+    int widths[ICLI_TABLE_COLS_MAX];
+    char *sample; /* rows held back until widths are measured, cells are NUL terminated */
+    size_t sample_len;
+    int n_sample;
+    FILE *spill;
+};
+
+/* Size of stdout buffer when stdout is not a terminal */
+#define ICLI_OUT_BUFFER_SIZE (64 * 1024)
+
+/* Default size of audit ring buffer */
+#define ICLI_AUDIT_BUFFER_SIZE (64 * 1024)
+
+/* Audit log writer. Output is pushed to a single producer / single consumer ring buffer without locking, and written
+   to the file by a background thread. The thread sleeps on eventfd when the ring is empty, it is woken up only if it
+   announced that it is going to sleep. */
+struct icli_audit {
+    bool running;
+    int fd; /* audit file, -1 if not opened */
+    int efd; /* eventfd used to wake up the writer, -1 if not opened */
+    pthread_t thread;
+    char *ring;
+    size_t size; /* power of 2 */
+    size_t head; /* total bytes pushed, written by producer only */
+    size_t tail; /* total bytes written to the file, written by writer only */
+    size_t dropped; /* bytes dropped since last report because the ring was full */
+    int waiting; /* writer is going to sleep */
+    int stop;
+};
+
+/* Maximal number of notifications waiting to be printed, further notifications are dropped */
+#define ICLI_NOTIFY_QUEUE_MAX 1024
+/* Maximal number of notifications printed at once, the rest of a burst is summarized in a single line */
+#define ICLI_NOTIFY_BURST 16
+
+/* Notification queued by icli_notify() */
+struct icli_notice {
+    struct icli_notice *next;
+    char text[];
+};
+
+/* Notifications pushed by any thread to a lock-free stack, which is taken as a whole by the interactive thread. The
+   interactive thread is woken up through eventfd only by the first notification pushed after it took the stack */
+struct icli_notify {
+    int efd; /* eventfd polled by the interactive thread, -1 if not opened */
+    struct icli_notice *head; /* the most recent notification */
+    uint32_t pending; /* notifications in the stack */
+    uint32_t dropped; /* notifications dropped since last drain because the stack was full */
+    int signaled; /* efd was written since last drain */
+};
+
+/* Structured output of the current command */
+struct icli_table {
+    bool active;
+    const struct icli_renderer *renderer;
+    const struct icli_column *cols;
+    int n_cols;
+};
+
+/* Maximal number of threads reading commands at the same time without locking */
+#define ICLI_READERS_MAX 64
+
+/* Thread reading commands, padded to a cache line */
+struct icli_reader {
+    uint64_t epoch; /* global epoch when the reader started reading, 0 if not reading */
+    int used; /* slot is taken by a thread */
+    char pad[64 - sizeof(uint64_t) - sizeof(int)];
+};
+
+/* Memory unlinked from commands, freed once no reader may still use it */
+struct icli_retired {
+    struct icli_retired *next;
+    uint64_t epoch; /* global epoch when the memory was unlinked */
+    void (*free)(void *ptr);
+    void *ptr;
+};
+
+/* Epoch based reclamation of commands. Readers never block - they only announce the epoch they started reading in.
+   Writers, serialized by lock, publish copies of the nodes and arrays they change, and retire the originals. Retired
+   memory is freed once every reader that could see it has finished reading. */
+struct icli_rcu {
+    pthread_mutex_t lock; /* serializes writers. Recursive, so that commands can register commands */
+    bool lock_ready;
+    bool draining; /* everything is freed at cleanup */
+    uint64_t epoch;
+    struct icli_reader readers[ICLI_READERS_MAX];
+    struct icli_retired *retired; /* the most recently retired first */
+};
+
+/* Mode entered by a user, below root */
+struct icli_mode_level {
+    struct icli_command *mode;
+    char *text; /* shown in prompt instead of mode name, with arguments the mode was entered with. NULL for name */
+};
+
+/* Modes entered by a user (the shell or a client of server), from the one below root to the current mode. Kept
+   apart from commands, so that each user sees arguments of its own modes */
+struct icli_mode_stack {
+    struct icli_mode_level *levels;
+    int depth;
+    int size;
 };
 
 struct icli {
@@ -70,18 +353,49 @@ struct icli {
     bool done;
     struct icli_command *root_cmd;
     struct icli_command *curr_cmd;
+    struct icli_mode_stack modes; /* modes entered by the shell, up to curr_cmd */
     char *curr_prompt;
     const char *prompt;
     const char *hist_file;
+    int history_size;
+    struct icli_hist_journal journal;
+    struct icli_hist_index hist_index;
+    bool hist_indexed; /* history file was loaded into hist_index */
     int rows;
     int cols;
     int curr_row;
     bool skip_output;
+    bool interactive; /* stdin is a terminal - lines are read with readline */
+    bool rl_ready; /* readline and history were set up by icli_run() */
+    char *app_name;
+    bool paging; /* stdin and stdout are terminals - output is paged */
+    bool color; /* stdout is a terminal - errors are colored */
+    bool batch; /* lines are read from non-terminal stdin by icli_run_batch(), which flushes the output */
 
     bool error_printed;
-
-    struct icli_command *curr_completion_cmd;
-    int curr_completion_arg;
+    enum icli_ret cmd_ret; /* result of the last executed command */
+
+    struct icli_completion_cache completion;
+
+    uint32_t usage_tick; /* number of commands executed */
+    struct icli_renderer *renderers; /* renderers of structured output */
+    int n_renderers;
+    int format; /* index of renderer used by default */
+    int cmd_format; /* index of renderer selected by the current command, -1 if not selected */
+    struct icli_table table;
+    struct icli_strbuf row; /* row rendered by built-in renderers */
+    struct icli_text_table text_tables[2]; /* state of "text" and "table" renderers */
+    struct icli_sink *sink; /* destination of output of icli_execute_capture(), NULL for terminal */
+    bool sink_failed; /* captured output was lost */
+    struct icli_strbuf sink_buf; /* formatting buffer of output passed to sink writers */
+    icli_write_hook_t out_write_hook;
+    icli_write_hook_t err_write_hook;
+    struct icli_strbuf out_buf; /* formatting buffer of output passed to write hooks and audit log */
+    struct icli_audit audit;
+    struct icli_notify notify;
+    uint32_t tree_gen; /* incremented on every change of commands or their arguments */
+    struct icli_rcu rcu;
+    struct icli_phase_stats phases[ICLI_PHASE_MAX]; /* cost of start up phases */
 
     icli_cmd_hook_t cmd_hook;
     icli_output_hook_t out_hook;
@@ -90,8 +404,261 @@ struct icli {
 
 static struct icli icli;
 
+/* Allocator of all internal memory, with counters of its calls. Kept apart from icli, so that the counters still tell
+   about leaks after icli_cleanup() */
+static struct {
+    struct icli_allocator hooks; /* callbacks are NULL for malloc() */
+    struct icli_alloc_stats stats;
+    struct icli_mem_stats categories[ICLI_MEM_MAX];
+} icli_mem;
+
+static const char *const icli_mem_names[ICLI_MEM_MAX] = {[ICLI_MEM_COMMANDS] = "commands",
+                                                         [ICLI_MEM_ARGUMENTS] = "arguments",
+                                                         [ICLI_MEM_PROMPTS] = "prompts",
+                                                         [ICLI_MEM_HISTORY] = "history",
+                                                         [ICLI_MEM_COMPLETION] = "completion",
+                                                         [ICLI_MEM_BUFFERS] = "buffers",
+                                                         [ICLI_MEM_SERVERS] = "servers",
+                                                         [ICLI_MEM_OTHER] = "other"};
+
+/* Header of every allocation, so that it can be accounted to its category when it is freed */
+struct icli_mem_hdr {
+    uint64_t size; /* bytes requested, including the header */
+    uint32_t category;
+    uint32_t pad; /* keeps the alignment of malloc() */
+};
+
+/* Account allocation of PTR (of USABLE bytes, when known), replacing OLD_USABLE bytes if REALLOCATED */
+static void icli_mem_count(void *ptr, size_t usable, size_t old_usable, bool reallocated)
+{
+    struct icli_alloc_stats *stats = &icli_mem.stats;
+
+    if (!ptr) {
+        __atomic_add_fetch(&stats->failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(reallocated ? &stats->reallocs : &stats->allocs, 1, __ATOMIC_RELAXED);
+    if (usable != old_usable) {
+        uint64_t bytes = __atomic_add_fetch(&stats->bytes, usable - old_usable, __ATOMIC_RELAXED);
+        uint64_t peak = __atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED);
+
+        while (bytes > peak &&
+               !__atomic_compare_exchange_n(&stats->peak_bytes, &peak, bytes, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+/* Account HDR (NULL on failure) to its category, replacing OLD_SIZE bytes if REALLOCATED */
+static void *icli_mem_account(struct icli_mem_hdr *hdr, uint64_t old_size, bool reallocated)
+{
+    struct icli_mem_stats *stats;
+
+    if (!hdr)
+        return NULL;
+
+    stats = &icli_mem.categories[hdr->category];
+    if (!reallocated)
+        __atomic_add_fetch(&stats->objects, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytes, hdr->size - old_size, __ATOMIC_RELAXED);
+
+    return hdr + 1;
+}
+
+static struct icli_mem_hdr *icli_mem_hdr(const void *ptr)
+{
+    return (struct icli_mem_hdr *)ptr - 1;
+}
+
+/* Bytes of allocation PTR, including its header */
+static uint64_t icli_mem_size(const void *ptr)
+{
+    return ptr ? icli_mem_hdr(ptr)->size : 0;
+}
+
+static void *icli_malloc(enum icli_mem_category category, size_t size)
+{
+    struct icli_mem_hdr *hdr;
+
+    if (size > SIZE_MAX - sizeof(*hdr)) {
+        __atomic_add_fetch(&icli_mem.stats.failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    size += sizeof(*hdr);
+
+    if (icli_mem.hooks.malloc) {
+        hdr = icli_mem.hooks.malloc(size, icli_mem.hooks.ctx);
+        icli_mem_count(hdr, 0, 0, false);
+    } else {
+        hdr = malloc(size);
+        icli_mem_count(hdr, hdr ? malloc_usable_size(hdr) : 0, 0, false);
+    }
+
+    if (hdr)
+        *hdr = (struct icli_mem_hdr){.size = size, .category = category};
+    return icli_mem_account(hdr, 0, false);
+}
+
+static void *icli_calloc(enum icli_mem_category category, size_t n, size_t size)
+{
+    void *ptr;
+
+    if (size && n > SIZE_MAX / size) {
+        __atomic_add_fetch(&icli_mem.stats.failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    ptr = icli_malloc(category, n * size);
+    if (ptr)
+        memset(ptr, 0, n * size);
+    return ptr;
+}
+
+/* Resize PTR, which keeps its category. CATEGORY is used if PTR is NULL */
+static void *icli_realloc(enum icli_mem_category category, void *ptr, size_t size)
+{
+    struct icli_mem_hdr *hdr, *old_hdr;
+    size_t old_usable = 0;
+    uint64_t old_size;
+
+    if (!ptr)
+        return icli_malloc(category, size);
+
+    if (size > SIZE_MAX - sizeof(*hdr)) {
+        __atomic_add_fetch(&icli_mem.stats.failures, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    size += sizeof(*hdr);
+
+    old_hdr = icli_mem_hdr(ptr);
+    old_size = old_hdr->size;
+
+    if (icli_mem.hooks.realloc) {
+        hdr = icli_mem.hooks.realloc(old_hdr, size, icli_mem.hooks.ctx);
+        icli_mem_count(hdr, 0, 0, true);
+    } else {
+        old_usable = malloc_usable_size(old_hdr);
+        hdr = realloc(old_hdr, size);
+        icli_mem_count(hdr, hdr ? malloc_usable_size(hdr) : 0, hdr ? old_usable : 0, true);
+    }
+
+    if (hdr)
+        hdr->size = size;
+    return icli_mem_account(hdr, old_size, true);
+}
+
+static void icli_free(void *ptr)
+{
+    struct icli_mem_hdr *hdr;
+    struct icli_mem_stats *stats;
+
+    if (!ptr)
+        return;
+
+    hdr = icli_mem_hdr(ptr);
+    stats = &icli_mem.categories[hdr->category];
+    __atomic_sub_fetch(&stats->objects, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats->bytes, hdr->size, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&icli_mem.stats.frees, 1, __ATOMIC_RELAXED);
+    if (icli_mem.hooks.free) {
+        icli_mem.hooks.free(hdr, icli_mem.hooks.ctx);
+    } else {
+        __atomic_sub_fetch(&icli_mem.stats.bytes, malloc_usable_size(hdr), __ATOMIC_RELAXED);
+        free(hdr);
+    }
+}
+
+static char *icli_strndup(enum icli_mem_category category, const char *str, size_t n)
+{
+    size_t len = strnlen(str, n);
+    char *copy = icli_malloc(category, len + 1);
+
+    if (copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static char *icli_strdup(enum icli_mem_category category, const char *str)
+{
+    return icli_strndup(category, str, SIZE_MAX);
+}
+
+/* getdelim() into a buffer of the icli allocator */
+static ssize_t icli_getdelim(char **line, size_t *size, int delim, FILE *file)
+{
+    size_t len = 0;
+    int c = EOF;
+
+    flockfile(file);
+    while (len < SSIZE_MAX) {
+        if (len + 2 > *size) {
+            size_t new_size = *size ? *size * 2 : 128;
+            char *data = icli_realloc(ICLI_MEM_BUFFERS, *line, new_size);
+
+            if (!data) {
+                len = 0;
+                errno = ENOMEM;
+                break;
+            }
+            *line = data;
+            *size = new_size;
+        }
+
+        c = getc_unlocked(file);
+        if (EOF == c)
+            break;
+
+        (*line)[len++] = (char)c;
+        if (c == delim)
+            break;
+    }
+    funlockfile(file);
+
+    if (!len)
+        return -1;
+
+    (*line)[len] = '\0';
+    return (ssize_t)len;
+}
+
+static const char *const icli_phase_names[ICLI_PHASE_MAX] = {[ICLI_PHASE_INIT] = "init",
+                                                             [ICLI_PHASE_READLINE] = "readline",
+                                                             [ICLI_PHASE_HISTORY] = "history",
+                                                             [ICLI_PHASE_HISTORY_INDEX] = "history index",
+                                                             [ICLI_PHASE_HISTORY_JOURNAL] = "history journal",
+                                                             [ICLI_PHASE_BUILTINS] = "built-in commands",
+                                                             [ICLI_PHASE_TERMINAL] = "terminal"};
+
+static uint64_t icli_clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Account time since START, as returned by icli_clock_ns(), to PHASE */
+static void icli_phase_done(enum icli_phase phase, uint64_t start)
+{
+    icli.phases[phase].nsec += icli_clock_ns() - start;
+    ++icli.phases[phase].count;
+}
+
+/* Separators between commands in a single line */
+enum icli_separator {
+    SEP_END, /* end of line */
+    SEP_SEQ, /* ';' - run next command regardless of the result */
+    SEP_AND /* '&&' - run next command only if previous succeeded */
+};
+
 #define array_len(_array) (sizeof(_array) / sizeof((_array)[0]))
 
+/* Maximal length of mode path recorded in history */
+#define ICLI_MODE_PATH_MAX 1024
+
 #define UNUSED __attribute__((__unused__))
 
 void icli_api_printf(const char *format, ...) __attribute__((__format__(__printf__, 1, 2)));
@@ -126,425 +693,5083 @@ void icli_api_printf(const char *format, ...)
     va_end(args);
 }
 
-/* Look up NAME as the name of a command, and return a pointer to that
-   command.  Return a NULL pointer if NAME isn't a command name. */
-static struct icli_command *icli_find_command(char *name)
+/* Slot of the calling thread in icli.rcu.readers, -1 if it reads under writer lock */
+static __thread int icli_reader_slot = -1;
+/* Nesting of read sections of the calling thread - commands may execute commands */
+static __thread int icli_read_depth;
+
+/* Start reading commands. Commands, names and arguments seen until icli_read_unlock() are not freed */
+static void icli_read_lock(void)
 {
-    struct icli_command *it;
+    struct icli_rcu *rcu = &icli.rcu;
 
-    LIST_FOREACH(it, &icli.curr_cmd->cmd_list, cmd_list_entry)
-    {
-        if (strcmp(name, it->name) == 0)
-            return it;
+    if (icli_read_depth++)
+        return;
+
+    for (int i = 0; i < ICLI_READERS_MAX; ++i) {
+        int slot = (icli_reader_slot + 1 + i) % ICLI_READERS_MAX;
+        struct icli_reader *reader = &rcu->readers[slot];
+        int unused = 0;
+
+        if (__atomic_compare_exchange_n(&reader->used, &unused, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&reader->epoch, __atomic_load_n(&rcu->epoch, __ATOMIC_RELAXED), __ATOMIC_SEQ_CST);
+            /* pairs with writers scanning readers after unlinking */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            icli_reader_slot = slot;
+            return;
+        }
     }
 
-    return ((struct icli_command *)NULL);
+    /* more readers than slots */
+    pthread_mutex_lock(&rcu->lock);
+    icli_reader_slot = -1;
 }
 
-static void icli_cat_command(struct icli_command *curr)
+static void icli_rcu_reclaim(void);
+
+static void icli_read_unlock(void)
 {
-    if (!curr->parent)
+    struct icli_rcu *rcu = &icli.rcu;
+
+    if (--icli_read_depth)
         return;
 
-    icli_cat_command(curr->parent);
+    if (icli_reader_slot < 0) {
+        icli_rcu_reclaim();
+        pthread_mutex_unlock(&rcu->lock);
+        return;
+    }
 
-    if (curr->name) {
-        strcat(icli.curr_prompt, "(");
+    __atomic_store_n(&rcu->readers[icli_reader_slot].epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rcu->readers[icli_reader_slot].used, 0, __ATOMIC_RELEASE);
 
-        if (curr->prompt_line) {
-            strcat(icli.curr_prompt, curr->prompt_line);
-        } else if (curr->short_name) {
-            strcat(icli.curr_prompt, curr->short_name);
-        } else if (curr->name) {
-            strcat(icli.curr_prompt, curr->name);
-        }
-        strcat(icli.curr_prompt, ")");
+    /* free memory retired while we were reading, unless a writer is going to */
+    if (__atomic_load_n(&rcu->retired, __ATOMIC_RELAXED) && pthread_mutex_trylock(&rcu->lock) == 0) {
+        icli_rcu_reclaim();
+        pthread_mutex_unlock(&rcu->lock);
     }
 }
 
-static void icli_build_prompt(struct icli_command *command)
+static void icli_write_lock(void)
+{
+    pthread_mutex_lock(&icli.rcu.lock);
+}
+
+/* Finish changing commands, and free retired memory readers can no longer see */
+static void icli_write_unlock(void)
 {
-    /*'\0' + prompt + '>' + ' ' */
-    size_t buf_sz = 1 + strlen(icli.prompt) + 2;
+    __atomic_add_fetch(&icli.rcu.epoch, 1, __ATOMIC_SEQ_CST);
+    icli_rcu_reclaim();
+    pthread_mutex_unlock(&icli.rcu.lock);
+}
 
-    struct icli_command *curr = command;
-    while (curr) {
-        if (curr->prompt_line) {
-            /*command + '(' + ')' */
-            buf_sz += 2 + strlen(curr->prompt_line);
-        } else if (curr->short_name) {
-            /*command + '(' + ')' */
-            buf_sz += 2 + strlen(curr->short_name);
-        } else if (curr->name) {
-            /*command + '(' + ')' */
-            buf_sz += 2 + strlen(curr->name);
-        }
-        curr = curr->parent;
+/* Free PTR with FREE once no reader may use it. PTR must be already unlinked. Called with writer lock held */
+static void icli_rcu_retire(void (*free_ptr)(void *ptr), void *ptr)
+{
+    struct icli_rcu *rcu = &icli.rcu;
+    struct icli_retired *retired;
+
+    if (!ptr)
+        return;
+
+    retired = icli_malloc(ICLI_MEM_OTHER, sizeof(*retired));
+    if (!retired) {
+        /* can't tell when it is safe to free */
+        icli_api_printf("Unable to allocate memory to retire %p, leaking it\n", ptr);
+        return;
     }
 
-    free((void *)icli.curr_prompt);
-    icli.curr_prompt = malloc(buf_sz);
+    retired->epoch = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST);
+    retired->free = free_ptr;
+    retired->ptr = ptr;
+    retired->next = rcu->retired;
+    __atomic_store_n(&rcu->retired, retired, __ATOMIC_RELAXED);
+}
 
-    strncpy(icli.curr_prompt, icli.prompt, buf_sz);
-    icli_cat_command(command);
+static int icli_rcu_init(void)
+{
+    pthread_mutexattr_t attr;
+    int err;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    err = pthread_mutex_init(&icli.rcu.lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (err) {
+        icli_api_printf("Unable to initialize commands lock (%s)\n", strerror(err));
+        return -1;
+    }
 
-    strcat(icli.curr_prompt, "> ");
+    icli.rcu.lock_ready = true;
+    icli.rcu.epoch = 1;
+    return 0;
 }
 
-static int icli_parse_line(char *line, char **cmd, char *argv[], int argc)
+/* Free all retired memory. Called when no thread reads commands anymore */
+static void icli_rcu_cleanup(void)
 {
-    int n_args = 0;
-    int i = 0;
-    char *tmp;
+    struct icli_rcu *rcu = &icli.rcu;
 
-    /* Isolate the command word. */
-    while (line[i] && isspace(line[i]))
-        i++;
-    tmp = &line[i];
+    rcu->draining = true;
+    while (rcu->retired) {
+        struct icli_retired *it = rcu->retired;
 
-    while (line[i] && !isspace(line[i]))
-        i++;
+        rcu->retired = it->next;
+        it->free(it->ptr);
+        icli_free(it);
+    }
 
-    if (line[i])
-        line[i++] = '\0';
+    if (rcu->lock_ready) {
+        pthread_mutex_destroy(&rcu->lock);
+        rcu->lock_ready = false;
+    }
+}
 
-    *cmd = tmp;
+/* Free retired memory older than the epochs of all readers. Called with writer lock held */
+static void icli_rcu_reclaim(void)
+{
+    struct icli_rcu *rcu = &icli.rcu;
+    struct icli_retired **link = &rcu->retired;
+    struct icli_retired *it;
+    uint64_t min = UINT64_MAX;
 
-    /* Get argument to command, if any. */
-    while (line[i]) {
-        while (isspace(line[i]))
-            i++;
+    if (!*link)
+        return;
 
-        if (line[i] && n_args < argc) {
-            argv[n_args++] = &line[i];
-        }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < ICLI_READERS_MAX; ++i) {
+        uint64_t epoch = __atomic_load_n(&rcu->readers[i].epoch, __ATOMIC_SEQ_CST);
 
-        while (line[i] && !isspace(line[i]))
-            i++;
+        if (epoch && epoch < min)
+            min = epoch;
+    }
 
-        if (line[i])
-            line[i++] = '\0';
+    /* the list is ordered from the newest to the oldest */
+    while (*link && (*link)->epoch >= min)
+        link = &(*link)->next;
+
+    it = *link;
+    *link = NULL;
+
+    while (it) {
+        struct icli_retired *next = it->next;
+
+        it->free(it->ptr);
+        icli_free(it);
+        it = next;
     }
+}
 
-    return n_args;
+static void **icli_index_values(const struct icli_index *index, int size)
+{
+    return (void **)&index->ents[size];
 }
 
-static int icli_set_command_prompt(struct icli_command *cmd, char *argv[], int argc)
+static char *icli_index_pool(const struct icli_index *index, int size)
 {
-    size_t bufsz = 1;
-    const char *name = NULL;
+    return (char *)&icli_index_values(index, size)[size];
+}
 
-    free(cmd->prompt_line);
-    cmd->prompt_line = NULL;
+/* Allocate index of SIZE names of POOL_SIZE bytes (including terminators), accounted to CATEGORY. The index is used
+   once all SIZE names are appended with icli_index_append() */
+static struct icli_index *icli_index_alloc(enum icli_mem_category category, int size, size_t pool_size)
+{
+    size_t bytes = sizeof(struct icli_index) + (size_t)size * (sizeof(struct icli_index_ent) + sizeof(void *));
 
-    if (cmd->short_name) {
-        bufsz += strlen(cmd->short_name);
-        name = cmd->short_name;
-    } else if (cmd->name) {
-        bufsz += strlen(cmd->name);
-        name = cmd->name;
-    }
+    if (pool_size > UINT32_MAX)
+        return NULL;
 
-    for (int i = 0; i < argc; ++i) {
-        bufsz += strlen(argv[i]) + 1;
-    }
+    return icli_calloc(category, 1, bytes + pool_size);
+}
 
-    cmd->prompt_line = malloc(bufsz);
-    if (!cmd->prompt_line)
-        return -1;
+static uint32_t icli_index_key(const char *name, size_t len)
+{
+    uint32_t key = 0;
 
-    strcpy(cmd->prompt_line, name);
-    for (int i = 0; i < argc; ++i) {
-        strcat(cmd->prompt_line, " ");
-        strcat(cmd->prompt_line, argv[i]);
-    }
+    for (size_t i = 0; i < 4; ++i)
+        key = key << 8 | (i < len ? (unsigned char)name[i] : 0);
 
-    return 0;
+    return key;
 }
 
-static void icli_print_command_help(struct icli_command *cmd)
+/* Append NAME (copied) with VALUE to INDEX of SIZE names. Names must be appended in sorted order */
+static void icli_index_append(struct icli_index *index, int size, const char *name, void *value)
 {
-    icli_printf("%s    %s\n", cmd->name, cmd->doc);
+    char *pool = icli_index_pool(index, size) + index->pool_len;
+    size_t len = strlen(name);
 
-    icli_printf("Arguments:\n");
+    index->ents[index->n].key = icli_index_key(name, len);
+    index->ents[index->n].off = index->pool_len;
+    icli_index_values(index, size)[index->n++] = value;
 
-    if (cmd->argc > 0) {
-        for (int i = 0; i < cmd->argc; ++i) {
-            icli_printf("---------------------------------------------------------------\n");
-            if (cmd->argv) {
-                switch (cmd->argv[i].type) {
-                case AT_Val:
-                    if (cmd->argv[i].help)
-                        icli_printf("%s\n", cmd->argv[i].help);
-                    for (struct icli_arg_val *vals = cmd->argv[i].vals; vals && vals->val; ++vals) {
-                        if (vals->help)
-                            icli_printf("%s (%s)\n", vals->val, vals->help);
-                        else
-                            icli_printf("%s\n", vals->val);
-                    }
-                    break;
+    memcpy(pool, name, len + 1);
+    index->pool_len += (uint32_t)len + 1;
+}
 
-                case AT_File:
-                    if (cmd->argv[i].help)
-                        icli_printf("filename (%s)\n", cmd->argv[i].help);
-                    else
-                        icli_printf("filename\n");
+static const char *icli_index_name(const struct icli_index *index, int i)
+{
+    return icli_index_pool(index, index->n) + index->ents[i].off;
+}
+
+/* Compare the first LEN bytes of the name of entry I of INDEX with PREFIX, the key of which is KEY under MASK */
+static int icli_index_cmp(const struct icli_index *index,
+                          int i,
+                          const char *prefix,
+                          size_t len,
+                          uint32_t key,
+                          uint32_t mask)
+{
+    uint32_t ent_key = index->ents[i].key & mask;
+
+    if (ent_key != key)
+        return ent_key < key ? -1 : 1;
+    if (len <= 4)
+        return 0;
+
+    return strncmp(icli_index_name(index, i) + 4, prefix + 4, len - 4);
+}
+
+/* Find the range [LO, HI) of names of INDEX starting with PREFIX */
+static void icli_index_range(const struct icli_index *index, const char *prefix, int *lo, int *hi)
+{
+    size_t len = strlen(prefix);
+    uint32_t mask = len >= 4 ? UINT32_MAX : len ? UINT32_MAX << (8 * (4 - len)) : 0;
+    uint32_t key = icli_index_key(prefix, len);
+    int l = 0, h = index->n;
+
+    while (l < h) {
+        int mid = (l + h) / 2;
+
+        if (icli_index_cmp(index, mid, prefix, len, key, mask) < 0)
+            l = mid + 1;
+        else
+            h = mid;
+    }
+    *lo = l;
+
+    for (h = index->n; l < h;) {
+        int mid = (l + h) / 2;
+
+        if (icli_index_cmp(index, mid, prefix, len, key, mask) <= 0)
+            l = mid + 1;
+        else
+            h = mid;
+    }
+    *hi = l;
+}
+
+/* Return position of NAME in INDEX, -1 if not found */
+static int icli_index_find(const struct icli_index *index, const char *name)
+{
+    int lo, hi;
+
+    icli_index_range(index, name, &lo, &hi);
+    return lo < hi && strcmp(icli_index_name(index, lo), name) == 0 ? lo : -1;
+}
+
+/* Resolve PREFIX to a single name: the name equal to PREFIX, or the only name starting with PREFIX.
+   Return the number of candidates (1 if resolved, in which case VALUE is set) */
+static int icli_index_lookup(const struct icli_index *index, const char *prefix, void **value)
+{
+    int lo, hi;
+
+    if (!index)
+        return 0;
+
+    icli_index_range(index, prefix, &lo, &hi);
+
+    /* the name equal to the prefix sorts first among the names starting with it */
+    if (hi - lo == 1 || (lo < hi && strcmp(icli_index_name(index, lo), prefix) == 0)) {
+        *value = icli_index_values(index, index->n)[lo];
+        return 1;
+    }
+
+    return hi - lo;
+}
+
+/* Print space-prefixed names starting with PREFIX into BUF, in lexicographical order */
+static void icli_index_list(const struct icli_index *index, const char *prefix, char *buf, size_t size)
+{
+    size_t len = 0;
+    int lo, hi;
+
+    *buf = '\0';
+    if (!index)
+        return;
+
+    icli_index_range(index, prefix, &lo, &hi);
+    for (int i = lo; i < hi && len < size; ++i) {
+        int ret = snprintf(buf + len, size - len, " %s", icli_index_name(index, i));
+        if (ret > 0)
+            len += (size_t)ret;
+    }
+}
+
+/* Return copy of INDEX (which may be NULL) with NAME inserted, or with entry SKIP removed if NAME is NULL */
+static struct icli_index *icli_index_copy(const struct icli_index *index, const char *name, void *value, int skip)
+{
+    int n = index ? index->n : 0;
+    int size = name ? n + 1 : n - 1;
+    size_t pool_size = index ? index->pool_len : 0;
+    struct icli_index *copy;
+    int pos = n, end;
+
+    if (name) {
+        pool_size += strlen(name) + 1;
+        if (index)
+            icli_index_range(index, name, &pos, &end);
+    } else {
+        pool_size -= strlen(icli_index_name(index, skip)) + 1;
+    }
+
+    copy = icli_index_alloc(ICLI_MEM_COMMANDS, size, pool_size);
+    if (!copy)
+        return NULL;
+
+    for (int i = 0; i <= n; ++i) {
+        if (name && i == pos)
+            icli_index_append(copy, size, name, value);
+        if (i < n && i != skip)
+            icli_index_append(copy, size, icli_index_name(index, i), icli_index_values(index, n)[i]);
+    }
+
+    return copy;
+}
+
+static int icli_index_val_cmp(const void *a, const void *b)
+{
+    const struct icli_arg_val *const *va = a, *const *vb = b;
+    int ret = strcmp((*va)->val, (*vb)->val);
+
+    /* duplicates keep their order, so that the last one wins */
+    if (!ret)
+        ret = *va < *vb ? -1 : 1;
+    return ret;
+}
+
+/* Return index of N_VALS VALS, mapping names to the values */
+static struct icli_index *icli_index_vals(struct icli_arg_val *vals, int n_vals)
+{
+    struct icli_arg_val **sorted = icli_malloc(ICLI_MEM_ARGUMENTS, (size_t)n_vals * sizeof(*sorted));
+    struct icli_index *index = NULL;
+    size_t pool_size = 0;
+    int size = 0;
+
+    if (!sorted)
+        return NULL;
+
+    for (int i = 0; i < n_vals; ++i)
+        sorted[i] = &vals[i];
+    qsort(sorted, (size_t)n_vals, sizeof(*sorted), icli_index_val_cmp);
+
+    for (int i = 0; i < n_vals; ++i) {
+        if (i + 1 < n_vals && !strcmp(sorted[i]->val, sorted[i + 1]->val))
+            continue;
+        pool_size += strlen(sorted[i]->val) + 1;
+        ++size;
+    }
+
+    index = icli_index_alloc(ICLI_MEM_ARGUMENTS, size, pool_size);
+    if (index) {
+        for (int i = 0; i < n_vals; ++i) {
+            if (i + 1 < n_vals && !strcmp(sorted[i]->val, sorted[i + 1]->val))
+                continue;
+            icli_index_append(index, size, sorted[i]->val, sorted[i]);
+        }
+    }
+
+    icli_free(sorted);
+    return index;
+}
+
+static void icli_bktree_free(struct icli_bktree *tree);
+
+static void icli_index_free(void *ptr)
+{
+    struct icli_index *index = ptr;
+
+    if (!index)
+        return;
+
+    if (index->bk) {
+        icli_bktree_free(index->bk);
+        icli_free(index->bk);
+    }
+    icli_free(index);
+}
+
+static const struct icli_index icli_index_empty;
+
+/* Names of commands of MODE, as published to readers */
+static struct icli_index *icli_mode_names(const struct icli_command *mode)
+{
+    struct icli_index *names = __atomic_load_n(&mode->names, __ATOMIC_ACQUIRE);
+
+    return names ? names : (struct icli_index *)&icli_index_empty;
+}
+
+/* Publish copy of names of MODE with NAME inserted, or with NAME removed if VALUE is NULL, and retire the replaced
+   names. Called with writer lock held */
+static int icli_names_update(struct icli_command *mode, const char *name, void *value)
+{
+    struct icli_index *names = mode->names;
+    struct icli_index *copy;
+
+    if (value) {
+        copy = icli_index_copy(names, name, value, -1);
+    } else {
+        int pos = names ? icli_index_find(names, name) : -1;
+
+        if (pos < 0)
+            return -1;
+        copy = icli_index_copy(names, NULL, NULL, pos);
+    }
+
+    if (!copy)
+        return -1;
+
+    __atomic_store_n(&mode->names, copy, __ATOMIC_RELEASE);
+    icli_rcu_retire(icli_index_free, names);
+
+    return 0;
+}
+
+static void icli_vals_free(void *ptr)
+{
+    struct icli_vals *vals = ptr;
+
+    if (!vals)
+        return;
+
+    icli_index_free(vals->index);
+    icli_free(vals);
+}
+
+/* Return indexed copy of VALS */
+static struct icli_vals *icli_vals_new(const struct icli_arg_val *vals)
+{
+    struct icli_vals *copy;
+    size_t strs_size = 0;
+    char *strs;
+    int n = 0;
+
+    for (const struct icli_arg_val *val = vals; val && val->val; ++val, ++n)
+        strs_size += strlen(val->val) + 1 + (val->help ? strlen(val->help) + 1 : 0);
+
+    copy = icli_calloc(ICLI_MEM_ARGUMENTS, 1, sizeof(*copy) + (size_t)(n + 1) * sizeof(copy->vals[0]) + strs_size);
+    if (!copy)
+        return NULL;
+
+    strs = (char *)&copy->vals[n + 1];
+    for (int i = 0; i < n; ++i) {
+        copy->vals[i].val = strs;
+        strs = stpcpy(strs, vals[i].val) + 1;
+        if (vals[i].help) {
+            copy->vals[i].help = strs;
+            strs = stpcpy(strs, vals[i].help) + 1;
+        }
+    }
+    copy->n_vals = n;
+
+    copy->index = icli_index_vals(copy->vals, n);
+    if (!copy->index) {
+        icli_free(copy);
+        return NULL;
+    }
+
+    return copy;
+}
+
+/* Return value set of VALS referenced once, SHARED if created by the application */
+static struct icli_value_set *icli_value_set_new(const struct icli_arg_val *vals, bool shared)
+{
+    struct icli_value_set *set = icli_calloc(ICLI_MEM_ARGUMENTS, 1, sizeof(*set));
+
+    if (!set)
+        return NULL;
+
+    set->vals = icli_vals_new(vals);
+    if (!set->vals) {
+        icli_free(set);
+        return NULL;
+    }
+
+    set->refs = 1;
+    set->shared = shared;
+    return set;
+}
+
+static void icli_value_set_free(void *ptr)
+{
+    struct icli_value_set *set = ptr;
+
+    icli_vals_free(set->vals);
+    icli_free(set);
+}
+
+/* Drop a reference to SET, which is freed once no reader may use it. Called with writer lock held */
+static void icli_value_set_unref(struct icli_value_set *set)
+{
+    if (set && 0 == --set->refs)
+        icli_rcu_retire(icli_value_set_free, set);
+}
+
+/* Values of argument of PRIV as published to readers, NULL if not provided */
+static const struct icli_vals *icli_arg_vals(const struct icli_arg_priv *priv)
+{
+    return priv && priv->set ? __atomic_load_n(&priv->set->vals, __ATOMIC_ACQUIRE) : NULL;
+}
+
+/* Arguments of CMD as published to readers, NULL if not provided. Called with reader lock held, the snapshot is
+   valid until it is released */
+static const struct icli_args *icli_command_args(const struct icli_command *cmd)
+{
+    return __atomic_load_n(&cmd->args, __ATOMIC_ACQUIRE);
+}
+
+/* Maximal number of suggestions printed for a mistyped name */
+#define ICLI_SUGGEST_MAX 3
+/* Maximal edit distance of a suggestion */
+#define ICLI_SUGGEST_MAX_DIST 2
+/* Names shorter than this have their edit distance computed on stack */
+#define ICLI_BK_ROW_MAX 64
+/* Values of arguments with at most this many values are listed when no suggestion is found */
+#define ICLI_SUGGEST_LIST_MAX 8
+
+static void icli_bktree_free(struct icli_bktree *tree)
+{
+    icli_free(tree->nodes);
+    memset(tree, 0, sizeof(*tree));
+}
+
+/* Levenshtein distance of A and B. The row of distances is on stack for names shorter than ICLI_BK_ROW_MAX */
+static unsigned icli_bktree_dist(const char *a, const char *b)
+{
+    unsigned stack_row[ICLI_BK_ROW_MAX];
+    size_t len_b = strlen(b);
+    unsigned *row = stack_row;
+    unsigned ret;
+
+    if (len_b + 1 > ICLI_BK_ROW_MAX) {
+        row = icli_malloc(ICLI_MEM_COMPLETION, (len_b + 1) * sizeof(*row));
+        if (!row)
+            return UINT_MAX;
+    }
+
+    for (size_t j = 0; j <= len_b; ++j)
+        row[j] = (unsigned)j;
+
+    for (unsigned i = 1; a[i - 1]; ++i) {
+        unsigned diag = row[0];
+
+        row[0] = i;
+        for (size_t j = 1; j <= len_b; ++j) {
+            unsigned up = row[j];
+            unsigned dist = diag + (a[i - 1] != b[j - 1]);
+
+            if (up + 1 < dist)
+                dist = up + 1;
+            if (row[j - 1] + 1 < dist)
+                dist = row[j - 1] + 1;
+
+            row[j] = dist;
+            diag = up;
+        }
+    }
+
+    ret = row[len_b];
+    if (row != stack_row)
+        icli_free(row);
+
+    return ret;
+}
+
+static void icli_bktree_add(struct icli_bktree *tree, const char *name)
+{
+    struct icli_bk_node *node = &tree->nodes[tree->n_nodes];
+    int pos = 0;
+
+    node->name = name;
+    node->dist = 0;
+    node->child = node->next = -1;
+
+    if (!tree->n_nodes++)
+        return;
+
+    for (;;) {
+        unsigned dist = icli_bktree_dist(name, tree->nodes[pos].name);
+        int *link = &tree->nodes[pos].child;
+
+        while (*link >= 0 && tree->nodes[*link].dist != dist)
+            link = &tree->nodes[*link].next;
+
+        if (*link < 0) {
+            node->dist = dist;
+            *link = tree->n_nodes - 1;
+            return;
+        }
+
+        pos = *link;
+    }
+}
+
+
+/* Collect up to ICLI_SUGGEST_MAX names closest to WORD into NAMES, ordered by distance */
+static void icli_bktree_search(const struct icli_bktree *tree,
+                               int pos,
+                               const char *word,
+                               unsigned max_dist,
+                               const char *names[],
+                               unsigned dists[],
+                               int *n)
+{
+    const struct icli_bk_node *node = &tree->nodes[pos];
+    unsigned dist = icli_bktree_dist(word, node->name);
+
+    if (dist <= max_dist && (*n < ICLI_SUGGEST_MAX || dist < dists[*n - 1])) {
+        int i = *n < ICLI_SUGGEST_MAX ? (*n)++ : *n - 1;
+
+        for (; i > 0 && dists[i - 1] > dist; --i) {
+            names[i] = names[i - 1];
+            dists[i] = dists[i - 1];
+        }
+        names[i] = node->name;
+        dists[i] = dist;
+    }
+
+    /* by triangle inequality only children at distance dist +- max_dist may match */
+    for (int child = node->child; child >= 0; child = tree->nodes[child].next) {
+        unsigned child_dist = tree->nodes[child].dist;
+
+        if (child_dist + max_dist >= dist && child_dist <= dist + max_dist)
+            icli_bktree_search(tree, child, word, max_dist, names, dists, n);
+    }
+}
+
+/* Print space-prefixed names of INDEX, which are within small edit distance from WORD, into BUF. The tree of
+   suggestions of INDEX is built if needed. Return the number of suggestions. */
+static int icli_suggest(struct icli_index *index, const char *word, char *buf, size_t size)
+{
+    const char *found[ICLI_SUGGEST_MAX];
+    unsigned dists[ICLI_SUGGEST_MAX];
+    unsigned max_dist = strlen(word) >= 3 ? ICLI_SUGGEST_MAX_DIST : 1;
+    struct icli_bktree *tree;
+    size_t len = 0;
+    int n = 0;
+
+    *buf = '\0';
+    if (!index || !index->n)
+        return 0;
+
+    tree = __atomic_load_n(&index->bk, __ATOMIC_ACQUIRE);
+    if (!tree) {
+        /* accounted as the names it is built from */
+        enum icli_mem_category category = icli_mem_hdr(index)->category;
+        struct icli_bktree *expected = NULL;
+
+        tree = icli_calloc(category, 1, sizeof(*tree));
+        if (!tree)
+            return 0;
+        tree->nodes = icli_malloc(category, (size_t)index->n * sizeof(*tree->nodes));
+        if (!tree->nodes) {
+            icli_free(tree);
+            return 0;
+        }
+        for (int i = 0; i < index->n; ++i)
+            icli_bktree_add(tree, icli_index_name(index, i));
+
+        /* names are immutable, so a tree built concurrently from the same names is as good as ours */
+        if (!__atomic_compare_exchange_n(&index->bk, &expected, tree, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            icli_bktree_free(tree);
+            icli_free(tree);
+            tree = expected;
+        }
+    }
+
+    icli_bktree_search(tree, 0, word, max_dist, found, dists, &n);
+
+    for (int i = 0; i < n && len < size; ++i) {
+        int ret = snprintf(buf + len, size - len, " %s", found[i]);
+        if (ret > 0)
+            len += (size_t)ret;
+    }
+
+    return n;
+}
+
+static void icli_init_builtins(struct icli_command *mode);
+
+/* Resolve NAME, which may be an unambiguous prefix of the command name, among commands of the current mode.
+   Return the number of matching commands, COMMAND is set if NAME resolves to a single command. */
+static int icli_resolve_command(const char *name, struct icli_command **command)
+{
+    void *value = NULL;
+    int n;
+
+    icli_init_builtins(icli.curr_cmd);
+    n = icli_index_lookup(icli_mode_names(icli.curr_cmd), name, &value);
+
+    *command = 1 == n ? value : NULL;
+    return n;
+}
+
+/* Look up NAME as the name (or unambiguous prefix of the name) of a command, and return a pointer to that
+   command.  Return a NULL pointer if NAME isn't a command name. */
+static struct icli_command *icli_find_command(char *name)
+{
+    struct icli_command *command;
+
+    icli_resolve_command(name, &command);
+    return command;
+}
+
+/* Store path of names from root to MODE separated by '/' in BUF. Return NULL for root */
+static const char *icli_mode_path(struct icli_command *mode, char *buf, size_t size)
+{
+    size_t len;
+
+    if (!mode || !mode->parent)
+        return NULL;
+
+    if (!icli_mode_path(mode->parent, buf, size))
+        buf[0] = '\0';
+
+    len = strlen(buf);
+    snprintf(buf + len, size - len, "%s%s", len ? "/" : "", mode->name);
+
+    return buf;
+}
+
+static int icli_strbuf_reserve(struct icli_strbuf *buf, size_t len)
+{
+    if (buf->len + len + 1 > buf->size) {
+        size_t size = buf->size ? buf->size : 128;
+        char *data;
+
+        while (buf->len + len + 1 > size)
+            size *= 2;
+
+        data = buf->caller_owned ? realloc(buf->data, size) : icli_realloc(ICLI_MEM_BUFFERS, buf->data, size);
+        if (!data)
+            return -1;
+
+        buf->data = data;
+        buf->size = size;
+    }
+
+    return 0;
+}
+
+static int icli_strbuf_append(struct icli_strbuf *buf, const char *str, size_t len)
+{
+    if (icli_strbuf_reserve(buf, len))
+        return -1;
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
+
+static int icli_strbuf_puts(struct icli_strbuf *buf, const char *str)
+{
+    return icli_strbuf_append(buf, str, strlen(str));
+}
+
+/* Append N spaces */
+static int icli_strbuf_pad(struct icli_strbuf *buf, int n)
+{
+    if (n <= 0)
+        return 0;
+
+    if (icli_strbuf_reserve(buf, (size_t)n))
+        return -1;
+
+    memset(buf->data + buf->len, ' ', (size_t)n);
+    buf->len += (size_t)n;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
+
+static void icli_strbuf_free(struct icli_strbuf *buf)
+{
+    icli_free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+/* Append names of modes from root to MODE, each in parentheses, as entered by the user of MODES. Return depth of
+   MODE below root, -1 on failure */
+static int icli_prompt_append_modes(struct icli_strbuf *buf,
+                                    struct icli_command *mode,
+                                    const struct icli_mode_stack *modes)
+{
+    const char *name = mode->short_name ? mode->short_name : mode->name;
+    int depth;
+
+    if (!mode->parent)
+        return 0;
+
+    depth = icli_prompt_append_modes(buf, mode->parent, modes);
+    if (depth < 0)
+        return -1;
+
+    if (depth < modes->depth && modes->levels[depth].mode == mode && modes->levels[depth].text)
+        name = modes->levels[depth].text;
+
+    if (name && (icli_strbuf_puts(buf, "(") || icli_strbuf_puts(buf, name) || icli_strbuf_puts(buf, ")")))
+        return -1;
+
+    return depth + 1;
+}
+
+/* Append prompt of MODE entered by the user of MODES to BUF */
+static int icli_prompt_append(struct icli_strbuf *buf, struct icli_command *mode, const struct icli_mode_stack *modes)
+{
+    if (icli_strbuf_puts(buf, icli.prompt) || icli_prompt_append_modes(buf, mode, modes) < 0 ||
+        icli_strbuf_puts(buf, "> "))
+        return -1;
+
+    return 0;
+}
+
+static void icli_build_prompt(struct icli_command *command)
+{
+    struct icli_strbuf buf = {0};
+
+    /* the prompt is built once the interactive loop shows it */
+    if (!icli.rl_ready)
+        return;
+
+    if (icli_prompt_append(&buf, command, &icli.modes)) {
+        icli_api_printf("Unable to allocate memory for prompt\n");
+        icli_strbuf_free(&buf);
+        return;
+    }
+
+    icli_free((void *)icli.curr_prompt);
+    icli.curr_prompt = buf.data;
+}
+
+/* Make MODES hold modes from below root to MODE, keeping texts of modes which stay entered. NULL MODE frees MODES */
+static void icli_mode_stack_set(struct icli_mode_stack *modes, struct icli_command *mode)
+{
+    struct icli_command *it;
+    int depth = 0;
+
+    for (it = mode; it && it->parent; it = it->parent)
+        ++depth;
+
+    for (int i = depth; i < modes->depth; ++i) {
+        icli_free(modes->levels[i].text);
+        modes->levels[i].text = NULL;
+    }
+    if (modes->depth > depth)
+        modes->depth = depth;
+
+    if (!mode) {
+        icli_free(modes->levels);
+        memset(modes, 0, sizeof(*modes));
+        return;
+    }
+
+    if (depth > modes->size) {
+        struct icli_mode_level *levels = icli_realloc(ICLI_MEM_PROMPTS, modes->levels, (size_t)depth * sizeof(*levels));
+
+        /* prompt shows names of the modes */
+        if (!levels) {
+            icli_mode_stack_set(modes, NULL);
+            return;
+        }
+
+        memset(levels + modes->size, 0, (size_t)(depth - modes->size) * sizeof(*levels));
+        modes->levels = levels;
+        modes->size = depth;
+    }
+
+    it = mode;
+    for (int i = depth - 1; i >= 0; --i, it = it->parent) {
+        struct icli_mode_level *level = &modes->levels[i];
+
+        if (i >= modes->depth || level->mode != it) {
+            icli_free(level->text);
+            level->mode = it;
+            level->text = NULL;
+        }
+    }
+
+    modes->depth = depth;
+}
+
+/* Show TEXT (owned by MODES, may be NULL) in prompt for the current mode of the user of MODES */
+static void icli_mode_stack_set_text(struct icli_mode_stack *modes, char *text)
+{
+    if (!modes->depth) {
+        icli_free(text);
+        return;
+    }
+
+    icli_free(modes->levels[modes->depth - 1].text);
+    modes->levels[modes->depth - 1].text = text;
+}
+
+/* Make MODE the mode of the user of *HOLDER, whose entered modes are in MODES. Unregistered modes are not freed while
+   they, or modes below them, are in use. MODE is referenced before the old mode is released, so that a removed subtree
+   being left stays referenced until its user is out of it */
+static void icli_set_mode(struct icli_command **holder, struct icli_mode_stack *modes, struct icli_command *mode)
+{
+    struct icli_command *it, *parent;
+
+    for (it = mode; it; it = it->parent)
+        __atomic_add_fetch(&it->mode_refs, 1, __ATOMIC_RELAXED);
+
+    icli_mode_stack_set(modes, mode);
+
+    for (it = *holder; it; it = parent) {
+        /* the mode may be freed once released */
+        parent = it->parent;
+        __atomic_sub_fetch(&it->mode_refs, 1, __ATOMIC_RELEASE);
+    }
+
+    *holder = mode;
+}
+
+/* Return the closest mode above MODE which is not unregistered, MODE itself if it is not */
+static struct icli_command *icli_live_mode(struct icli_command *mode)
+{
+    struct icli_command *live = mode;
+
+    for (struct icli_command *it = mode; it; it = it->parent) {
+        if (__atomic_load_n(&it->removed, __ATOMIC_ACQUIRE))
+            live = it->parent;
+    }
+
+    return live;
+}
+
+/* Leave the current mode if it was unregistered, and REPORT it. Return true if it was */
+static bool icli_leave_removed_mode(bool report)
+{
+    struct icli_command *live = icli_live_mode(icli.curr_cmd);
+
+    if (live == icli.curr_cmd)
+        return false;
+
+    if (report)
+        icli_err_printf("%s: Mode was removed\n", icli.curr_cmd->name);
+    icli_set_mode(&icli.curr_cmd, &icli.modes, live);
+    icli_build_prompt(live);
+    return true;
+}
+
+static int icli_parse_line(char *line, char **cmd, char *argv[], int argc)
+{
+    int n_args = 0;
+    int i = 0;
+    char *tmp;
+
+    /* Isolate the command word. */
+    while (line[i] && isspace(line[i]))
+        i++;
+    tmp = &line[i];
+
+    while (line[i] && !isspace(line[i]))
+        i++;
+
+    if (line[i])
+        line[i++] = '\0';
+
+    *cmd = tmp;
+
+    /* Get argument to command, if any. */
+    while (line[i]) {
+        while (isspace(line[i]))
+            i++;
+
+        if (line[i] && n_args < argc) {
+            argv[n_args++] = &line[i];
+        }
+
+        while (line[i] && !isspace(line[i]))
+            i++;
+
+        if (line[i])
+            line[i++] = '\0';
+    }
+
+    return n_args;
+}
+
+/* Base of integer STR - hex with explicit 0x prefix, otherwise decimal (leading zeros don't mean octal) */
+static int icli_int_base(const char *str)
+{
+    if ('-' == *str || '+' == *str)
+        ++str;
+
+    return '0' == str[0] && ('x' == str[1] || 'X' == str[1]) ? 16 : 10;
+}
+
+/* Parse signed integer in decimal or hex notation */
+static int icli_parse_int(const char *str, int64_t *out)
+{
+    char *end;
+    long long val;
+
+    errno = 0;
+    val = strtoll(str, &end, icli_int_base(str));
+    if (errno || end == str || *end)
+        return -1;
+
+    *out = val;
+    return 0;
+}
+
+/* Parse unsigned integer, END (if not NULL) is set to the first character after the number */
+static int icli_parse_uint64(const char *str, uint64_t *out, char **end)
+{
+    char *num_end;
+    unsigned long long val;
+
+    if (!isdigit(*str))
+        return -1;
+
+    errno = 0;
+    val = strtoull(str, &num_end, icli_int_base(str));
+    if (errno || (!end && *num_end))
+        return -1;
+
+    if (end)
+        *end = num_end;
+    *out = val;
+    return 0;
+}
+
+static int icli_parse_size(const char *str, uint64_t *out)
+{
+    static const char units[] = "KMGT";
+    const char *unit;
+    uint64_t val;
+    char *end;
+    unsigned shift = 0;
+
+    if (icli_parse_uint64(str, &val, &end))
+        return -1;
+
+    /* allow K, KB and KiB (case insensitive) */
+    if (*end && (unit = strchr(units, toupper(*end)))) {
+        shift = 10 * (unsigned)(unit - units + 1);
+        ++end;
+        if ('i' == *end)
+            ++end;
+    }
+    if ('b' == *end || 'B' == *end)
+        ++end;
+
+    if (*end || val > (UINT64_MAX >> shift))
+        return -1;
+
+    *out = val << shift;
+    return 0;
+}
+
+/* Parse STR as argument ARG into VALUE. Return 0 if STR is a valid value of the argument */
+static int icli_parse_value(const struct icli_arg *arg,
+                            const struct icli_arg_priv *priv,
+                            const char *str,
+                            struct icli_value *value)
+{
+    const struct icli_vals *vals = icli_arg_vals(priv);
+    void *val;
+
+    memset(value, 0, sizeof(*value));
+    value->type = arg->type;
+    value->str = str;
+
+    switch (arg->type) {
+    case AT_Val:
+    case AT_Enum:
+        /* no validation if values were not provided */
+        if (!vals) {
+            value->index = -1;
+            return 0;
+        }
+
+        /* accept unambiguous prefix, VALUE is set to the full value */
+        if (1 != icli_index_lookup(vals->index, str, &val))
+            return -1;
+
+        value->index = (int)((struct icli_arg_val *)val - vals->vals);
+        value->str = vals->vals[value->index].val;
+        return 0;
+
+    case AT_Int:
+        if (icli_parse_int(str, &value->i))
+            return -1;
+
+        if (arg->range && (value->i < arg->min || value->i > arg->max))
+            return -1;
+        return 0;
+
+    case AT_Uint64:
+        return icli_parse_uint64(str, &value->u, NULL);
+
+    case AT_IPv4:
+        return inet_pton(AF_INET, str, &value->ipv4) == 1 ? 0 : -1;
+
+    case AT_IPv6:
+        return inet_pton(AF_INET6, str, &value->ipv6) == 1 ? 0 : -1;
+
+    case AT_Size:
+        return icli_parse_size(str, &value->u);
+
+    case AT_Regex:
+        if (!priv || !priv->regex)
+            return 0;
+        return regexec(priv->regex, str, 0, NULL, 0) == 0 ? 0 : -1;
+
+    default:
+        return 0;
+    }
+}
+
+/* Describe values accepted by argument ARG */
+static void icli_describe_arg(const struct icli_arg *arg, char *buf, size_t size)
+{
+    switch (arg->type) {
+    case AT_Val:
+    case AT_Enum:
+        snprintf(buf, size, "one of the values");
+        break;
+    case AT_File:
+        snprintf(buf, size, "filename");
+        break;
+    case AT_Int:
+        if (arg->range)
+            snprintf(buf, size, "integer in range [%" PRId64 ", %" PRId64 "]", arg->min, arg->max);
+        else
+            snprintf(buf, size, "integer");
+        break;
+    case AT_Uint64:
+        snprintf(buf, size, "unsigned integer");
+        break;
+    case AT_IPv4:
+        snprintf(buf, size, "IPv4 address");
+        break;
+    case AT_IPv6:
+        snprintf(buf, size, "IPv6 address");
+        break;
+    case AT_Size:
+        snprintf(buf, size, "size, e.g. 512, 4K, 16M, 1G");
+        break;
+    case AT_Regex:
+        snprintf(buf, size, "string matching '%s'", arg->regex ? arg->regex : "");
+        break;
+    default:
+        snprintf(buf, size, "argument");
+        break;
+    }
+}
+
+/* Map type name used in grammar to argument type */
+static int icli_arg_type_from_name(const char *name, enum icli_arg_type *type)
+{
+    static const struct {
+        const char *name;
+        enum icli_arg_type type;
+    } types[] = {{"int", AT_Int}, {"uint64", AT_Uint64}, {"ipv4", AT_IPv4}, {"ipv6", AT_IPv6}, {"size", AT_Size}};
+
+    for (size_t i = 0; i < array_len(types); ++i) {
+        if (strcmp(types[i].name, name) == 0) {
+            *type = types[i].type;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Argument grammar of ICLI_ARGS_DYNAMIC commands.
+   The grammar is parsed into a syntax tree which is compiled into a program for a small non-backtracking state
+   machine (Pike VM). Running the program over the arguments both validates them and provides the keywords that
+   may follow, which are used for completion. */
+
+/* Maximal number of instructions of compiled grammar */
+#define ICLI_GRAMMAR_MAX_INSTS 256
+
+enum icli_gram_op {
+    GOP_WORD, /* match keyword */
+    GOP_VALUE, /* match any argument */
+    GOP_SPLIT, /* continue at both x and y */
+    GOP_JMP, /* continue at x */
+    GOP_MATCH /* arguments accepted */
+};
+
+struct icli_gram_inst {
+    enum icli_gram_op op;
+    const char *str; /* keyword or value name */
+    enum icli_arg_type type; /* type of value */
+    int x;
+    int y;
+};
+
+struct icli_grammar {
+    char *src; /* grammar as provided by the user */
+    char *strs; /* copy of grammar keywords and value names */
+    struct icli_gram_inst *insts;
+    int n_insts;
+};
+
+enum icli_gnode_type { GN_WORD, GN_VALUE, GN_SEQ, GN_ALT, GN_OPT, GN_REP };
+
+/* Node of grammar syntax tree */
+struct icli_gnode {
+    enum icli_gnode_type type;
+    const char *str; /* keyword or value name */
+    enum icli_arg_type arg_type; /* type of value */
+    struct icli_gnode *child; /* first child of seq/alt, the only child of opt/rep */
+    struct icli_gnode *next; /* next sibling */
+};
+
+struct icli_gram_parser {
+    char *pos;
+    const char *src;
+    char *strs;
+    int n_insts;
+};
+
+/* Current set of states (instruction indexes) of a grammar run */
+struct icli_gram_run {
+    int pcs[ICLI_GRAMMAR_MAX_INSTS];
+    int n_pcs;
+};
+
+static void icli_gnode_free(struct icli_gnode *node)
+{
+    while (node) {
+        struct icli_gnode *next = node->next;
+        icli_gnode_free(node->child);
+        icli_free(node);
+        node = next;
+    }
+}
+
+static struct icli_gnode *icli_gnode_new(struct icli_gram_parser *parser,
+                                         enum icli_gnode_type type,
+                                         const char *str,
+                                         struct icli_gnode *child)
+{
+    struct icli_gnode *node = icli_calloc(ICLI_MEM_COMMANDS, 1, sizeof(*node));
+    if (!node) {
+        icli_gnode_free(child);
+        return NULL;
+    }
+
+    node->type = type;
+    node->str = str;
+    node->child = child;
+
+    /* count instructions the node compiles to */
+    switch (type) {
+    case GN_WORD:
+    case GN_VALUE:
+    case GN_OPT:
+    case GN_REP:
+        parser->n_insts += 1;
+        break;
+    case GN_ALT:
+        for (struct icli_gnode *it = child; it && it->next; it = it->next)
+            parser->n_insts += 2;
+        break;
+    case GN_SEQ:
+        break;
+    }
+
+    return node;
+}
+
+static void icli_gram_skip_space(struct icli_gram_parser *parser)
+{
+    while (isspace(*parser->pos))
+        ++parser->pos;
+}
+
+static bool icli_gram_special(const char *pos)
+{
+    return !*pos || isspace(*pos) || strchr("[]()|<>", *pos) || strncmp(pos, "...", 3) == 0;
+}
+
+static struct icli_gnode *icli_gram_parse_alt(struct icli_gram_parser *parser);
+
+static struct icli_gnode *icli_gram_parse_atom(struct icli_gram_parser *parser)
+{
+    struct icli_gnode *node;
+    char *str;
+    char close;
+
+    icli_gram_skip_space(parser);
+
+    switch (*parser->pos) {
+    case '[':
+    case '(':
+        close = '[' == *parser->pos ? ']' : ')';
+        ++parser->pos;
+
+        node = icli_gram_parse_alt(parser);
+        if (!node)
+            return NULL;
+
+        icli_gram_skip_space(parser);
+        if (*parser->pos != close) {
+            icli_gnode_free(node);
+            return NULL;
+        }
+        ++parser->pos;
+
+        return ']' == close ? icli_gnode_new(parser, GN_OPT, NULL, node) : node;
+
+    case '<': {
+        enum icli_arg_type type = AT_None;
+        char *type_name = NULL;
+
+        str = parser->strs + (++parser->pos - parser->src);
+        while (*parser->pos && '>' != *parser->pos && !isspace(*parser->pos)) {
+            if (':' == *parser->pos && !type_name) {
+                parser->strs[parser->pos - parser->src] = '\0';
+                type_name = parser->strs + (parser->pos - parser->src) + 1;
+            }
+            ++parser->pos;
+        }
+        if ('>' != *parser->pos || str == parser->strs + (parser->pos - parser->src))
+            return NULL;
+        parser->strs[parser->pos++ - parser->src] = '\0';
+
+        if (type_name && icli_arg_type_from_name(type_name, &type))
+            return NULL;
+
+        node = icli_gnode_new(parser, GN_VALUE, str, NULL);
+        if (node)
+            node->arg_type = type;
+
+        return node;
+    }
+
+    default:
+        if (icli_gram_special(parser->pos))
+            return NULL;
+
+        str = parser->strs + (parser->pos - parser->src);
+        while (!icli_gram_special(parser->pos))
+            ++parser->pos;
+        parser->strs[parser->pos - parser->src] = '\0';
+
+        return icli_gnode_new(parser, GN_WORD, str, NULL);
+    }
+}
+
+static struct icli_gnode *icli_gram_parse_seq(struct icli_gram_parser *parser)
+{
+    struct icli_gnode *first = NULL;
+    struct icli_gnode **last = &first;
+
+    for (;;) {
+        icli_gram_skip_space(parser);
+        if (!*parser->pos || strchr("])|", *parser->pos))
+            break;
+
+        struct icli_gnode *node = icli_gram_parse_atom(parser);
+        if (!node)
+            goto err;
+
+        if (strncmp(parser->pos, "...", 3) == 0) {
+            parser->pos += 3;
+            node = icli_gnode_new(parser, GN_REP, NULL, node);
+            if (!node)
+                goto err;
+        }
+
+        *last = node;
+        last = &node->next;
+    }
+
+    if (!first)
+        return NULL;
+
+    return icli_gnode_new(parser, GN_SEQ, NULL, first);
+
+err:
+    icli_gnode_free(first);
+    return NULL;
+}
+
+static struct icli_gnode *icli_gram_parse_alt(struct icli_gram_parser *parser)
+{
+    struct icli_gnode *first = NULL;
+    struct icli_gnode **last = &first;
+
+    for (;;) {
+        struct icli_gnode *node = icli_gram_parse_seq(parser);
+        if (!node) {
+            icli_gnode_free(first);
+            return NULL;
+        }
+
+        *last = node;
+        last = &node->next;
+
+        icli_gram_skip_space(parser);
+        if ('|' != *parser->pos)
+            break;
+        ++parser->pos;
+    }
+
+    if (!first->next)
+        return first;
+
+    return icli_gnode_new(parser, GN_ALT, NULL, first);
+}
+
+static void icli_gram_emit(struct icli_grammar *grammar, struct icli_gnode *node)
+{
+    struct icli_gram_inst *inst;
+    int split;
+
+    switch (node->type) {
+    case GN_WORD:
+    case GN_VALUE:
+        inst = &grammar->insts[grammar->n_insts++];
+        inst->op = GN_WORD == node->type ? GOP_WORD : GOP_VALUE;
+        inst->str = node->str;
+        inst->type = node->arg_type;
+        break;
+
+    case GN_SEQ:
+        for (struct icli_gnode *it = node->child; it; it = it->next)
+            icli_gram_emit(grammar, it);
+        break;
+
+    case GN_ALT: {
+        int jmps[ICLI_GRAMMAR_MAX_INSTS];
+        int n_jmps = 0;
+
+        for (struct icli_gnode *it = node->child; it; it = it->next) {
+            if (!it->next) {
+                icli_gram_emit(grammar, it);
+                break;
+            }
+
+            split = grammar->n_insts++;
+            grammar->insts[split].op = GOP_SPLIT;
+            grammar->insts[split].x = grammar->n_insts;
+            icli_gram_emit(grammar, it);
+            jmps[n_jmps++] = grammar->n_insts;
+            grammar->insts[grammar->n_insts++].op = GOP_JMP;
+            grammar->insts[split].y = grammar->n_insts;
+        }
+
+        for (int i = 0; i < n_jmps; ++i)
+            grammar->insts[jmps[i]].x = grammar->n_insts;
+        break;
+    }
+
+    case GN_OPT:
+        split = grammar->n_insts++;
+        grammar->insts[split].op = GOP_SPLIT;
+        grammar->insts[split].x = grammar->n_insts;
+        icli_gram_emit(grammar, node->child);
+        grammar->insts[split].y = grammar->n_insts;
+        break;
+
+    case GN_REP:
+        split = grammar->n_insts;
+        icli_gram_emit(grammar, node->child);
+        inst = &grammar->insts[grammar->n_insts++];
+        inst->op = GOP_SPLIT;
+        inst->x = split;
+        inst->y = grammar->n_insts;
+        break;
+    }
+}
+
+static void icli_grammar_free(struct icli_grammar *grammar)
+{
+    if (!grammar)
+        return;
+
+    icli_free(grammar->src);
+    icli_free(grammar->strs);
+    icli_free(grammar->insts);
+    icli_free(grammar);
+}
+
+/* Add allocation PTR to STATS */
+static void icli_mem_add(struct icli_mem_stats *stats, const void *ptr)
+{
+    if (ptr) {
+        ++stats->objects;
+        stats->bytes += icli_mem_size(ptr);
+    }
+}
+
+static void icli_index_mem(struct icli_mem_stats *stats, const struct icli_index *index)
+{
+    struct icli_bktree *tree = index ? __atomic_load_n(&index->bk, __ATOMIC_ACQUIRE) : NULL;
+
+    icli_mem_add(stats, index);
+    if (tree) {
+        icli_mem_add(stats, tree);
+        icli_mem_add(stats, tree->nodes);
+    }
+}
+
+/* Add memory of CMD and its subtree to STATS. Called with reader lock held */
+static void icli_command_mem(struct icli_mem_stats *stats, const struct icli_command *cmd)
+{
+    const struct icli_args *args = icli_command_args(cmd);
+    struct icli_command *it;
+
+    icli_mem_add(stats, cmd);
+    icli_index_mem(stats, __atomic_load_n(&cmd->names, __ATOMIC_ACQUIRE));
+
+    if (cmd->grammar) {
+        icli_mem_add(stats, cmd->grammar);
+        icli_mem_add(stats, cmd->grammar->src);
+        icli_mem_add(stats, cmd->grammar->strs);
+        icli_mem_add(stats, cmd->grammar->insts);
+    }
+
+    if (args) {
+        icli_mem_add(stats, args);
+
+        for (int i = 0; i < args->argc; ++i) {
+            icli_mem_add(stats, args->argv[i].help);
+            if (AT_Regex == args->argv[i].type)
+                icli_mem_add(stats, args->argv[i].regex);
+            icli_mem_add(stats, args->priv[i].regex);
+
+            /* shared value sets don't belong to any subtree */
+            if (args->priv[i].set && !args->priv[i].set->shared) {
+                const struct icli_vals *vals = icli_arg_vals(&args->priv[i]);
+
+                icli_mem_add(stats, args->priv[i].set);
+                icli_mem_add(stats, vals);
+                icli_index_mem(stats, vals->index);
+            }
+        }
+    }
+
+    LIST_FOREACH(it, &cmd->cmd_list, cmd_list_entry)
+    icli_command_mem(stats, it);
+}
+
+static struct icli_grammar *icli_grammar_compile(const char *src)
+{
+    struct icli_gram_parser parser = {0};
+    struct icli_gnode *root = NULL;
+    struct icli_grammar *grammar = icli_calloc(ICLI_MEM_COMMANDS, 1, sizeof(*grammar));
+
+    if (!grammar)
+        return NULL;
+
+    grammar->src = icli_strdup(ICLI_MEM_COMMANDS, src);
+    grammar->strs = icli_strdup(ICLI_MEM_COMMANDS, src);
+    if (!grammar->src || !grammar->strs)
+        goto err;
+
+    parser.src = grammar->src;
+    parser.pos = grammar->src;
+    parser.strs = grammar->strs;
+
+    root = icli_gram_parse_alt(&parser);
+    icli_gram_skip_space(&parser);
+    if (!root || *parser.pos) {
+        icli_api_printf("Invalid grammar '%s' at position %d\n", src, (int)(parser.pos - parser.src));
+        goto err;
+    }
+
+    if (parser.n_insts + 1 > ICLI_GRAMMAR_MAX_INSTS) {
+        icli_api_printf("Grammar '%s' is too complex\n", src);
+        goto err;
+    }
+
+    grammar->insts = icli_calloc(ICLI_MEM_COMMANDS, (size_t)parser.n_insts + 1, sizeof(*grammar->insts));
+    if (!grammar->insts)
+        goto err;
+
+    icli_gram_emit(grammar, root);
+    grammar->insts[grammar->n_insts++].op = GOP_MATCH;
+
+    icli_gnode_free(root);
+    return grammar;
+
+err:
+    icli_gnode_free(root);
+    icli_grammar_free(grammar);
+    return NULL;
+}
+
+/* Add state PC to RUN following split and jump instructions */
+static void icli_gram_add(const struct icli_grammar *grammar, struct icli_gram_run *run, bool *added, int pc)
+{
+    if (added[pc])
+        return;
+    added[pc] = true;
+
+    switch (grammar->insts[pc].op) {
+    case GOP_JMP:
+        icli_gram_add(grammar, run, added, grammar->insts[pc].x);
+        break;
+    case GOP_SPLIT:
+        icli_gram_add(grammar, run, added, grammar->insts[pc].x);
+        icli_gram_add(grammar, run, added, grammar->insts[pc].y);
+        break;
+    default:
+        run->pcs[run->n_pcs++] = pc;
+    }
+}
+
+/* Match ARG against INST. If VALUE is not NULL and has no type yet, it is set to ARG parsed by a typed value */
+static bool icli_gram_inst_match(const struct icli_gram_inst *inst, const char *arg, struct icli_value *value)
+{
+    struct icli_arg type = {.type = inst->type};
+    struct icli_value parsed;
+
+    if (GOP_VALUE != inst->op)
+        return GOP_WORD == inst->op && strcmp(inst->str, arg) == 0;
+
+    if (icli_parse_value(&type, NULL, arg, &parsed))
+        return false;
+
+    if (value && AT_None == value->type)
+        *value = parsed;
+
+    return true;
+}
+
+/* Expand ARG to the keyword it is an unambiguous prefix of, among keywords accepted by RUN. ARG is returned if it
+   matches a keyword exactly or is accepted as a value. */
+static const char *icli_gram_expand(const struct icli_grammar *grammar,
+                                    const struct icli_gram_run *run,
+                                    const char *arg)
+{
+    const char *word = NULL;
+    bool ambiguous = false;
+    size_t len = strlen(arg);
+
+    for (int i = 0; i < run->n_pcs; ++i) {
+        const struct icli_gram_inst *inst = &grammar->insts[run->pcs[i]];
+
+        if (GOP_VALUE == inst->op && icli_gram_inst_match(inst, arg, NULL))
+            return arg;
+
+        if (GOP_WORD != inst->op || strncmp(inst->str, arg, len) != 0)
+            continue;
+
+        if (!inst->str[len])
+            return arg;
+
+        if (word && strcmp(word, inst->str) != 0)
+            ambiguous = true;
+        word = inst->str;
+    }
+
+    return word && !ambiguous ? word : arg;
+}
+
+/* Run GRAMMAR over ARGV in a single pass, abbreviated keywords in ARGV are replaced with the full keywords.
+   Return number of arguments accepted - argc if all of them are valid. RUN holds the states after the last accepted
+   argument. If VALUES is not NULL, it is set to the arguments parsed by their types */
+static int icli_grammar_run(const struct icli_grammar *grammar,
+                            char *argv[],
+                            int argc,
+                            struct icli_gram_run *run,
+                            struct icli_value values[])
+{
+    bool added[ICLI_GRAMMAR_MAX_INSTS];
+    struct icli_gram_run next;
+
+    memset(added, 0, sizeof(added));
+    run->n_pcs = 0;
+    icli_gram_add(grammar, run, added, 0);
+
+    for (int i = 0; i < argc; ++i) {
+        memset(added, 0, sizeof(added));
+        next.n_pcs = 0;
+        argv[i] = (char *)icli_gram_expand(grammar, run, argv[i]);
+        if (values)
+            values[i] = (struct icli_value){.type = AT_None, .str = argv[i]};
+
+        for (int j = 0; j < run->n_pcs; ++j) {
+            int pc = run->pcs[j];
+            if (icli_gram_inst_match(&grammar->insts[pc], argv[i], values ? &values[i] : NULL))
+                icli_gram_add(grammar, &next, added, pc + 1);
+        }
+
+        if (!next.n_pcs)
+            return i;
+
+        *run = next;
+    }
+
+    return argc;
+}
+
+static bool icli_gram_accepted(const struct icli_grammar *grammar, const struct icli_gram_run *run)
+{
+    for (int i = 0; i < run->n_pcs; ++i) {
+        if (GOP_MATCH == grammar->insts[run->pcs[i]].op)
+            return true;
+    }
+
+    return false;
+}
+
+/* Print what may follow the accepted arguments */
+static void icli_gram_print_expected(const struct icli_grammar *grammar, const struct icli_gram_run *run)
+{
+    char expected[1024] = "";
+    size_t len = 0;
+
+    for (int i = 0; i < run->n_pcs && len < sizeof(expected); ++i) {
+        const struct icli_gram_inst *inst = &grammar->insts[run->pcs[i]];
+        int ret = 0;
+
+        switch (inst->op) {
+        case GOP_WORD:
+            ret = snprintf(expected + len, sizeof(expected) - len, " %s", inst->str);
+            break;
+        case GOP_VALUE:
+            if (AT_None != inst->type) {
+                struct icli_arg type = {.type = inst->type};
+                char desc[256];
+
+                icli_describe_arg(&type, desc, sizeof(desc));
+                ret = snprintf(expected + len, sizeof(expected) - len, " <%s> (%s)", inst->str, desc);
+            } else {
+                ret = snprintf(expected + len, sizeof(expected) - len, " <%s>", inst->str);
+            }
+            break;
+        case GOP_MATCH:
+            ret = snprintf(expected + len, sizeof(expected) - len, " <end of line>");
+            break;
+        default:
+            break;
+        }
+
+        if (ret > 0)
+            len += (size_t)ret;
+    }
+
+    icli_err_printf("Expected:%s\n", expected);
+}
+
+/* Validate arguments of command with grammar and parse them into VALUES. Return 0 if arguments are valid */
+static int icli_grammar_validate(struct icli_command *command, char *argv[], int argc, struct icli_value values[])
+{
+    struct icli_gram_run run;
+    int n_accepted = icli_grammar_run(command->grammar, argv, argc, &run, values);
+
+    if (n_accepted < argc) {
+        icli_err_printf("Command %s %d argument invalid: %s\n", command->name, n_accepted, argv[n_accepted]);
+    } else if (!icli_gram_accepted(command->grammar, &run)) {
+        icli_err_printf("Command %s is missing arguments\n", command->name);
+    } else {
+        return 0;
+    }
+
+    icli_gram_print_expected(command->grammar, &run);
+    icli_err_printf("Usage: %s %s\n", command->name, command->grammar->src);
+
+    return -1;
+}
+
+/* Text shown in prompt for mode CMD entered with ARGV, NULL if it is the name of the mode */
+static char *icli_mode_text(struct icli_command *cmd, char *argv[], int argc)
+{
+    const char *name = cmd->short_name ? cmd->short_name : cmd->name;
+    size_t bufsz = strlen(name) + 1;
+    char *text;
+
+    if (!argc)
+        return NULL;
+
+    for (int i = 0; i < argc; ++i)
+        bufsz += strlen(argv[i]) + 1;
+
+    text = icli_malloc(ICLI_MEM_PROMPTS, bufsz);
+    if (!text)
+        return NULL;
+
+    strcpy(text, name);
+    for (int i = 0; i < argc; ++i) {
+        strcat(text, " ");
+        strcat(text, argv[i]);
+    }
+
+    return text;
+}
+
+static void icli_account_usage(struct icli_command *cmd)
+{
+    cmd->usage.count++;
+    cmd->usage.last = ++icli.usage_tick;
+}
+
+static void icli_print_command_help(struct icli_command *cmd)
+{
+    const struct icli_args *args = icli_command_args(cmd);
+    const struct icli_vals *vals;
+
+    icli_printf("%s    %s\n", cmd->name, cmd->doc);
+
+    icli_printf("Arguments:\n");
+
+    if (cmd->argc > 0) {
+        for (int i = 0; i < cmd->argc; ++i) {
+            icli_printf("---------------------------------------------------------------\n");
+            if (args) {
+                const struct icli_arg *arg = &args->argv[i];
+
+                switch (arg->type) {
+                case AT_Val:
+                case AT_Enum:
+                    if (arg->help)
+                        icli_printf("%s\n", arg->help);
+                    vals = icli_arg_vals(&args->priv[i]);
+                    for (int j = 0; vals && j < vals->n_vals; ++j) {
+                        if (vals->vals[j].help)
+                            icli_printf("%s (%s)\n", vals->vals[j].val, vals->vals[j].help);
+                        else
+                            icli_printf("%s\n", vals->vals[j].val);
+                    }
+                    break;
+
+                case AT_File:
+                    if (arg->help)
+                        icli_printf("filename (%s)\n", arg->help);
+                    else
+                        icli_printf("filename\n");
+                    break;
+
+                case AT_Int:
+                case AT_Uint64:
+                case AT_IPv4:
+                case AT_IPv6:
+                case AT_Size:
+                case AT_Regex: {
+                    char desc[256];
+
+                    icli_describe_arg(arg, desc, sizeof(desc));
+                    if (arg->help)
+                        icli_printf("%s (%s)\n", desc, arg->help);
+                    else
+                        icli_printf("%s\n", desc);
+                    break;
+                }
+
+                default:
+                    if (arg->help)
+                        icli_printf("arg%d (%s)\n", i, arg->help);
+                    else
+                        icli_printf("arg%d\n", i);
+                }
+            } else {
+                icli_printf("arg%d\n", i);
+            }
+        }
+    } else if (ICLI_ARGS_DYNAMIC == cmd->argc && cmd->grammar) {
+        icli_printf("Usage: %s %s\n", cmd->name, cmd->grammar->src);
+    } else if (ICLI_ARGS_DYNAMIC == cmd->argc) {
+        icli_printf("Variable number arguments accepted\n");
+    } else if (0 == cmd->argc) {
+        icli_printf("None\n");
+    }
+}
+
+/* Structured output */
+
+static bool icli_is_true(const char *val)
+{
+    static const char *trues[] = {"true", "yes", "on", "1"};
+
+    for (size_t i = 0; val && i < array_len(trues); ++i) {
+        if (strcasecmp(val, trues[i]) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+/* Check VAL is a number according to JSON grammar */
+static bool icli_is_json_number(const char *val)
+{
+    if ('-' == *val)
+        ++val;
+
+    if ('0' == *val)
+        ++val;
+    else if (isdigit(*val))
+        while (isdigit(*val))
+            ++val;
+    else
+        return false;
+
+    if ('.' == *val) {
+        if (!isdigit(*++val))
+            return false;
+        while (isdigit(*val))
+            ++val;
+    }
+
+    if ('e' == *val || 'E' == *val) {
+        ++val;
+        if ('+' == *val || '-' == *val)
+            ++val;
+        if (!isdigit(*val))
+            return false;
+        while (isdigit(*val))
+            ++val;
+    }
+
+    return !*val;
+}
+
+static int icli_json_append_str(struct icli_strbuf *buf, const char *str)
+{
+    int ret = icli_strbuf_puts(buf, "\"");
+
+    for (const char *c = str; *c && !ret; ++c) {
+        char esc[8];
+
+        switch (*c) {
+        case '"':
+            ret = icli_strbuf_puts(buf, "\\\"");
+            break;
+        case '\\':
+            ret = icli_strbuf_puts(buf, "\\\\");
+            break;
+        case '\n':
+            ret = icli_strbuf_puts(buf, "\\n");
+            break;
+        case '\r':
+            ret = icli_strbuf_puts(buf, "\\r");
+            break;
+        case '\t':
+            ret = icli_strbuf_puts(buf, "\\t");
+            break;
+        default:
+            if ((unsigned char)*c < 0x20) {
+                snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*c);
+                ret = icli_strbuf_puts(buf, esc);
+            } else {
+                ret = icli_strbuf_append(buf, c, 1);
+            }
+            break;
+        }
+    }
+
+    return ret ? ret : icli_strbuf_puts(buf, "\"");
+}
+
+/* JSON Lines - an object per row */
+static void icli_json_row(const struct icli_column cols[], int n_cols, const char *const vals[], void *ctx UNUSED)
+{
+    struct icli_strbuf *buf = &icli.row;
+    int ret = 0;
+
+    buf->len = 0;
+    ret = icli_strbuf_puts(buf, "{");
+
+    for (int i = 0; i < n_cols && !ret; ++i) {
+        if (i)
+            ret = icli_strbuf_puts(buf, ",");
+        ret = ret ? ret : icli_json_append_str(buf, cols[i].name);
+        ret = ret ? ret : icli_strbuf_puts(buf, ":");
+        if (ret)
+            break;
+
+        if (!vals[i])
+            ret = icli_strbuf_puts(buf, "null");
+        else if (ICLI_COL_BOOL == cols[i].type)
+            ret = icli_strbuf_puts(buf, icli_is_true(vals[i]) ? "true" : "false");
+        else if (ICLI_COL_NUM == cols[i].type && icli_is_json_number(vals[i]))
+            ret = icli_strbuf_puts(buf, vals[i]);
+        else
+            ret = icli_json_append_str(buf, vals[i]);
+    }
+
+    if (!ret)
+        ret = icli_strbuf_puts(buf, "}");
+
+    if (ret)
+        icli_err_printf("Unable to allocate memory for row\n");
+    else
+        icli_printf("%s\n", buf->data);
+}
+
+static int icli_csv_append(struct icli_strbuf *buf, const char *val)
+{
+    size_t len = strlen(val);
+    int ret = 0;
+
+    if (!strpbrk(val, ",\"\r\n") && !(len && (isspace(val[0]) || isspace(val[len - 1]))))
+        return icli_strbuf_append(buf, val, len);
+
+    ret = icli_strbuf_puts(buf, "\"");
+    for (const char *c = val; *c && !ret; ++c) {
+        /* quotes are escaped by doubling */
+        ret = icli_strbuf_append(buf, c, 1);
+        if (!ret && '"' == *c)
+            ret = icli_strbuf_append(buf, c, 1);
+    }
+
+    return ret ? ret : icli_strbuf_puts(buf, "\"");
+}
+
+/* Output CSV line of VALS, or of names of COLS if VALS is NULL */
+static void icli_csv_line(const struct icli_column cols[], int n_cols, const char *const vals[])
+{
+    struct icli_strbuf *buf = &icli.row;
+    int ret = 0;
+
+    buf->len = 0;
+    ret = icli_strbuf_reserve(buf, 0);
+
+    for (int i = 0; i < n_cols && !ret; ++i) {
+        const char *val = vals ? vals[i] : cols[i].name;
+
+        if (i)
+            ret = icli_strbuf_puts(buf, ",");
+        if (!ret && val)
+            ret = icli_csv_append(buf, val);
+    }
+
+    if (ret)
+        icli_err_printf("Unable to allocate memory for row\n");
+    else
+        icli_printf("%s\n", buf->data);
+}
+
+static void icli_csv_begin(const struct icli_column cols[], int n_cols, void *ctx UNUSED)
+{
+    icli_csv_line(cols, n_cols, NULL);
+}
+
+static void icli_csv_row(const struct icli_column cols[], int n_cols, const char *const vals[], void *ctx UNUSED)
+{
+    icli_csv_line(cols, n_cols, vals);
+}
+
+/* Display width of UTF-8 string STR */
+static int icli_text_width(const char *str)
+{
+    int width = 0;
+
+    for (; *str; ++str) {
+        if (((unsigned char)*str & 0xc0) != 0x80)
+            ++width;
+    }
+
+    return width;
+}
+
+static int icli_text_append_cell(struct icli_strbuf *buf,
+                                 const struct icli_column *col,
+                                 const char *val,
+                                 int width,
+                                 bool first,
+                                 bool last)
+{
+    int pad = width - icli_text_width(val);
+    bool right = ICLI_COL_NUM == col->type;
+    int ret = first ? 0 : icli_strbuf_puts(buf, "  ");
+
+    if (!ret && right)
+        ret = icli_strbuf_pad(buf, pad);
+    if (!ret)
+        ret = icli_strbuf_puts(buf, val);
+    if (!ret && !right && !last)
+        ret = icli_strbuf_pad(buf, pad);
+
+    return ret;
+}
+
+static void icli_text_print_row(struct icli_text_table *table,
+                                const struct icli_column cols[],
+                                int n_cols,
+                                const char *const vals[])
+{
+    struct icli_strbuf *buf = &icli.row;
+    int ret;
+
+    buf->len = 0;
+    ret = icli_strbuf_reserve(buf, 0);
+
+    for (int i = 0; i < n_cols && !ret; ++i) {
+        const char *val = vals ? vals[i] : cols[i].name;
+
+        int width = i < ICLI_TABLE_COLS_MAX ? table->widths[i] : 0;
+
+        ret = icli_text_append_cell(buf, &cols[i], val ? val : "", width, !i, i == n_cols - 1);
+    }
+
+    if (ret)
+        icli_err_printf("Unable to allocate memory for row\n");
+    else
+        icli_printf("%s\n", buf->data);
+}
+
+static void icli_text_measure(struct icli_text_table *table, int n_cols, const char *const vals[])
+{
+    for (int i = 0; i < n_cols; ++i) {
+        int width = vals[i] ? icli_text_width(vals[i]) : 0;
+
+        if (width > table->widths[i])
+            table->widths[i] = width;
+    }
+}
+
+/* Size of row in sample or spill file - cells are NUL terminated */
+static size_t icli_text_row_size(int n_cols, const char *const vals[])
+{
+    size_t size = 0;
+
+    for (int i = 0; i < n_cols; ++i)
+        size += (vals[i] ? strlen(vals[i]) : 0) + 1;
+
+    return size;
+}
+
+/* Print header, sample rows and spilled rows, and switch to streaming */
+static void icli_text_flush(struct icli_text_table *table, const struct icli_column cols[], int n_cols)
+{
+    const char *vals[ICLI_TABLE_COLS_MAX];
+    const char *cell = table->sample;
+    char *line = NULL;
+    size_t line_size = 0;
+
+    icli_text_print_row(table, cols, n_cols, NULL);
+
+    for (int row = 0; row < table->n_sample; ++row) {
+        for (int i = 0; i < n_cols; ++i) {
+            vals[i] = cell;
+            cell += strlen(cell) + 1;
+        }
+        icli_text_print_row(table, cols, n_cols, vals);
+    }
+
+    if (table->spill) {
+        rewind(table->spill);
+
+        for (bool done = false; !done;) {
+            struct icli_strbuf *buf = &icli.row;
+            int ret;
+
+            buf->len = 0;
+            ret = icli_strbuf_reserve(buf, 0);
+
+            for (int i = 0; i < n_cols && !ret; ++i) {
+                if (icli_getdelim(&line, &line_size, '\0', table->spill) <= 0) {
+                    done = true;
                     break;
+                }
+                ret = icli_text_append_cell(buf, &cols[i], line, table->widths[i], !i, i == n_cols - 1);
+            }
+
+            if (ret)
+                icli_err_printf("Unable to allocate memory for row\n");
+            else if (!done)
+                icli_printf("%s\n", buf->data);
+        }
+
+        icli_free(line);
+        fclose(table->spill);
+        table->spill = NULL;
+    }
+
+    table->n_sample = 0;
+    table->sample_len = 0;
+    table->streaming = true;
+}
+
+/* Human readable table. Column widths are measured over the first ICLI_TABLE_SAMPLE_ROWS rows (or as many rows as
+   fit into ICLI_TABLE_SAMPLE_SIZE bytes), then the rows are streamed. In exact mode rows beyond the sample window are
+   spilled to a temporary file, and the table is printed once widths of all rows are known. */
+static void icli_text_begin(const struct icli_column cols[], int n_cols, void *ctx)
+{
+    struct icli_text_table *table = ctx;
+
+    table->streaming = n_cols > ICLI_TABLE_COLS_MAX;
+    table->n_sample = 0;
+    table->sample_len = 0;
+    table->spill = NULL;
+
+    if (!table->sample) {
+        table->sample = icli_malloc(ICLI_MEM_BUFFERS, ICLI_TABLE_SAMPLE_SIZE);
+        if (!table->sample)
+            table->streaming = true;
+    }
+
+    for (int i = 0; i < n_cols && i < ICLI_TABLE_COLS_MAX; ++i)
+        table->widths[i] = icli_text_width(cols[i].name);
+
+    if (table->streaming) {
+        /* no room to measure - columns are as wide as their headers */
+        icli_text_print_row(table, cols, n_cols, NULL);
+    }
+}
+
+static void icli_text_row(const struct icli_column cols[], int n_cols, const char *const vals[], void *ctx)
+{
+    struct icli_text_table *table = ctx;
+    size_t size = icli_text_row_size(n_cols, vals);
+
+    if (table->streaming) {
+        icli_text_print_row(table, cols, n_cols, vals);
+        return;
+    }
+
+    icli_text_measure(table, n_cols, vals);
+
+    if (!table->spill && table->n_sample < ICLI_TABLE_SAMPLE_ROWS &&
+        table->sample_len + size <= ICLI_TABLE_SAMPLE_SIZE) {
+        for (int i = 0; i < n_cols; ++i) {
+            size_t len = vals[i] ? strlen(vals[i]) : 0;
+
+            memcpy(table->sample + table->sample_len, vals[i] ? vals[i] : "", len + 1);
+            table->sample_len += len + 1;
+        }
+        ++table->n_sample;
+        return;
+    }
+
+    if (table->exact && !table->spill)
+        table->spill = tmpfile();
+
+    if (table->spill) {
+        for (int i = 0; i < n_cols; ++i)
+            fwrite(vals[i] ? vals[i] : "", 1, (vals[i] ? strlen(vals[i]) : 0) + 1, table->spill);
+
+        if (!ferror(table->spill))
+            return;
+
+        /* print what we have so far, widths of spilled rows are measured already */
+        icli_err_printf("Unable to spill table rows (%m)\n");
+    }
+
+    icli_text_flush(table, cols, n_cols);
+    icli_text_print_row(table, cols, n_cols, vals);
+}
+
+static void icli_text_end(const struct icli_column cols[], int n_cols, void *ctx)
+{
+    struct icli_text_table *table = ctx;
+
+    if (!table->streaming)
+        icli_text_flush(table, cols, n_cols);
+
+    table->streaming = false;
+}
+
+static int icli_find_renderer(const char *name)
+{
+    for (int i = 0; i < icli.n_renderers; ++i) {
+        if (strcmp(icli.renderers[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int icli_register_renderer(const struct icli_renderer *renderer)
+{
+    struct icli_renderer *renderers;
+
+    if (!renderer || !renderer->name || !*renderer->name || !renderer->row) {
+        icli_api_printf("renderer name or row callback not provided\n");
+        return -1;
+    }
+
+    if (icli_find_renderer(renderer->name) >= 0) {
+        icli_api_printf("renderer %s already registered\n", renderer->name);
+        return -1;
+    }
+
+    renderers = icli_realloc(ICLI_MEM_OTHER, icli.renderers, (size_t)(icli.n_renderers + 1) * sizeof(*renderers));
+    if (!renderers) {
+        icli_api_printf("Unable to allocate memory for renderer %s\n", renderer->name);
+        return -1;
+    }
+    icli.renderers = renderers;
+
+    renderers[icli.n_renderers] = *renderer;
+    renderers[icli.n_renderers].name = icli_strdup(ICLI_MEM_OTHER, renderer->name);
+    if (!renderers[icli.n_renderers].name) {
+        icli_api_printf("Unable to allocate memory for renderer %s\n", renderer->name);
+        return -1;
+    }
+
+    ++icli.n_renderers;
+    return 0;
+}
+
+int icli_set_output_format(const char *name)
+{
+    int format = icli_find_renderer(name);
+
+    if (format < 0) {
+        icli_api_printf("renderer %s not registered\n", name);
+        return -1;
+    }
+
+    icli.format = format;
+    return 0;
+}
+
+static int icli_init_renderers(void)
+{
+    const struct icli_renderer renderers[] = {{.name = "text",
+                                               .begin = icli_text_begin,
+                                               .row = icli_text_row,
+                                               .end = icli_text_end,
+                                               .ctx = &icli.text_tables[0]},
+                                              {.name = "table",
+                                               .begin = icli_text_begin,
+                                               .row = icli_text_row,
+                                               .end = icli_text_end,
+                                               .ctx = &icli.text_tables[1]},
+                                              {.name = "json", .row = icli_json_row},
+                                              {.name = "csv", .begin = icli_csv_begin, .row = icli_csv_row}};
+
+    icli.text_tables[1].exact = true;
+
+    for (size_t i = 0; i < array_len(renderers); ++i) {
+        if (icli_register_renderer(&renderers[i]))
+            return -1;
+    }
+
+    return 0;
+}
+
+static void icli_cleanup_renderers(void)
+{
+    for (int i = 0; i < icli.n_renderers; ++i)
+        icli_free((void *)icli.renderers[i].name);
+
+    icli_free(icli.renderers);
+    icli.renderers = NULL;
+    icli.n_renderers = 0;
+    icli_strbuf_free(&icli.row);
+
+    for (size_t i = 0; i < array_len(icli.text_tables); ++i) {
+        icli_free(icli.text_tables[i].sample);
+        icli.text_tables[i].sample = NULL;
+    }
+}
+
+int icli_table_begin(const struct icli_column cols[], int n_cols)
+{
+    int format = icli.cmd_format >= 0 ? icli.cmd_format : icli.format;
+
+    if (icli.table.active) {
+        icli_api_printf("table already started\n");
+        return -1;
+    }
+
+    if (!cols || n_cols <= 0 || format >= icli.n_renderers) {
+        icli_api_printf("no columns or renderer provided\n");
+        return -1;
+    }
+
+    icli.table.active = true;
+    icli.table.renderer = &icli.renderers[format];
+    icli.table.cols = cols;
+    icli.table.n_cols = n_cols;
+
+    if (icli.table.renderer->begin)
+        icli.table.renderer->begin(cols, n_cols, icli.table.renderer->ctx);
+
+    return 0;
+}
+
+int icli_table_row(const char *const vals[])
+{
+    if (!icli.table.active) {
+        icli_api_printf("table not started\n");
+        return -1;
+    }
+
+    icli.table.renderer->row(icli.table.cols, icli.table.n_cols, vals, icli.table.renderer->ctx);
+    return 0;
+}
+
+void icli_table_end(void)
+{
+    if (!icli.table.active)
+        return;
+
+    if (icli.table.renderer->end)
+        icli.table.renderer->end(icli.table.cols, icli.table.n_cols, icli.table.renderer->ctx);
+
+    memset(&icli.table, 0, sizeof(icli.table));
+}
+
+/* Split "command | format" LINE. Return the renderer, or -1 if the line does not end with " | <renderer>" token.
+   Other '|' are left alone, arguments (e.g. regular expressions) may contain them */
+static int icli_split_format(char *line)
+{
+    char *pipe = strrchr(line, '|');
+    char *name;
+    size_t len;
+    char end;
+    int format;
+
+    if (!pipe || pipe == line || !isspace(pipe[-1]))
+        return -1;
+
+    name = pipe + 1 + strspn(pipe + 1, " \t");
+    len = strcspn(name, " \t");
+    if (!len || name[len + strspn(name + len, " \t")])
+        return -1;
+
+    end = name[len];
+    name[len] = '\0';
+    format = icli_find_renderer(name);
+    name[len] = end;
+
+    if (format >= 0)
+        *pipe = '\0';
+
+    return format;
+}
+
+static bool icli_has_callback(const struct icli_command *command)
+{
+    return command->func || command->typed_func;
+}
+
+/* Parse arguments of COMMAND into VALUES. Print error and return -1 on invalid argument */
+static int icli_validate_values(struct icli_command *command, char *argv[], int argc, struct icli_value values[])
+{
+    const struct icli_args *args = icli_command_args(command);
+
+    for (int i = 0; i < argc; ++i) {
+        const struct icli_vals *vals;
+        const struct icli_arg *arg;
+        char desc[256];
+        void *val;
+
+        if (!args || ICLI_ARGS_DYNAMIC == command->argc) {
+            values[i] = (struct icli_value){.type = AT_None, .str = argv[i]};
+            continue;
+        }
+
+        arg = &args->argv[i];
+        if (!icli_parse_value(arg, &args->priv[i], argv[i], &values[i])) {
+            /* replace abbreviation with the full value */
+            argv[i] = (char *)values[i].str;
+            continue;
+        }
+
+        vals = icli_arg_vals(&args->priv[i]);
+        if ((AT_Val == arg->type || AT_Enum == arg->type) && vals &&
+            icli_index_lookup(vals->index, argv[i], &val) > 1) {
+            icli_index_list(vals->index, argv[i], desc, sizeof(desc));
+            icli_err_printf("Command %s %d argument ambiguous: %s. Candidates:%s\n", command->name, i, argv[i], desc);
+            return -1;
+        }
+
+        icli_err_printf("Command %s %d argument invalid: %s\n", command->name, i, argv[i]);
+        if (AT_Val == arg->type || AT_Enum == arg->type) {
+            int n_vals = vals ? vals->n_vals : 0;
+
+            if (vals && icli_suggest(vals->index, argv[i], desc, sizeof(desc))) {
+                icli_err_printf("Did you mean:%s?\n", desc);
+            } else if (n_vals <= ICLI_SUGGEST_LIST_MAX) {
+                icli_index_list(vals ? vals->index : NULL, "", desc, sizeof(desc));
+                icli_err_printf("Expected one of:%s\n", desc);
+            } else {
+                icli_err_printf("Expected one of %d values, see 'help %s'\n", n_vals, command->name);
+            }
+        } else {
+            icli_describe_arg(arg, desc, sizeof(desc));
+            icli_err_printf("Expected: %s\n", desc);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+static int icli_execute_single(char *line)
+{
+    struct icli_command *command;
+    /* not static - commands may execute other commands */
+    char *argv[ICLI_ARGS_MAX];
+    struct icli_value values[ICLI_ARGS_MAX];
+    char *cmd;
+    char *mode_text = NULL;
+    int cmd_format = icli_split_format(line);
+    int n;
+
+    /* anything failing before the command is called is a usage error */
+    icli.cmd_ret = ICLI_ERR_ARG;
+
+    int argc = icli_parse_line(line, &cmd, argv, array_len(argv));
+
+    n = icli_resolve_command(cmd, &command);
+
+    if (n > 1) {
+        char cands[256];
+
+        icli_index_list(icli_mode_names(icli.curr_cmd), cmd, cands, sizeof(cands));
+        icli_err_printf("%s: Ambiguous command:%s\n", cmd, cands);
+        return -1;
+    }
+
+    if (!command) {
+        char cands[256];
+
+        icli_err_printf("%s: No such command\n", cmd);
+        if (icli_suggest(icli_mode_names(icli.curr_cmd), cmd, cands, sizeof(cands)))
+            icli_err_printf("Did you mean:%s?\n", cands);
+        return -1;
+    }
+
+    if (!icli_has_callback(command) && argc) {
+        icli_err_printf("Command %s does not accept arguments\n", cmd);
+        return -1;
+    }
+
+    if (icli_has_callback(command)) {
+        if (command->argc != ICLI_ARGS_DYNAMIC) {
+            if (command->argc != argc) {
+                icli_err_printf("Command %s accepts exactly %d arguments. %d were provided\n",
+                                cmd,
+                                command->argc,
+                                argc);
+                icli_print_command_help(command);
+                return -1;
+            }
+
+        }
+
+        /* arguments of command with grammar are parsed by the grammar */
+        if (command->grammar ? icli_grammar_validate(command, argv, argc, values)
+                             : icli_validate_values(command, argv, argc, values))
+            return -1;
+
+        if (command->n_cmds)
+            mode_text = icli_mode_text(command, argv, argc);
+
+        icli.error_printed = false;
+
+        icli_account_usage(command);
+
+        if (icli.cmd_hook)
+            icli.cmd_hook(command->name, argv, argc, icli.user_data);
+
+        /* Call the function. */
+        enum icli_ret ret;
+        icli.cmd_format = cmd_format;
+        if (command->typed_func)
+            ret = command->typed_func(values, argc, icli.user_data);
+        else
+            ret = command->func(argv, argc, icli.user_data);
+
+        icli_table_end();
+        icli.cmd_format = -1;
+        icli.cmd_ret = ret;
+
+        switch (ret) {
+        case ICLI_OK:
+            break;
+        case ICLI_ERR_ARG:
+            if (!icli.error_printed)
+                icli_err_printf("Argument error\n");
+            icli_free(mode_text);
+            return -1;
+            break;
+        case ICLI_ERR:
+            if (!icli.error_printed)
+                icli_err_printf("Error\n");
+            icli_free(mode_text);
+            return -1;
+            break;
+        }
+    } else {
+        icli_account_usage(command);
+
+        if (icli.cmd_hook)
+            icli.cmd_hook(command->name, argv, argc, icli.user_data);
+    }
+
+    if (command->n_cmds) {
+        icli_set_mode(&icli.curr_cmd, &icli.modes, command);
+        icli_mode_stack_set_text(&icli.modes, mode_text);
+        icli_build_prompt(command);
+    }
+
+    icli.cmd_ret = ICLI_OK;
+    return 0;
+}
+
+/* Find the next command separator in LINE. Return pointer to it (or to the terminating '\0') and store its type */
+static char *icli_next_separator(char *line, enum icli_separator *sep)
+{
+    for (; *line; ++line) {
+        if (';' == *line) {
+            *sep = SEP_SEQ;
+            return line;
+        }
+
+        if ('&' == line[0] && '&' == line[1]) {
+            *sep = SEP_AND;
+            return line;
+        }
+    }
+
+    *sep = SEP_END;
+    return line;
+}
+
+/* Exit status of the last executed line, which returned RET */
+static int icli_exit_status(int ret)
+{
+    if (!ret)
+        return ICLI_EXIT_OK;
+
+    return ICLI_ERR == icli.cmd_ret ? ICLI_EXIT_ERR : ICLI_EXIT_USAGE;
+}
+
+int icli_main(int argc, char *argv[])
+{
+    struct icli_strbuf line = {0};
+    int status = ICLI_EXIT_OK;
+    int i = 1;
+
+    if (argc < 2) {
+        icli_err_printf("Usage: %s <command> [arguments]\n", argc ? argv[0] : "cli");
+        return ICLI_EXIT_USAGE;
+    }
+
+    /* output is not paged - there is nobody to press a key */
+    icli.paging = false;
+
+    icli_read_lock();
+
+    while (i < argc) {
+        struct icli_command *command;
+        int n_args = argc - i - 1;
+
+        /* arguments not accepted by a mode command select the command in the mode */
+        if (1 == icli_resolve_command(argv[i], &command)) {
+            if (!icli_has_callback(command))
+                n_args = 0;
+            else if (command->n_cmds && command->argc != ICLI_ARGS_DYNAMIC && n_args > command->argc)
+                n_args = command->argc;
+        }
+
+        line.len = 0;
+        for (int j = i; j <= i + n_args; ++j) {
+            if ((j > i && icli_strbuf_puts(&line, " ")) || icli_strbuf_puts(&line, argv[j])) {
+                icli_api_printf("Unable to allocate memory for command line\n");
+                status = ICLI_EXIT_ERR;
+                goto out;
+            }
+        }
+
+        if (icli_execute_single(line.data)) {
+            status = icli_exit_status(-1);
+            goto out;
+        }
+
+        i += n_args + 1;
+    }
+
+out:
+    icli_read_unlock();
+    icli_strbuf_free(&line);
+    fflush(stdout);
+    return status;
+}
+
+int icli_get_phase_stats(enum icli_phase phase, struct icli_phase_stats *stats)
+{
+    if (phase < 0 || phase >= ICLI_PHASE_MAX || !stats) {
+        icli_api_printf("Invalid phase %d or NULL stats specified\n", phase);
+        return -1;
+    }
+
+    *stats = icli.phases[phase];
+    stats->name = icli_phase_names[phase];
+
+    return 0;
+}
+
+int icli_get_alloc_stats(struct icli_alloc_stats *stats)
+{
+    if (!stats) {
+        icli_api_printf("NULL stats specified\n");
+        return -1;
+    }
+
+    *stats = icli_mem.stats;
+    return 0;
+}
+
+int icli_get_mem_stats(enum icli_mem_category category, struct icli_mem_stats *stats)
+{
+    if (category < 0 || category >= ICLI_MEM_MAX || !stats) {
+        icli_api_printf("Invalid category %d or NULL stats specified\n", category);
+        return -1;
+    }
+
+    stats->name = icli_mem_names[category];
+    stats->objects = __atomic_load_n(&icli_mem.categories[category].objects, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&icli_mem.categories[category].bytes, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+int icli_execute_capture(char *line, struct icli_sink *sink)
+{
+    struct icli_sink *prev_sink = icli.sink;
+    bool prev_failed = icli.sink_failed;
+    struct icli_table table = icli.table;
+    int cmd_format = icli.cmd_format;
+    bool skip_output = icli.skip_output;
+    bool error_printed = icli.error_printed;
+    int curr_row = icli.curr_row;
+    struct icli_text_table text_tables[array_len(icli.text_tables)];
+    bool nested = icli.table.active;
+    int ret;
+
+    if (!line || !sink) {
+        icli_api_printf("NULL line or sink specified\n");
+        return -1;
+    }
+
+    /* the line may be executed by a command in the middle of its own output, whose rows may be held by the renderer */
+    memset(&icli.table, 0, sizeof(icli.table));
+    if (nested) {
+        memcpy(text_tables, icli.text_tables, sizeof(text_tables));
+        for (size_t i = 0; i < array_len(icli.text_tables); ++i)
+            icli.text_tables[i] = (struct icli_text_table){.exact = text_tables[i].exact};
+    }
+    icli.sink = sink;
+    icli.sink_failed = false;
+
+    ret = icli_execute_line(line);
+    if (icli.sink_failed) {
+        icli_api_printf("Unable to allocate memory for captured output\n");
+        ret = -1;
+    }
+
+    /* paging state of the terminal is not affected by captured output */
+    icli.sink = prev_sink;
+    icli.sink_failed = prev_failed;
+    icli.table = table;
+    icli.cmd_format = cmd_format;
+    icli.skip_output = skip_output;
+    icli.error_printed = error_printed;
+    icli.curr_row = curr_row;
+
+    if (nested) {
+        for (size_t i = 0; i < array_len(icli.text_tables); ++i) {
+            icli_free(icli.text_tables[i].sample);
+            if (icli.text_tables[i].spill)
+                fclose(icli.text_tables[i].spill);
+        }
+        memcpy(icli.text_tables, text_tables, sizeof(text_tables));
+    }
+
+    return ret;
+}
+
+/* Control server */
+
+/* Default maximal number of clients of control server */
+#define ICLI_SERVER_MAX_CLIENTS 256
+/* Default maximal length of request payload */
+#define ICLI_SERVER_MAX_REQUEST (64 * 1024)
+/* Maximal number of bytes read from a client per event, so that a single client can't starve the others */
+#define ICLI_SERVER_READ_SIZE (64 * 1024)
+/* Requests of a client are not read while this many bytes of its responses are not consumed */
+#define ICLI_SERVER_OUT_MAX (1024 * 1024)
+#define ICLI_SERVER_EVENTS 64
+/* Number of lines kept in history of a session if history_size is not set */
+#define ICLI_SESSION_HISTORY 64
+
+#define MORE_STRING "--More--"
+
+/* State of escape sequence parser of a session */
+enum icli_session_esc { ICLI_ESC_NONE, ICLI_ESC_START, ICLI_ESC_CSI };
+
+/* Keys decoded from escape sequences, beyond the range of bytes */
+enum icli_session_key {
+    ICLI_KEY_NONE = 256,
+    ICLI_KEY_UP,
+    ICLI_KEY_DOWN,
+    ICLI_KEY_RIGHT,
+    ICLI_KEY_LEFT,
+    ICLI_KEY_HOME,
+    ICLI_KEY_END,
+    ICLI_KEY_DELETE,
+    ICLI_KEY_OTHER
+};
+
+/* Interactive session of a client of session server, with its own line editor and pager */
+struct icli_session {
+    struct icli_strbuf line; /* line being edited */
+    size_t point; /* cursor position in line */
+    int rows; /* terminal size reported by the client, 0 if unknown */
+    int cols;
+    enum icli_session_esc esc;
+    char csi[16]; /* parameters of control sequence being parsed */
+    size_t csi_len;
+    int last_key;
+    bool dirty; /* line has to be redisplayed */
+    char **history; /* lines executed in the session, the oldest first */
+    int n_history;
+    int hist_pos; /* history entry being edited, n_history for a new line */
+    char *saved_line; /* new line saved while browsing history */
+    struct icli_strbuf output; /* output of the executed line, shown page by page */
+    size_t output_off; /* start of the next page */
+    bool paging; /* waiting for a key to show the next page */
+};
+
+struct icli_server_client {
+    LIST_ENTRY(icli_server_client) entry;
+    int fd;
+    uint32_t events; /* events the client is registered for */
+    struct icli_command *mode; /* current mode of the client */
+    struct icli_mode_stack modes; /* modes entered by the client, up to mode */
+    struct icli_session *session; /* NULL for client of control server */
+    struct icli_strbuf in; /* incomplete request */
+    struct icli_strbuf out; /* output not sent yet, starting at out_off */
+    size_t out_off;
+    bool eof; /* client won't send more data */
+    bool closing; /* client executed "quit", the connection is closed once output is sent */
+    bool closed; /* client is disconnected and freed at the end of icli_server_poll() */
+};
+
+struct icli_server {
+    char *path;
+    bool bound; /* socket file was created by the server */
+    bool sessions; /* clients are interactive sessions */
+    int fd; /* listening socket */
+    int epfd;
+    int n_clients;
+    int max_clients;
+    uint32_t max_request_size;
+    LIST_HEAD(, icli_server_client) clients;
+    LIST_HEAD(, icli_server_client) closed; /* events of the clients may still be pending */
+    struct icli_strbuf line; /* command line of the executed request */
+    struct icli_sink sink; /* output of the executed request */
+    char buf[ICLI_SERVER_READ_SIZE]; /* data read from a client, shared so that idle clients hold no buffers */
+};
+
+static void icli_session_free(struct icli_session *session)
+{
+    if (!session)
+        return;
+
+    for (int i = 0; i < session->n_history; ++i)
+        icli_free(session->history[i]);
+    icli_free(session->history);
+    icli_free(session->saved_line);
+    icli_strbuf_free(&session->line);
+    icli_strbuf_free(&session->output);
+    icli_free(session);
+}
+
+static void icli_server_close(struct icli_server *server, struct icli_server_client *client)
+{
+    if (client->closed)
+        return;
+
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    client->closed = true;
+
+    LIST_REMOVE(client, entry);
+    LIST_INSERT_HEAD(&server->closed, client, entry);
+    --server->n_clients;
+}
+
+static void icli_server_free_closed(struct icli_server *server)
+{
+    while (!LIST_EMPTY(&server->closed)) {
+        struct icli_server_client *client = LIST_FIRST(&server->closed);
+
+        LIST_REMOVE(client, entry);
+        icli_set_mode(&client->mode, &client->modes, NULL);
+        icli_session_free(client->session);
+        icli_strbuf_free(&client->in);
+        icli_strbuf_free(&client->out);
+        icli_free(client);
+    }
+}
+
+/* Register CLIENT for reading unless it has too much unsent output, and for writing if it has any */
+static int icli_server_set_events(struct icli_server *server, struct icli_server_client *client)
+{
+    size_t pending = client->out.len - client->out_off;
+    struct epoll_event ev = {.data.ptr = client};
+
+    if (!client->eof && !client->closing && pending < ICLI_SERVER_OUT_MAX)
+        ev.events |= EPOLLIN;
+    if (pending)
+        ev.events |= EPOLLOUT;
+
+    if (ev.events == client->events)
+        return 0;
+
+    if (epoll_ctl(server->epfd, EPOLL_CTL_MOD, client->fd, &ev))
+        return -1;
+
+    client->events = ev.events;
+    return 0;
+}
+
+/* Execute LINE in the mode of CLIENT, writing output in FORMAT (-1 for default format) to SINK. Return exit status */
+static int icli_server_run(struct icli_server_client *client, char *line, int format, struct icli_sink *sink)
+{
+    struct icli_command *curr_cmd = icli.curr_cmd;
+    struct icli_mode_stack modes = icli.modes;
+    int prev_format = icli.format;
+    bool done = icli.done;
+    int ret;
+
+    icli.curr_cmd = client->mode;
+    icli.modes = client->modes;
+    if (format >= 0)
+        icli.format = format;
+
+    ret = icli_execute_capture(line, sink);
+
+    /* "quit" ends the connection, not the application */
+    client->closing = icli.done;
+    client->mode = icli.curr_cmd;
+    client->modes = icli.modes;
+
+    icli.done = done;
+    icli.format = prev_format;
+    icli.curr_cmd = curr_cmd;
+    icli.modes = modes;
+    /* the prompt may have been built for the client */
+    icli_build_prompt(curr_cmd);
+
+    return icli_exit_status(ret);
+}
+
+/* Writer of output of lines executed in a session. The terminal of the session is in raw mode, so new lines are sent
+   as CR LF */
+static void icli_session_write(const char *buf, size_t len, void *ctx)
+{
+    struct icli_session *session = ctx;
+    const char *end = buf + len;
+
+    while (buf < end) {
+        const char *eol = memchr(buf, '\n', (size_t)(end - buf));
+        size_t n = (size_t)((eol ? eol : end) - buf);
+
+        if ((n && icli_strbuf_append(&session->output, buf, n)) ||
+            (eol && icli_strbuf_puts(&session->output, "\r\n"))) {
+            icli.sink_failed = true;
+            return;
+        }
+
+        buf += n + (eol ? 1 : 0);
+    }
+}
+
+static void icli_session_write_err(const char *buf, size_t len, void *ctx)
+{
+    struct icli_session *session = ctx;
+
+    if (icli_strbuf_puts(&session->output, ANSI_RED_NORMAL)) {
+        icli.sink_failed = true;
+        return;
+    }
+
+    icli_session_write(buf, len, ctx);
+
+    if (icli_strbuf_puts(&session->output, ANSI_RESET))
+        icli.sink_failed = true;
+}
+
+/* Send prompt and the edited line of the session of CLIENT, and move the cursor to its position in the line */
+static int icli_session_redisplay(struct icli_server_client *client)
+{
+    struct icli_session *session = client->session;
+    int tail = session->point < session->line.len ? icli_text_width(session->line.data + session->point) : 0;
+    char move[32];
+
+    session->dirty = false;
+
+    if (icli_strbuf_puts(&client->out, "\r") || icli_prompt_append(&client->out, client->mode, &client->modes) ||
+        (session->line.len && icli_strbuf_append(&client->out, session->line.data, session->line.len)) ||
+        icli_strbuf_puts(&client->out, "\x1b[K"))
+        return -1;
+
+    if (tail) {
+        snprintf(move, sizeof(move), "\x1b[%dD", tail);
+        return icli_strbuf_puts(&client->out, move);
+    }
+
+    return 0;
+}
+
+/* Send the next page of output of the session of CLIENT, followed by "--More--" if the output continues, or by the
+   prompt */
+static int icli_session_page(struct icli_server_client *client)
+{
+    struct icli_session *session = client->session;
+    const char *page = session->output.data + session->output_off;
+    const char *end = session->output.data + session->output.len;
+    const char *p = page;
+
+    for (int n_lines = session->rows > 2 ? session->rows - 2 : INT_MAX; p < end && n_lines > 0; --n_lines) {
+        p = memchr(p, '\n', (size_t)(end - p));
+        p = p ? p + 1 : end;
+    }
+
+    if (p > page && icli_strbuf_append(&client->out, page, (size_t)(p - page)))
+        return -1;
+
+    if (p < end) {
+        session->output_off = (size_t)(p - session->output.data);
+        session->paging = true;
+        return icli_strbuf_puts(&client->out, MORE_STRING);
+    }
+
+    icli_strbuf_free(&session->output);
+    session->output_off = 0;
+    session->paging = false;
+
+    return icli_session_redisplay(client);
+}
+
+static int icli_session_insert(struct icli_session *session, const char *str, size_t len)
+{
+    if (icli_strbuf_reserve(&session->line, len))
+        return -1;
+
+    memmove(session->line.data + session->point + len,
+            session->line.data + session->point,
+            session->line.len - session->point);
+    memcpy(session->line.data + session->point, str, len);
+    session->line.len += len;
+    session->line.data[session->line.len] = '\0';
+    session->point += len;
+    session->dirty = true;
+
+    return 0;
+}
+
+/* Delete bytes of the line in [FROM, TO) */
+static void icli_session_delete(struct icli_session *session, size_t from, size_t to)
+{
+    if (from >= to)
+        return;
+
+    memmove(session->line.data + from, session->line.data + to, session->line.len - to + 1);
+    session->line.len -= to - from;
+    session->point = from;
+    session->dirty = true;
+}
+
+/* Position of UTF-8 character before POS */
+static size_t icli_session_prev_char(const struct icli_session *session, size_t pos)
+{
+    while (pos > 0 && ((unsigned char)session->line.data[--pos] & 0xc0) == 0x80)
+        ;
+
+    return pos;
+}
+
+/* Position of UTF-8 character after POS */
+static size_t icli_session_next_char(const struct icli_session *session, size_t pos)
+{
+    while (pos < session->line.len && ((unsigned char)session->line.data[++pos] & 0xc0) == 0x80)
+        ;
+
+    return pos;
+}
+
+static int icli_session_set_line(struct icli_session *session, const char *line)
+{
+    session->line.len = 0;
+    session->point = 0;
+    session->dirty = true;
+
+    return icli_session_insert(session, line, strlen(line));
+}
+
+static int icli_session_history_add(struct icli_session *session, const char *line)
+{
+    int max = icli.history_size > 0 ? icli.history_size : ICLI_SESSION_HISTORY;
+    char *entry;
+
+    if (session->n_history && strcmp(session->history[session->n_history - 1], line) == 0)
+        return 0;
+
+    if (!session->history) {
+        session->history = icli_calloc(ICLI_MEM_HISTORY, (size_t)max, sizeof(*session->history));
+        if (!session->history)
+            return -1;
+    }
+
+    entry = icli_strdup(ICLI_MEM_HISTORY, line);
+    if (!entry)
+        return -1;
+
+    if (session->n_history == max) {
+        icli_free(session->history[0]);
+        memmove(session->history, session->history + 1, (size_t)(max - 1) * sizeof(*session->history));
+        --session->n_history;
+    }
+
+    session->history[session->n_history++] = entry;
+    return 0;
+}
+
+/* Show the history entry DIR entries after the current one */
+static int icli_session_history_move(struct icli_session *session, int dir)
+{
+    int pos = session->hist_pos + dir;
+
+    if (pos < 0 || pos > session->n_history)
+        return 0;
+
+    if (session->hist_pos == session->n_history) {
+        icli_free(session->saved_line);
+        session->saved_line = icli_strdup(ICLI_MEM_HISTORY, session->line.len ? session->line.data : "");
+        if (!session->saved_line)
+            return -1;
+    }
+
+    session->hist_pos = pos;
+    return icli_session_set_line(session, pos == session->n_history ? session->saved_line : session->history[pos]);
+}
+
+static int icli_completion_complete(struct icli_completion_cache *cache,
+                                    const char *line,
+                                    const char *text,
+                                    size_t len,
+                                    int start);
+
+/* Complete the word before the cursor. Common prefix of the candidates is inserted, and the candidates are listed if
+   there is nothing to insert */
+static int icli_session_complete(struct icli_server_client *client)
+{
+    struct icli_session *session = client->session;
+    struct icli_completion_cache *cache = &icli.completion;
+    struct icli_command *curr_cmd = icli.curr_cmd;
+    const char *line = session->line.len ? session->line.data : "";
+    size_t start = session->point;
+    size_t common;
+    char *text;
+    int ret;
+
+    while (start > 0 && !isspace((unsigned char)line[start - 1]))
+        --start;
+
+    text = icli_strndup(ICLI_MEM_COMPLETION, line + start, session->point - start);
+    if (!text)
+        return -1;
+
+    /* candidates point into commands */
+    icli_read_lock();
+    icli.curr_cmd = client->mode;
+    ret = icli_completion_complete(cache, line, text, session->point - start, (int)start);
+    icli.curr_cmd = curr_cmd;
+
+    if (ret || cache->file || !cache->n_cands)
+        goto out;
+
+    common = strlen(cache->cands[0]);
+    for (size_t i = 1; i < cache->n_cands; ++i) {
+        size_t j = 0;
+
+        while (j < common && cache->cands[i][j] == cache->cands[0][j])
+            ++j;
+        common = j;
+    }
+
+    if (common > session->point - start) {
+        ret = icli_session_insert(session, cache->cands[0] + session->point - start, common - (session->point - start));
+        if (!ret && 1 == cache->n_cands)
+            ret = icli_session_insert(session, " ", 1);
+    } else if (cache->n_cands > 1) {
+        ret = (session->dirty && icli_session_redisplay(client)) || icli_strbuf_puts(&client->out, "\r\n");
+        for (size_t i = 0; i < cache->n_cands && !ret; ++i)
+            ret = icli_strbuf_puts(&client->out, cache->cands[i]) || icli_strbuf_puts(&client->out, "  ");
+        if (!ret)
+            ret = icli_strbuf_puts(&client->out, "\r\n");
+        session->dirty = true;
+    }
+
+out:
+    icli_read_unlock();
+    icli_free(text);
+    return ret;
+}
+
+/* Execute the edited line of the session of CLIENT */
+static int icli_session_submit(struct icli_server_client *client)
+{
+    struct icli_session *session = client->session;
+    struct icli_sink sink = {.out = {.write = icli_session_write, .ctx = session},
+                             .err = {.write = icli_session_write_err, .ctx = session}};
+    char *line = session->line.data;
+    char *s;
+    int ret = 0;
+
+    /* keys typed together with Enter were not echoed yet */
+    if (session->dirty && icli_session_redisplay(client))
+        return -1;
+
+    s = line ? stripwhite(line) : NULL;
+    session->line = (struct icli_strbuf){0};
+    session->point = 0;
+    icli_free(session->saved_line);
+    session->saved_line = NULL;
+
+    if (icli_strbuf_puts(&client->out, "\r\n")) {
+        ret = -1;
+        goto out;
+    }
+
+    if (s && *s) {
+        if (icli_session_history_add(session, s)) {
+            ret = -1;
+            goto out;
+        }
+
+        icli_server_run(client, s, -1, &sink);
+    }
+    session->hist_pos = session->n_history;
+
+    if (!client->closing)
+        ret = icli_session_page(client);
+
+out:
+    icli_free(line);
+    return ret;
+}
+
+/* Feed byte C to escape sequence parser of SESSION. Return the key, or ICLI_KEY_NONE while a sequence is incomplete.
+   Terminal size is reported by the client as "ESC [ 8 ; rows ; cols t" */
+static int icli_session_parse_key(struct icli_session *session, unsigned char c)
+{
+    switch (session->esc) {
+    case ICLI_ESC_NONE:
+        if (0x1b != c)
+            return c;
+
+        session->esc = ICLI_ESC_START;
+        return ICLI_KEY_NONE;
+    case ICLI_ESC_START:
+        if ('[' != c && 'O' != c) {
+            session->esc = ICLI_ESC_NONE;
+            return ICLI_KEY_OTHER;
+        }
+
+        session->esc = ICLI_ESC_CSI;
+        session->csi_len = 0;
+        return ICLI_KEY_NONE;
+    case ICLI_ESC_CSI:
+        if (c >= 0x30 && c <= 0x3f) {
+            if (session->csi_len < sizeof(session->csi) - 1)
+                session->csi[session->csi_len++] = (char)c;
+            return ICLI_KEY_NONE;
+        }
+
+        session->esc = ICLI_ESC_NONE;
+        session->csi[session->csi_len] = '\0';
+        break;
+    }
+
+    switch (c) {
+    case 'A':
+        return ICLI_KEY_UP;
+    case 'B':
+        return ICLI_KEY_DOWN;
+    case 'C':
+        return ICLI_KEY_RIGHT;
+    case 'D':
+        return ICLI_KEY_LEFT;
+    case 'H':
+        return ICLI_KEY_HOME;
+    case 'F':
+        return ICLI_KEY_END;
+    case 't':
+        if (sscanf(session->csi, "8;%d;%d", &session->rows, &session->cols) == 2)
+            return ICLI_KEY_NONE;
+        break;
+    case '~':
+        if (strcmp(session->csi, "3") == 0)
+            return ICLI_KEY_DELETE;
+        if (strcmp(session->csi, "1") == 0 || strcmp(session->csi, "7") == 0)
+            return ICLI_KEY_HOME;
+        if (strcmp(session->csi, "4") == 0 || strcmp(session->csi, "8") == 0)
+            return ICLI_KEY_END;
+        break;
+    }
+
+    return ICLI_KEY_OTHER;
+}
+
+/* Handle KEY typed in the line editor of the session of CLIENT */
+static int icli_session_edit(struct icli_server_client *client, int key)
+{
+    struct icli_session *session = client->session;
+    size_t pos;
+
+    switch (key) {
+    case '\r':
+    case '\n':
+        return icli_session_submit(client);
+    case 'A' & 0x1f:
+    case ICLI_KEY_HOME:
+        session->point = 0;
+        break;
+    case 'E' & 0x1f:
+    case ICLI_KEY_END:
+        session->point = session->line.len;
+        break;
+    case 'B' & 0x1f:
+    case ICLI_KEY_LEFT:
+        session->point = icli_session_prev_char(session, session->point);
+        break;
+    case 'F' & 0x1f:
+    case ICLI_KEY_RIGHT:
+        session->point = icli_session_next_char(session, session->point);
+        break;
+    case 'P' & 0x1f:
+    case ICLI_KEY_UP:
+        return icli_session_history_move(session, -1);
+    case 'N' & 0x1f:
+    case ICLI_KEY_DOWN:
+        return icli_session_history_move(session, 1);
+    case 0x7f:
+    case 'H' & 0x1f:
+        icli_session_delete(session, icli_session_prev_char(session, session->point), session->point);
+        break;
+    case ICLI_KEY_DELETE:
+        icli_session_delete(session, session->point, icli_session_next_char(session, session->point));
+        break;
+    case 'D' & 0x1f:
+        if (!session->line.len) {
+            client->closing = true;
+            return icli_strbuf_puts(&client->out, "\r\n");
+        }
+        icli_session_delete(session, session->point, icli_session_next_char(session, session->point));
+        break;
+    case 'K' & 0x1f:
+        icli_session_delete(session, session->point, session->line.len);
+        break;
+    case 'U' & 0x1f:
+        icli_session_delete(session, 0, session->point);
+        break;
+    case 'W' & 0x1f:
+        for (pos = session->point; pos > 0 && isspace((unsigned char)session->line.data[pos - 1]); --pos)
+            ;
+        while (pos > 0 && !isspace((unsigned char)session->line.data[pos - 1]))
+            --pos;
+        icli_session_delete(session, pos, session->point);
+        break;
+    case 'C' & 0x1f:
+        session->line.len = 0;
+        session->point = 0;
+        session->hist_pos = session->n_history;
+        session->dirty = true;
+        return icli_strbuf_puts(&client->out, "^C\r\n");
+    case 'L' & 0x1f:
+        session->dirty = true;
+        return icli_strbuf_puts(&client->out, "\x1b[H\x1b[2J");
+    case '\t':
+        return icli_session_complete(client);
+    default:
+        if (key >= 0x20 && key < 0x100) {
+            char c = (char)key;
+            return icli_session_insert(session, &c, 1);
+        }
+        return 0;
+    }
+
+    session->dirty = true;
+    return 0;
+}
+
+/* Handle LEN bytes of DATA typed in the session of CLIENT. The line is redisplayed once for all of them */
+static int icli_session_input(struct icli_server_client *client, const char *data, size_t len)
+{
+    struct icli_session *session = client->session;
+
+    for (size_t i = 0; i < len && !client->closing; ++i) {
+        int key = icli_session_parse_key(session, (unsigned char)data[i]);
+        int ret;
+
+        if (ICLI_KEY_NONE == key)
+            continue;
+
+        /* LF of CR LF sent by some terminals */
+        if ('\n' == key && '\r' == session->last_key) {
+            session->last_key = key;
+            continue;
+        }
+        session->last_key = key;
+
+        if (session->paging) {
+            /* erase "--More--" and show the next page, or stop paging on 'q' */
+            if (icli_strbuf_puts(&client->out, "\r\x1b[K"))
+                return -1;
+
+            if ('q' == key) {
+                session->output.len = session->output_off;
+                ret = icli_session_page(client);
+            } else {
+                ret = icli_session_page(client);
+            }
+        } else {
+            ret = icli_session_edit(client, key);
+        }
+
+        if (ret)
+            return -1;
+    }
+
+    if (session->dirty && !session->paging && !client->closing)
+        return icli_session_redisplay(client);
+
+    return 0;
+}
+
+static void icli_server_accept(struct icli_server *server)
+{
+    for (;;) {
+        struct icli_server_client *client;
+        struct epoll_event ev = {.events = EPOLLIN};
+        int fd = accept4(server->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN != errno && EWOULDBLOCK != errno)
+                icli_api_printf("Unable to accept client (%m)\n");
+            return;
+        }
+
+        if (server->n_clients >= server->max_clients) {
+            close(fd);
+            continue;
+        }
+
+        client = icli_calloc(ICLI_MEM_SERVERS, 1, sizeof(*client));
+        if (!client ||
+            (server->sessions && !(client->session = icli_calloc(ICLI_MEM_SERVERS, 1, sizeof(*client->session))))) {
+            icli_api_printf("Unable to allocate memory for client\n");
+            icli_free(client);
+            close(fd);
+            continue;
+        }
+
+        client->fd = fd;
+        client->events = ev.events;
+        icli_set_mode(&client->mode, &client->modes, icli.root_cmd);
+        ev.data.ptr = client;
+
+        if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            icli_api_printf("Unable to register client (%m)\n");
+            icli_set_mode(&client->mode, &client->modes, NULL);
+            icli_session_free(client->session);
+            icli_free(client);
+            close(fd);
+            continue;
+        }
+
+        LIST_INSERT_HEAD(&server->clients, client, entry);
+        ++server->n_clients;
+
+        /* the prompt is sent once the client is writable */
+        if (client->session && (icli_session_redisplay(client) || icli_server_set_events(server, client)))
+            icli_server_close(server, client);
+    }
+}
+
+/* Execute request ID of CLIENT with payload of LEN bytes, and append the response to the output of the client */
+static int icli_server_execute(struct icli_server *server,
+                               struct icli_server_client *client,
+                               uint32_t id,
+                               const char *payload,
+                               uint32_t len)
+{
+    struct icli_server_response resp = {.id = id, .status = ICLI_EXIT_USAGE};
+    const char *sep = memchr(payload, '\0', len);
+    const char *err = NULL;
+    int format = -1;
+
+    server->sink.out.len = 0;
+    server->sink.err.len = 0;
+    server->line.len = 0;
+
+    if (!sep)
+        err = "Malformed request\n";
+    else if (*payload && (format = icli_find_renderer(payload)) < 0)
+        err = "No such output format\n";
+    else if (icli_strbuf_append(&server->line, sep + 1, len - (size_t)(sep + 1 - payload)))
+        return -1;
+
+    if (!err) {
+        resp.status = icli_server_run(client, server->line.data, format, &server->sink);
+        resp.out_len = (uint32_t)server->sink.out.len;
+        resp.err_len = (uint32_t)server->sink.err.len;
+    } else {
+        resp.err_len = (uint32_t)strlen(err);
+    }
+
+    if (icli_strbuf_append(&client->out, (const char *)&resp, sizeof(resp)) ||
+        (resp.out_len && icli_strbuf_append(&client->out, server->sink.out.buf, resp.out_len)) ||
+        (resp.err_len && icli_strbuf_append(&client->out, err ? err : server->sink.err.buf, resp.err_len))) {
+        icli_api_printf("Unable to allocate memory for response\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Execute complete requests in LEN bytes of DATA received from CLIENT, after the incomplete request received before */
+static int icli_server_requests(struct icli_server *server, struct icli_server_client *client, char *data, size_t len)
+{
+    struct icli_server_request req;
+    size_t off = 0;
+
+    if (client->in.len) {
+        if (icli_strbuf_append(&client->in, data, len))
+            return -1;
+        data = client->in.data;
+        len = client->in.len;
+    }
+
+    while (!client->closing && len - off >= sizeof(req)) {
+        memcpy(&req, data + off, sizeof(req));
+
+        /* the stream can't be resynchronized */
+        if (req.len > server->max_request_size)
+            return -1;
+
+        if (len - off < sizeof(req) + req.len)
+            break;
+
+        if (icli_server_execute(server, client, req.id, data + off + sizeof(req), req.len))
+            return -1;
+
+        off += sizeof(req) + req.len;
+    }
+
+    /* keep only the incomplete request */
+    if (data == client->in.data) {
+        memmove(client->in.data, client->in.data + off, len - off);
+        client->in.len = len - off;
+        if (!client->in.len)
+            icli_strbuf_free(&client->in);
+    } else if (off < len && icli_strbuf_append(&client->in, data + off, len - off)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Read data of CLIENT - requests, or keys typed in its session - and handle it */
+static int icli_server_read(struct icli_server *server, struct icli_server_client *client)
+{
+    ssize_t n = recv(client->fd, server->buf, sizeof(server->buf), MSG_DONTWAIT);
+
+    if (n < 0)
+        return EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+
+    if (0 == n) {
+        client->eof = true;
+        return 0;
+    }
+
+    if (client->session)
+        return icli_session_input(client, server->buf, (size_t)n);
+
+    return icli_server_requests(server, client, server->buf, (size_t)n);
+}
+
+/* Send output of CLIENT, which was not sent yet. Return -1 if the client should be disconnected */
+static int icli_server_flush(struct icli_server *server, struct icli_server_client *client)
+{
+    while (client->out_off < client->out.len) {
+        ssize_t n = send(client->fd,
+                         client->out.data + client->out_off,
+                         client->out.len - client->out_off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+            return -1;
+        }
+
+        client->out_off += (size_t)n;
+    }
+
+    if (client->out_off == client->out.len) {
+        icli_strbuf_free(&client->out);
+        client->out_off = 0;
+
+        if (client->eof || client->closing)
+            return -1;
+    }
+
+    return icli_server_set_events(server, client);
+}
+
+struct icli_server *icli_server_create(const struct icli_server_params *params)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    struct icli_server *server;
+    struct stat st;
+
+    if (!params || !params->path) {
+        icli_api_printf("NULL params or path specified\n");
+        return NULL;
+    }
+
+    if (strlen(params->path) >= sizeof(addr.sun_path)) {
+        icli_api_printf("Socket path %s is too long\n", params->path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, params->path);
+
+    server = icli_calloc(ICLI_MEM_SERVERS, 1, sizeof(*server));
+    if (!server) {
+        icli_api_printf("Unable to allocate memory for server\n");
+        return NULL;
+    }
+
+    server->fd = server->epfd = -1;
+    server->sessions = params->sessions != 0;
+    server->max_clients = params->max_clients > 0 ? params->max_clients : ICLI_SERVER_MAX_CLIENTS;
+    server->max_request_size = params->max_request_size ? params->max_request_size : ICLI_SERVER_MAX_REQUEST;
+    LIST_INIT(&server->clients);
+    LIST_INIT(&server->closed);
+
+    server->path = icli_strdup(ICLI_MEM_SERVERS, params->path);
+    if (!server->path) {
+        icli_api_printf("Unable to allocate memory for server path\n");
+        goto err;
+    }
+
+    /* socket left by previous instance of the server */
+    if (stat(server->path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(server->path);
+
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->fd < 0 || bind(server->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        icli_api_printf("Unable to bind to %s (%m)\n", server->path);
+        goto err;
+    }
+    server->bound = true;
+
+    if (listen(server->fd, SOMAXCONN)) {
+        icli_api_printf("Unable to listen on %s (%m)\n", server->path);
+        goto err;
+    }
+
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epfd < 0 || epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->fd, &ev)) {
+        icli_api_printf("Unable to create epoll instance (%m)\n");
+        goto err;
+    }
+
+    return server;
+err:
+    icli_server_destroy(server);
+    return NULL;
+}
+
+int icli_server_fd(struct icli_server *server)
+{
+    return server->epfd;
+}
+
+int icli_server_poll(struct icli_server *server, int timeout_ms)
+{
+    struct epoll_event events[ICLI_SERVER_EVENTS];
+    int n = epoll_wait(server->epfd, events, (int)array_len(events), timeout_ms);
+
+    if (n < 0)
+        return EINTR == errno ? 0 : -1;
+
+    for (int i = 0; i < n; ++i) {
+        struct icli_server_client *client = events[i].data.ptr;
+
+        if (!client) {
+            icli_server_accept(server);
+            continue;
+        }
+
+        if (client->closed)
+            continue;
+
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && icli_server_read(server, client)) {
+            icli_server_close(server, client);
+            continue;
+        }
+
+        /* responses of all requests read are sent together */
+        if (icli_server_flush(server, client))
+            icli_server_close(server, client);
+    }
+
+    icli_server_free_closed(server);
+    return n;
+}
+
+void icli_server_destroy(struct icli_server *server)
+{
+    if (!server)
+        return;
+
+    while (!LIST_EMPTY(&server->clients))
+        icli_server_close(server, LIST_FIRST(&server->clients));
+    icli_server_free_closed(server);
+
+    if (server->epfd >= 0)
+        close(server->epfd);
+    if (server->fd >= 0)
+        close(server->fd);
+    if (server->bound)
+        unlink(server->path);
+
+    icli_free(server->path);
+    icli_strbuf_free(&server->line);
+    /* captured output is grown with realloc(), as for any caller of icli_execute_capture() */
+    free(server->sink.out.buf);
+    free(server->sink.err.buf);
+    icli_free(server);
+}
+
+int icli_execute_line(char *line)
+{
+    enum icli_separator prev_sep = SEP_SEQ;
+    enum icli_separator sep;
+    int ret = 0;
+    char *end;
+
+    /* the whole batch is a single output unit for paging purposes */
+    icli.curr_row = 0;
+    icli.skip_output = false;
+
+    /* commands seen while executing the batch are not freed before it is done */
+    icli_read_lock();
+
+    /* the line was typed for commands of the mode, so it is not executed in another one */
+    if (icli_leave_removed_mode(true)) {
+        icli.cmd_ret = ICLI_ERR;
+        ret = -1;
+        goto out;
+    }
+
+    do {
+        end = icli_next_separator(line, &sep);
+        *end = '\0';
+
+        char *stripped = stripwhite(line);
+
+        /* commands chained with && are skipped once something before them failed */
+        if (*stripped && !(SEP_AND == prev_sep && ret))
+            ret = icli_execute_single(stripped);
+
+        if (SEP_AND == sep)
+            ++end;
+
+        line = end + 1;
+        prev_sep = sep;
+    } while (SEP_END != sep && !icli.done);
+
+    /* a command may have unregistered the mode */
+    icli_leave_removed_mode(false);
+
+out:
+    icli_read_unlock();
+
+    icli.skip_output = false;
+    /* output of batch redirected to a file or a pipe is written in large chunks, icli_run_batch() flushes it when
+       the input is idle. Lines executed directly by the application are flushed, so their output is seen */
+    if (icli.color || !icli.batch)
+        fflush(stdout);
+
+    return ret;
+}
+
+/* Fixed point scale of usage scores */
+#define ICLI_USAGE_SCALE 1024
+/* Number of executions after which the weight of a command usage is halved */
+#define ICLI_USAGE_RECENCY_SCALE 64
+
+/* Rank of a command - number of executions decayed by how long ago it was last executed */
+static uint64_t icli_usage_score(const struct icli_usage *usage)
+{
+    uint32_t age = icli.usage_tick - usage->last;
+
+    return (uint64_t)usage->count * ICLI_USAGE_SCALE * ICLI_USAGE_RECENCY_SCALE / (ICLI_USAGE_RECENCY_SCALE + age);
+}
+
+static int icli_cmp_usage(const void *a, const void *b)
+{
+    const struct icli_command *cmd_a = *(struct icli_command *const *)a;
+    const struct icli_command *cmd_b = *(struct icli_command *const *)b;
+    uint64_t score_a = icli_usage_score(&cmd_a->usage);
+    uint64_t score_b = icli_usage_score(&cmd_b->usage);
+
+    if (score_a != score_b)
+        return score_a < score_b ? 1 : -1;
+
+    return strcmp(cmd_a->name, cmd_b->name);
+}
+
+static int icli_completion_reserve(struct icli_completion_cache *cache, size_t n_cands)
+{
+    if (n_cands <= cache->size)
+        return 0;
+
+    const char **cands = icli_realloc(ICLI_MEM_COMPLETION, cache->cands, n_cands * sizeof(*cands));
+    if (!cands)
+        return -1;
+
+    cache->cands = cands;
+    cache->size = n_cands;
+
+    return 0;
+}
+
+/* Collect names of commands of the current mode starting with TEXT, ranked by their usage */
+static int icli_completion_fill_commands(struct icli_completion_cache *cache, const char *text, size_t len)
+{
+    struct icli_command **cmds;
+    struct icli_command *it;
+    size_t n_cmds = 0, size = 0;
+
+    icli_init_builtins(icli.curr_cmd);
+
+    /* commands may be registered by other threads meanwhile, so the list is counted rather than n_cmds trusted */
+    LIST_FOREACH(it, &icli.curr_cmd->cmd_list, cmd_list_entry)
+        size += strncmp(it->name, text, len) == 0;
+
+    cmds = icli_malloc(ICLI_MEM_COMPLETION, (size ? size : 1) * sizeof(*cmds));
+    if (!cmds)
+        return -1;
+
+    LIST_FOREACH(it, &icli.curr_cmd->cmd_list, cmd_list_entry)
+    {
+        if (n_cmds < size && strncmp(it->name, text, len) == 0)
+            cmds[n_cmds++] = it;
+    }
+
+    qsort(cmds, n_cmds, sizeof(*cmds), icli_cmp_usage);
+
+    if (icli_completion_reserve(cache, n_cmds)) {
+        icli_free(cmds);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n_cmds; ++i)
+        cache->cands[i] = cmds[i]->name;
+    cache->n_cands = n_cmds;
+
+    icli_free(cmds);
+    return 0;
+}
+
+/* Collect values of argument ARG of ARGS starting with TEXT */
+static int icli_completion_fill_arg(struct icli_completion_cache *cache,
+                                    const struct icli_args *args,
+                                    int arg,
+                                    const char *text,
+                                    size_t len)
+{
+    const struct icli_vals *vals;
+    int lo, hi;
+
+    cache->file = AT_File == args->argv[arg].type;
+
+    if (AT_Val != args->argv[arg].type && AT_Enum != args->argv[arg].type)
+        return 0;
+
+    vals = icli_arg_vals(&args->priv[arg]);
+    if (!vals)
+        return 0;
+
+    /* the index yields the candidates in sorted order */
+    icli_index_range(vals->index, text, &lo, &hi);
+    if (icli_completion_reserve(cache, (size_t)(hi - lo)))
+        return -1;
+
+    for (int i = lo; i < hi; ++i)
+        cache->cands[cache->n_cands++] = icli_index_name(vals->index, i);
+
+    return 0;
+}
+
+/* Store copy of LEN bytes of STR in *BUF */
+static int icli_completion_store(char **buf, size_t *size, const char *str, size_t len)
+{
+    if (len + 1 > *size) {
+        char *tmp = icli_realloc(ICLI_MEM_COMPLETION, *buf, len + 1);
+        if (!tmp)
+            return -1;
+        *buf = tmp;
+        *size = len + 1;
+    }
+
+    memcpy(*buf, str, len);
+    (*buf)[len] = '\0';
+
+    return 0;
+}
+
+/* Check whether the cached result can be reused for completing TEXT starting at START of LINE */
+static bool icli_completion_cached(struct icli_completion_cache *cache,
+                                   const char *line,
+                                   const char *text,
+                                   size_t len,
+                                   int start)
+{
+    return cache->valid && cache->mode == icli.curr_cmd &&
+           cache->tree_gen == __atomic_load_n(&icli.tree_gen, __ATOMIC_ACQUIRE) &&
+           cache->usage_tick == icli.usage_tick && cache->line_len == (size_t)start &&
+           memcmp(cache->line, line, cache->line_len) == 0 && len >= cache->text_len &&
+           strncmp(text, cache->text, cache->text_len) == 0;
+}
+
+/* Collect keywords which may follow arguments of command with grammar and start with TEXT */
+static int icli_completion_fill_grammar(struct icli_completion_cache *cache,
+                                        struct icli_grammar *grammar,
+                                        char *argv[],
+                                        int argc,
+                                        const char *text,
+                                        size_t len)
+{
+    struct icli_gram_run run;
+
+    if (icli_grammar_run(grammar, argv, argc, &run, NULL) < argc)
+        return 0;
+
+    if (icli_completion_reserve(cache, (size_t)run.n_pcs))
+        return -1;
+
+    for (int i = 0; i < run.n_pcs; ++i) {
+        const struct icli_gram_inst *inst = &grammar->insts[run.pcs[i]];
+        bool dup = false;
+
+        if (GOP_WORD != inst->op || strncmp(inst->str, text, len) != 0)
+            continue;
+
+        for (size_t j = 0; j < cache->n_cands && !dup; ++j)
+            dup = strcmp(cache->cands[j], inst->str) == 0;
+
+        if (!dup)
+            cache->cands[cache->n_cands++] = inst->str;
+    }
+
+    return 0;
+}
+
+/* Resolve completion context of the word starting at START of LINE_BUF and collect candidates for TEXT */
+static int icli_completion_fill(struct icli_completion_cache *cache,
+                                const char *line_buf,
+                                const char *text,
+                                size_t len,
+                                int start)
+{
+    static char *argv[ICLI_ARGS_MAX];
+    enum icli_separator sep;
+    char *cmd;
+    char *line;
+
+    cache->valid = false;
+    cache->n_cands = 0;
+    cache->file = false;
+
+    /* commands changed from now on by other threads invalidate the candidates */
+    icli_init_builtins(icli.curr_cmd);
+    cache->tree_gen = __atomic_load_n(&icli.tree_gen, __ATOMIC_ACQUIRE);
+
+    if (icli_completion_store(&cache->line, &cache->line_size, line_buf, (size_t)start) ||
+        icli_completion_store(&cache->scratch, &cache->scratch_size, line_buf, (size_t)start))
+        return -1;
+
+    /* only the last command of a batch is completed */
+    line = cache->scratch;
+    for (char *end = icli_next_separator(line, &sep); SEP_END != sep; end = icli_next_separator(line, &sep))
+        line = end + (SEP_AND == sep ? 2 : 1);
+
+    int argc = icli_parse_line(line, &cmd, argv, array_len(argv));
+
+    cache->cmd = NULL;
+    cache->arg = 0;
+
+    if (!*cmd) {
+        if (icli_completion_fill_commands(cache, text, len))
+            return -1;
+    } else {
+        struct icli_command *command = icli_find_command(cmd);
+        const struct icli_args *args = command ? icli_command_args(command) : NULL;
+
+        if (args && argc < args->argc) {
+            cache->cmd = command;
+            cache->arg = argc;
+            if (icli_completion_fill_arg(cache, args, argc, text, len))
+                return -1;
+        } else if (command && command->grammar) {
+            cache->cmd = command;
+            cache->arg = argc;
+            if (icli_completion_fill_grammar(cache, command->grammar, argv, argc, text, len))
+                return -1;
+        }
+    }
+
+    cache->mode = icli.curr_cmd;
+    cache->usage_tick = icli.usage_tick;
+    cache->line_len = (size_t)start;
+    cache->valid = true;
+
+    return 0;
+}
+
+/* Narrow cached candidates to the ones starting with TEXT, keeping their order */
+static void icli_completion_narrow(struct icli_completion_cache *cache, const char *text, size_t len)
+{
+    size_t n_cands = 0;
+
+    if (len == cache->text_len)
+        return;
+
+    for (size_t i = 0; i < cache->n_cands; ++i) {
+        if (strncmp(cache->cands[i] + cache->text_len, text + cache->text_len, len - cache->text_len) == 0)
+            cache->cands[n_cands++] = cache->cands[i];
+    }
+
+    cache->n_cands = n_cands;
+}
+
+/* Collect candidates for completing TEXT of LEN bytes starting at START of LINE */
+static int icli_completion_complete(struct icli_completion_cache *cache,
+                                    const char *line,
+                                    const char *text,
+                                    size_t len,
+                                    int start)
+{
+    if (icli_completion_cached(cache, line, text, len, start)) {
+        icli_completion_narrow(cache, text, len);
+    } else if (icli_completion_fill(cache, line, text, len, start)) {
+        cache->valid = false;
+        return -1;
+    }
+
+    if (icli_completion_store(&cache->text, &cache->text_size, text, len)) {
+        cache->valid = false;
+        return -1;
+    }
+    cache->text_len = len;
+
+    return 0;
+}
+
+/* Generator function for completion.  STATE lets us
+   know whether to start from scratch; without any state
+   (i.e. STATE == 0), then we start at the top of the list.
+   Candidates are served from the completion cache. */
+static char *icli_completion_generator(const char *text UNUSED, int state)
+{
+    struct icli_completion_cache *cache = &icli.completion;
+
+    if (!state)
+        cache->pos = 0;
+
+    /* Return the next candidate */
+    if (cache->pos < cache->n_cands)
+        return strdup(cache->cands[cache->pos++]); /* freed by the line editor */
+
+    /* If no names matched, then return NULL. */
+    return (char *)NULL;
+}
+
+/* Attempt to complete on the contents of TEXT.  START and END
+   bound the region of rl_line_buffer that contains the word to
+   complete.  TEXT is the word to complete.  The result of the last
+   completion is cached, so repeated TAB presses on the same word, or
+   presses after extending it, only narrow down the previous candidates.
+   Return the array of matches, or NULL if there aren't any. */
+static char **icli_completion(const char *text, int start, int end UNUSED)
+{
+    struct icli_completion_cache *cache = &icli.completion;
+    size_t len = text ? strlen(text) : 0;
+
+    char **matches = NULL;
+
+    /* Don't do filename completion even if our generator finds no matches. */
+    rl_attempted_completion_over = 1;
+
+    /* candidates point into commands */
+    icli_read_lock();
+
+    if (icli_completion_complete(cache, rl_line_buffer, text, len, start))
+        goto out;
+
+    if (cache->file) {
+        /* make readline attempt to complete with file name */
+        rl_attempted_completion_over = 0;
+        goto out;
+    }
+
+    matches = completion_matches((char *)text, icli_completion_generator);
+out:
+    icli_read_unlock();
+    return matches;
+}
+
+static void icli_completion_cleanup(void)
+{
+    struct icli_completion_cache *cache = &icli.completion;
+
+    icli_free(cache->line);
+    icli_free(cache->scratch);
+    icli_free(cache->text);
+    icli_free(cache->cands);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/* Separates mode path from the line in history file. It is written for root mode too (with empty path), so that the
+   line may contain it. Lines without it are lines of root mode written by older versions */
+#define ICLI_HIST_MODE_SEP '\t'
+
+/* Number of journal appends between fdatasync() calls */
+#define ICLI_HIST_SYNC_BATCH 16
+/* Journal is compacted once it holds ICLI_HIST_COMPACT_FACTOR times history_size lines */
+#define ICLI_HIST_COMPACT_FACTOR 2
+/* Header of history files written by libedit write_history() */
+#define ICLI_HIST_LEGACY_HEADER "_HiStOrY_V2_\n"
+
+/* Decode line written by libedit write_history() (strvis(3) encoded) in place */
+static void icli_hist_unvis(char *line)
+{
+    char *out = line;
+
+    while (*line) {
+        if ('\\' == line[0] && '\\' == line[1]) {
+            *out++ = '\\';
+            line += 2;
+        } else if ('\\' == line[0] && line[1] >= '0' && line[1] <= '3' && line[2] >= '0' && line[2] <= '7' &&
+                   line[3] >= '0' && line[3] <= '7') {
+            *out++ = (char)(((line[1] - '0') << 6) | ((line[2] - '0') << 3) | (line[3] - '0'));
+            line += 4;
+        } else {
+            *out++ = *line++;
+        }
+    }
+
+    *out = '\0';
+}
+
+/* Memory mapped history file */
+struct icli_hist_map {
+    char *data;
+    size_t size;
+    const char *begin; /* first line (after legacy header if exists) */
+    const char *end;
+    bool legacy; /* file was written by libedit write_history() */
+};
+
+static int icli_hist_map(int fd, struct icli_hist_map *map)
+{
+    struct stat st;
+
+    memset(map, 0, sizeof(*map));
+
+    if (fstat(fd, &st))
+        return -1;
+
+    if (0 == st.st_size)
+        return 0;
+
+    map->size = (size_t)st.st_size;
+    map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == map->data) {
+        map->data = NULL;
+        return -1;
+    }
+
+    map->begin = map->data;
+    map->end = map->data + map->size;
+
+    if (map->size >= sizeof(ICLI_HIST_LEGACY_HEADER) - 1 &&
+        memcmp(map->data, ICLI_HIST_LEGACY_HEADER, sizeof(ICLI_HIST_LEGACY_HEADER) - 1) == 0) {
+        map->legacy = true;
+        map->begin += sizeof(ICLI_HIST_LEGACY_HEADER) - 1;
+    }
+
+    return 0;
+}
+
+static int icli_hist_count_lines(const struct icli_hist_map *map)
+{
+    int n_lines = 0;
+
+    for (const char *p = map->begin; p < map->end; ++n_lines) {
+        p = memchr(p, '\n', (size_t)(map->end - p));
+        if (!p)
+            p = map->end;
+        ++p;
+    }
+
+    return n_lines;
+}
+
+static void icli_hist_unmap(struct icli_hist_map *map)
+{
+    if (map->data)
+        munmap(map->data, map->size);
+    memset(map, 0, sizeof(*map));
+}
+
+/* Call CB on each of the last N_LINES lines of mapped history file. The tail is found by scanning backwards, so the
+   cost does not depend on the size of the file */
+static int icli_hist_foreach_tail(struct icli_hist_map *map,
+                                  int n_lines,
+                                  int (*cb)(const char *line, void *arg),
+                                  void *arg)
+{
+    const char *tail = map->end;
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    int ret = 0;
+
+    if (tail > map->begin && '\n' == tail[-1])
+        --tail;
+
+    for (int i = 0; i < n_lines && tail > map->begin; ++i) {
+        const char *eol = memrchr(map->begin, '\n', (size_t)(tail - map->begin));
+        tail = eol ? eol : map->begin;
+    }
+
+    if (tail < map->end && '\n' == *tail)
+        ++tail;
+
+    for (const char *p = tail, *eol; p < map->end; p = eol + 1) {
+        eol = memchr(p, '\n', (size_t)(map->end - p));
+        if (!eol)
+            eol = map->end;
+
+        if (eol == p)
+            continue;
+
+        size_t len = (size_t)(eol - p);
+        if (len + 1 > buf_sz) {
+            char *tmp = icli_realloc(ICLI_MEM_HISTORY, buf, len + 1);
+            if (!tmp) {
+                ret = -1;
+                break;
+            }
+            buf = tmp;
+            buf_sz = len + 1;
+        }
+
+        memcpy(buf, p, len);
+        buf[len] = '\0';
+
+        if (map->legacy)
+            icli_hist_unvis(buf);
+
+        ret = cb(buf, arg);
+        if (ret)
+            break;
+    }
+
+    icli_free(buf);
+    return ret;
+}
+
+#define ICLI_HIST_INDEX_INIT_SIZE 1024
+/* Maximal number of results printed by 'history search' */
+#define ICLI_HIST_SEARCH_MAX 32
+/* Number of additions after which the recency weight of an entry is halved */
+#define ICLI_HIST_RECENCY_SCALE 64
+/* Weight of entries executed in the current mode relative to entries of other modes */
+#define ICLI_HIST_MODE_WEIGHT 4
+
+static uint32_t icli_hash(const char *str, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t icli_hist_gram(const char *str)
+{
+    return (uint32_t)(uint8_t)str[0] << 16 | (uint32_t)(uint8_t)str[1] << 8 | (uint8_t)str[2];
+}
+
+static uint32_t icli_hist_gram_hash(uint32_t gram)
+{
+    return gram * 2654435761u;
+}
+
+static uint32_t icli_hist_entry_hash(const char *mode, const char *line)
+{
+    uint32_t hash = icli_hash(line, strlen(line));
+
+    if (mode)
+        hash ^= icli_hash(mode, strlen(mode)) * 31;
+
+    return hash;
+}
+
+static bool icli_hist_mode_eq(const char *mode_a, const char *mode_b)
+{
+    if (!mode_a || !mode_b)
+        return mode_a == mode_b;
+
+    return strcmp(mode_a, mode_b) == 0;
+}
+
+static int icli_hist_index_grow_lines(struct icli_hist_index *index)
+{
+    uint32_t size = index->lines_size ? index->lines_size * 2 : ICLI_HIST_INDEX_INIT_SIZE;
+    uint32_t *lines = icli_calloc(ICLI_MEM_HISTORY, size, sizeof(*lines));
+
+    if (!lines)
+        return -1;
+
+    for (uint32_t id = 0; id < index->n_entries; ++id) {
+        uint32_t slot = icli_hist_entry_hash(index->entries[id].mode, index->entries[id].line) & (size - 1);
+
+        while (lines[slot])
+            slot = (slot + 1) & (size - 1);
+        lines[slot] = id + 1;
+    }
+
+    icli_free(index->lines);
+    index->lines = lines;
+    index->lines_size = size;
+
+    return 0;
+}
+
+static int icli_hist_index_grow_grams(struct icli_hist_index *index)
+{
+    uint32_t size = index->grams_size ? index->grams_size * 2 : ICLI_HIST_INDEX_INIT_SIZE;
+    struct icli_hist_posting *grams = icli_calloc(ICLI_MEM_HISTORY, size, sizeof(*grams));
+
+    if (!grams)
+        return -1;
+
+    for (uint32_t i = 0; i < index->grams_size; ++i) {
+        if (!index->grams[i].gram)
+            continue;
+
+        uint32_t slot = icli_hist_gram_hash(index->grams[i].gram) & (size - 1);
+        while (grams[slot].gram)
+            slot = (slot + 1) & (size - 1);
+        grams[slot] = index->grams[i];
+    }
+
+    icli_free(index->grams);
+    index->grams = grams;
+    index->grams_size = size;
+
+    return 0;
+}
+
+static struct icli_hist_posting *icli_hist_index_find_gram(struct icli_hist_index *index, uint32_t gram, bool create)
+{
+    if (!index->grams_size) {
+        if (!create || icli_hist_index_grow_grams(index))
+            return NULL;
+    }
+
+    uint32_t slot = icli_hist_gram_hash(gram) & (index->grams_size - 1);
+
+    while (index->grams[slot].gram) {
+        if (index->grams[slot].gram == gram)
+            return &index->grams[slot];
+        slot = (slot + 1) & (index->grams_size - 1);
+    }
+
+    if (!create)
+        return NULL;
+
+    if ((index->n_grams + 1) * 10 > index->grams_size * 7) {
+        if (icli_hist_index_grow_grams(index))
+            return NULL;
+        return icli_hist_index_find_gram(index, gram, create);
+    }
+
+    ++index->n_grams;
+    index->grams[slot].gram = gram;
+    return &index->grams[slot];
+}
+
+static int icli_hist_index_add_grams(struct icli_hist_index *index, const char *line, uint32_t id)
+{
+    size_t len = strlen(line);
+
+    for (size_t i = 0; i + 3 <= len; ++i) {
+        struct icli_hist_posting *posting = icli_hist_index_find_gram(index, icli_hist_gram(&line[i]), true);
+        if (!posting)
+            return -1;
+
+        /* ids are added in increasing order, so repeated trigram of the same line is always the last one */
+        if (posting->n_ids && posting->ids[posting->n_ids - 1] == id)
+            continue;
+
+        if (posting->n_ids == posting->size) {
+            uint32_t size = posting->size ? posting->size * 2 : 4;
+            uint32_t *ids = icli_realloc(ICLI_MEM_HISTORY, posting->ids, size * sizeof(*ids));
+            if (!ids)
+                return -1;
+            posting->ids = ids;
+            posting->size = size;
+        }
+
+        posting->ids[posting->n_ids++] = id;
+    }
+
+    return 0;
+}
+
+/* Account LINE executed in MODE in the index - either bump statistics of an existing entry or index a new one */
+static int icli_hist_index_add(const char *mode, const char *line)
+{
+    struct icli_hist_index *index = &icli.hist_index;
+    uint32_t hash = icli_hist_entry_hash(mode, line);
+    uint32_t slot;
+
+    ++index->seq;
+
+    if (index->lines_size) {
+        for (slot = hash & (index->lines_size - 1); index->lines[slot];
+             slot = (slot + 1) & (index->lines_size - 1)) {
+            struct icli_hist_entry *entry = &index->entries[index->lines[slot] - 1];
+            if (strcmp(entry->line, line) == 0 && icli_hist_mode_eq(entry->mode, mode)) {
+                ++entry->count;
+                entry->last_seq = index->seq;
+                return 0;
+            }
+        }
+    }
+
+    if ((index->n_entries + 1) * 10 > index->lines_size * 7 && icli_hist_index_grow_lines(index))
+        return -1;
+
+    if (index->n_entries == index->size) {
+        uint32_t size = index->size ? index->size * 2 : ICLI_HIST_INDEX_INIT_SIZE;
+        struct icli_hist_entry *entries = icli_realloc(ICLI_MEM_HISTORY, index->entries, size * sizeof(*entries));
+        if (!entries)
+            return -1;
+        index->entries = entries;
+        index->size = size;
+    }
+
+    struct icli_hist_entry *entry = &index->entries[index->n_entries];
+    entry->line = icli_strdup(ICLI_MEM_HISTORY, line);
+    if (!entry->line)
+        return -1;
+    entry->mode = NULL;
+    if (mode) {
+        entry->mode = icli_strdup(ICLI_MEM_HISTORY, mode);
+        if (!entry->mode) {
+            icli_free(entry->line);
+            return -1;
+        }
+    }
+    entry->count = 1;
+    entry->last_seq = index->seq;
+
+    for (slot = hash & (index->lines_size - 1); index->lines[slot]; slot = (slot + 1) & (index->lines_size - 1))
+        ;
+    index->lines[slot] = ++index->n_entries;
+
+    return icli_hist_index_add_grams(index, line, index->n_entries - 1);
+}
+
+static void icli_hist_index_cleanup(void)
+{
+    struct icli_hist_index *index = &icli.hist_index;
+
+    for (uint32_t i = 0; i < index->n_entries; ++i) {
+        icli_free(index->entries[i].mode);
+        icli_free(index->entries[i].line);
+    }
+
+    for (uint32_t i = 0; i < index->grams_size; ++i)
+        icli_free(index->grams[i].ids);
+
+    icli_free(index->entries);
+    icli_free(index->lines);
+    icli_free(index->grams);
+    icli_free(index->search_ids);
+    memset(index, 0, sizeof(*index));
+}
+
+/* Rank of an entry - frequency of the entry decayed by how long ago it was last used. Entries executed in the mode
+   the search is done from are preferred */
+static double icli_hist_score(struct icli_hist_entry *entry)
+{
+    uint32_t age = icli.hist_index.seq - entry->last_seq;
+    double score = (double)entry->count * ICLI_HIST_RECENCY_SCALE / (ICLI_HIST_RECENCY_SCALE + age);
 
-                default:
-                    if (cmd->argv[i].help)
-                        icli_printf("arg%d (%s)\n", i, cmd->argv[i].help);
-                    else
-                        icli_printf("arg%d\n", i);
-                }
-            } else {
-                icli_printf("arg%d\n", i);
-            }
+    if (icli_hist_mode_eq(entry->mode, icli.hist_index.search_mode))
+        score *= ICLI_HIST_MODE_WEIGHT;
+
+    return score;
+}
+
+static int icli_hist_cmp_score(const void *a, const void *b)
+{
+    struct icli_hist_entry *entry_a = &icli.hist_index.entries[*(const uint32_t *)a];
+    struct icli_hist_entry *entry_b = &icli.hist_index.entries[*(const uint32_t *)b];
+    double score_a = icli_hist_score(entry_a);
+    double score_b = icli_hist_score(entry_b);
+
+    if (score_a != score_b)
+        return score_a < score_b ? 1 : -1;
+
+    return entry_a->last_seq < entry_b->last_seq ? 1 : -1;
+}
+
+/* Find entries containing PATTERN, ranked by recency and frequency and preferring entries of MODE.
+   Candidates are taken from the shortest posting list of the pattern trigrams and verified with strstr(). Patterns
+   shorter than a trigram are verified against all entries. Returns number of ids stored in *OUT_IDS (to be freed by
+   the caller) or -1 on error */
+static int icli_hist_index_search(const char *mode, const char *pattern, uint32_t **out_ids)
+{
+    struct icli_hist_index *index = &icli.hist_index;
+    size_t len = strlen(pattern);
+    uint32_t *candidates = NULL;
+    uint32_t n_candidates = index->n_entries;
+    uint32_t *ids;
+    uint32_t n_ids = 0;
+
+    *out_ids = NULL;
+
+    for (size_t i = 0; i + 3 <= len; ++i) {
+        struct icli_hist_posting *posting = icli_hist_index_find_gram(index, icli_hist_gram(&pattern[i]), false);
+        if (!posting)
+            return 0;
+
+        if (!candidates || posting->n_ids < n_candidates) {
+            candidates = posting->ids;
+            n_candidates = posting->n_ids;
         }
-    } else if (ICLI_ARGS_DYNAMIC == cmd->argc) {
-        icli_printf("Variable number arguments accepted\n");
-    } else if (0 == cmd->argc) {
-        icli_printf("None\n");
     }
+
+    if (!n_candidates)
+        return 0;
+
+    ids = icli_malloc(ICLI_MEM_HISTORY, n_candidates * sizeof(*ids));
+    if (!ids)
+        return -1;
+
+    for (uint32_t i = 0; i < n_candidates; ++i) {
+        uint32_t id = candidates ? candidates[i] : i;
+
+        if (strstr(index->entries[id].line, pattern))
+            ids[n_ids++] = id;
+    }
+
+    index->search_mode = mode;
+    qsort(ids, n_ids, sizeof(*ids), icli_hist_cmp_score);
+    index->search_mode = NULL;
+
+    *out_ids = ids;
+    return (int)n_ids;
 }
 
-int icli_execute_line(char *line)
+static int icli_hist_load_line(const char *line, void *arg UNUSED)
 {
-    struct icli_command *command;
-    static char *argv[ICLI_ARGS_MAX];
-    char *cmd;
+    const char *sep = strchr(line, ICLI_HIST_MODE_SEP);
 
-    int argc = icli_parse_line(line, &cmd, argv, array_len(argv));
+    add_history(sep ? sep + 1 : line);
+    return 0;
+}
+
+static int icli_hist_index_line(const char *line, void *arg UNUSED)
+{
+    char mode[ICLI_MODE_PATH_MAX];
+    const char *sep = strchr(line, ICLI_HIST_MODE_SEP);
 
-    command = icli_find_command(cmd);
+    if (!sep || sep == line)
+        return icli_hist_index_add(NULL, sep ? sep + 1 : line);
 
-    if (!command) {
-        icli_err_printf("%s: No such command\n", cmd);
+    snprintf(mode, sizeof(mode), "%.*s", (int)(sep - line), line);
+
+    return icli_hist_index_add(mode, sep + 1);
+}
+
+/* Call CB on each line of the tail of history file */
+static int icli_hist_load(int (*cb)(const char *line, void *arg))
+{
+    struct icli_hist_map map;
+    int ret;
+    int fd;
+
+    fd = open(icli.hist_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return ENOENT == errno ? 0 : -1;
+
+    ret = icli_hist_map(fd, &map);
+    close(fd);
+    if (ret)
         return -1;
+
+    ret = icli_hist_foreach_tail(&map, icli.history_size, cb, NULL);
+    icli_hist_unmap(&map);
+
+    return ret;
+}
+
+/* Load history file into the search index, the first time the index is needed */
+static void icli_hist_index_init(void)
+{
+    uint64_t start;
+
+    if (icli.hist_indexed)
+        return;
+
+    icli.hist_indexed = true;
+    if (!icli.hist_file)
+        return;
+
+    start = icli_clock_ns();
+    if (icli_hist_load(icli_hist_index_line))
+        icli_api_printf("Unable to index history from %s (%m)\n", icli.hist_file);
+    icli_phase_done(ICLI_PHASE_HISTORY_INDEX, start);
+}
+
+/* Reverse search key binding. Uses the line typed so far as the pattern and replaces it with the best ranked match.
+   Repeated presses cycle through the following matches */
+static int icli_hist_search_key(int count UNUSED, int key UNUSED)
+{
+    struct icli_hist_index *index = &icli.hist_index;
+
+    if (index->n_search_ids && index->search_pos < index->n_search_ids &&
+        strcmp(rl_line_buffer, index->entries[index->search_ids[index->search_pos]].line) == 0) {
+        ++index->search_pos;
+    } else {
+        uint32_t *ids;
+        int n_ids;
+
+        icli_hist_index_init();
+
+        icli_free(index->search_ids);
+        index->search_ids = NULL;
+        index->n_search_ids = 0;
+        index->search_pos = 0;
+
+        char mode[ICLI_MODE_PATH_MAX];
+
+        n_ids = icli_hist_index_search(icli_mode_path(icli.curr_cmd, mode, sizeof(mode)), rl_line_buffer, &ids);
+        if (n_ids <= 0)
+            return 0;
+
+        index->search_ids = ids;
+        index->n_search_ids = (uint32_t)n_ids;
     }
 
-    if (!command->func && argc) {
-        icli_err_printf("Command %s does not accept arguments\n", cmd);
+    if (index->search_pos >= index->n_search_ids)
+        index->search_pos = 0;
+
+    rl_replace_line(index->entries[index->search_ids[index->search_pos]].line, 0);
+    rl_point = rl_end;
+
+    return 0;
+}
+
+static int icli_hist_bind_keys(void)
+{
+    static bool bound;
+
+    if (!bound) {
+        rl_add_defun("icli-history-search", icli_hist_search_key, 'R' & 0x1f);
+        bound = true;
+    }
+
+    return 0;
+}
+
+static int icli_hist_write_line(const char *line, void *arg)
+{
+    FILE *out = arg;
+
+    if (fputs(line, out) < 0 || fputc('\n', out) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Write line of file written by write_history(), which has no mode */
+static int icli_hist_write_legacy_line(const char *line, void *arg)
+{
+    FILE *out = arg;
+
+    if (fputc(ICLI_HIST_MODE_SEP, out) < 0)
+        return -1;
+
+    return icli_hist_write_line(line, out);
+}
+
+static int icli_hist_open(void)
+{
+    return open(icli.hist_file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+/* Rewrite history file to hold only the last history_size lines. Lines appended by concurrent sessions are
+   preserved: the file is rewritten under exclusive lock into a temporary file which replaces the original. Sessions
+   still holding the replaced file notice it was unlinked and reopen it before their next append. */
+static int icli_hist_compact(void)
+{
+    struct icli_hist_journal *journal = &icli.journal;
+    struct icli_hist_map map;
+    struct stat st;
+    char tmp_name[PATH_MAX];
+    int (*write_line)(const char *line, void *arg);
+    FILE *out = NULL;
+    int ret = -1;
+    int fd;
+
+    if (flock(journal->fd, LOCK_EX))
         return -1;
+
+    if (fstat(journal->fd, &st))
+        goto unlock;
+
+    if (0 == st.st_nlink) {
+        /* someone else has already compacted the file */
+        ret = 0;
+        journal->n_lines = icli.history_size;
+        goto reopen;
     }
 
-    if (command->func) {
-        if (command->argc != ICLI_ARGS_DYNAMIC) {
-            if (command->argc != argc) {
-                icli_err_printf("Command %s accepts exactly %d arguments. %d were provided\n",
-                                cmd,
-                                command->argc,
-                                argc);
-                icli_print_command_help(command);
-                return -1;
-            }
+    if (icli_hist_map(journal->fd, &map))
+        goto unlock;
 
-            if (command->argv) {
-                for (int i = 0; i < command->argc; ++i) {
-                    if (AT_Val == command->argv[i].type) {
-                        struct icli_arg_val *vals = command->argv[i].vals;
-                        bool found = false;
-
-                        if (!vals)
-                            continue;
-
-                        while (vals->val) {
-                            if (strcmp(vals->val, argv[i]) == 0) {
-                                found = true;
-                                break;
-                            }
-                            ++vals;
-                        }
-
-                        if (!found) {
-                            icli_err_printf("Command %s %d argument invalid: %s\n", cmd, i, argv[i]);
-                            icli_print_command_help(command);
-                            return -1;
-                        }
-                    }
-                }
-            }
-        }
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", icli.hist_file);
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        goto unmap;
 
-        icli_set_command_prompt(command, argv, argc);
+    out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        unlink(tmp_name);
+        goto unmap;
+    }
 
-        icli.curr_row = 0;
-        icli.error_printed = false;
+    write_line = map.legacy ? icli_hist_write_legacy_line : icli_hist_write_line;
+    if (icli_hist_foreach_tail(&map, icli.history_size, write_line, out) || fflush(out) || fdatasync(fileno(out))) {
+        fclose(out);
+        unlink(tmp_name);
+        goto unmap;
+    }
+    fclose(out);
 
-        if (icli.cmd_hook)
-            icli.cmd_hook(command->name, argv, argc, icli.user_data);
+    if (rename(tmp_name, icli.hist_file)) {
+        unlink(tmp_name);
+        goto unmap;
+    }
 
-        /* Call the function. */
-        enum icli_ret ret = command->func(argv, argc, icli.user_data);
+    journal->n_lines = icli_hist_count_lines(&map);
+    if (journal->n_lines > icli.history_size)
+        journal->n_lines = icli.history_size;
+    ret = 0;
+
+unmap:
+    icli_hist_unmap(&map);
+reopen:
+    if (0 == ret) {
+        fd = icli_hist_open();
+        if (fd < 0) {
+            ret = -1;
+            goto unlock;
+        }
+
+        close(journal->fd);
+        journal->fd = fd;
+        journal->n_unsynced = 0;
+        return ret;
+    }
+unlock:
+    flock(journal->fd, LOCK_UN);
+    return ret;
+}
 
-        icli.skip_output = false;
+static int icli_hist_append(const char *mode, const char *line)
+{
+    struct icli_hist_journal *journal = &icli.journal;
+    struct iovec iov[] = {{.iov_base = (void *)mode, .iov_len = mode ? strlen(mode) : 0},
+                          {.iov_base = "\t", .iov_len = 1},
+                          {.iov_base = (void *)line, .iov_len = strlen(line)},
+                          {.iov_base = "\n", .iov_len = 1}};
+    struct stat st;
+    ssize_t written;
+    int fd;
+
+    for (;;) {
+        if (flock(journal->fd, LOCK_SH))
+            return -1;
 
-        switch (ret) {
-        case ICLI_OK:
-            break;
-        case ICLI_ERR_ARG:
-            if (!icli.error_printed)
-                icli_err_printf("Argument error\n");
-            free(command->prompt_line);
-            command->prompt_line = NULL;
+        if (fstat(journal->fd, &st)) {
+            flock(journal->fd, LOCK_UN);
             return -1;
+        }
+
+        if (st.st_nlink)
             break;
-        case ICLI_ERR:
-            if (!icli.error_printed)
-                icli_err_printf("Error\n");
-            free(command->prompt_line);
-            command->prompt_line = NULL;
+
+        /* file was replaced by compaction of another session */
+        fd = icli_hist_open();
+        if (fd < 0) {
+            flock(journal->fd, LOCK_UN);
             return -1;
-            break;
         }
-    } else {
-        if (icli.cmd_hook)
-            icli.cmd_hook(command->name, argv, argc, icli.user_data);
+
+        close(journal->fd);
+        journal->fd = fd;
     }
 
-    if (command->n_cmds) {
-        icli.curr_cmd = command;
-        icli_build_prompt(command);
+    /* O_APPEND makes a single writev() atomic with respect to appends of other sessions */
+    written = writev(journal->fd, iov, (int)array_len(iov));
+    flock(journal->fd, LOCK_UN);
+
+    if (written != (ssize_t)(iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len))
+        return -1;
+
+    if (++journal->n_unsynced >= ICLI_HIST_SYNC_BATCH) {
+        fdatasync(journal->fd);
+        journal->n_unsynced = 0;
     }
 
+    if (icli.history_size > 0 && ++journal->n_lines >= icli.history_size * ICLI_HIST_COMPACT_FACTOR)
+        return icli_hist_compact();
+
     return 0;
 }
 
-/* Generator function for command argument completion.  STATE lets us
-   know whether to start from scratch; without any state
-   (i.e. STATE == 0), then we start at the top of the list. */
-static char *icli_command_arg_generator(const char *text, int state)
+/* Load the tail of history file into the line editor. The search index and the journal are set up separately, the
+   first time they are needed */
+static int icli_hist_init(void)
 {
-    static size_t len;
-    static struct icli_arg_val *vals;
-    static struct icli_arg *arg;
-    const char *name;
+    uint64_t start;
+    int ret;
 
-    /* If this is a new word to complete, initialize now.  This
-       includes saving the length of TEXT for efficiency, and
-       initializing the index variable to 0. */
-    if (!state) {
-        if (text)
-            len = strlen(text);
-        else
-            len = 0;
+    if (!icli.hist_file)
+        return 0;
 
-        if (len) {
-            arg = &icli.curr_completion_cmd->argv[icli.curr_completion_arg - 1];
-            vals = icli.curr_completion_cmd->argv[icli.curr_completion_arg - 1].vals;
-        } else {
-            arg = &icli.curr_completion_cmd->argv[icli.curr_completion_arg];
-            vals = icli.curr_completion_cmd->argv[icli.curr_completion_arg].vals;
-        }
-    }
+    start = icli_clock_ns();
+    ret = icli_hist_load(icli_hist_load_line);
+    icli_phase_done(ICLI_PHASE_HISTORY, start);
 
-    switch (arg->type) {
-    case AT_Val:
-        /* Return the next name which partially matches from the
-           argument list. */
-        while (vals && vals->val) {
-            name = vals->val;
+    return ret;
+}
 
-            ++vals;
-            if (strncmp(name, text, len) == 0)
-                return strdup(name);
-        }
-        break;
+/* Open history file for appending. Its lines are counted to decide when it is compacted, and file written by
+   write_history() is converted so that it can be appended to */
+static int icli_hist_journal_init(void)
+{
+    struct icli_hist_map map;
+    bool legacy;
 
-    case AT_File:
-        /* make readline attempt to complete with file name */
-        rl_attempted_completion_over = 0;
-        break;
+    icli.journal.fd = icli_hist_open();
+    if (icli.journal.fd < 0)
+        return -1;
 
-    default:
-        break;
-    }
+    if (icli_hist_map(icli.journal.fd, &map))
+        return -1;
 
-    /* If no names matched, then return NULL. */
-    return (char *)NULL;
+    icli.journal.n_lines = icli_hist_count_lines(&map);
+    legacy = map.legacy;
+    icli_hist_unmap(&map);
+
+    if (legacy || (icli.history_size > 0 && icli.journal.n_lines >= icli.history_size * ICLI_HIST_COMPACT_FACTOR))
+        return icli_hist_compact();
+
+    return 0;
 }
 
-/* Generator function for command completion.  STATE lets us
-   know whether to start from scratch; without any state
-   (i.e. STATE == 0), then we start at the top of the list. */
-static char *icli_command_generator(const char *text, int state)
+/* Return descriptor of history journal, opening it on first call. Return -1 if history is not saved */
+static int icli_hist_journal_fd(void)
 {
-    static struct icli_command *list_entry;
-    static size_t len;
-    char *name;
+    uint64_t start;
 
-    /* If this is a new word to complete, initialize now.  This
-       includes saving the length of TEXT for efficiency, and
-       initializing the index variable to 0. */
-    if (!state) {
-        list_entry = LIST_FIRST(&icli.curr_cmd->cmd_list);
-        if (text)
-            len = strlen(text);
-        else
-            len = 0;
+    if (!icli.hist_file || icli.journal.opened)
+        return icli.journal.fd;
+
+    icli.journal.opened = true;
+
+    start = icli_clock_ns();
+    if (icli_hist_journal_init())
+        icli_api_printf("Unable to open history file %s (%m)\n", icli.hist_file);
+    icli_phase_done(ICLI_PHASE_HISTORY_JOURNAL, start);
+
+    return icli.journal.fd;
+}
+
+static void icli_hist_cleanup(void)
+{
+    if (icli.journal.fd < 0)
+        return;
+
+    if (icli.journal.n_unsynced)
+        fdatasync(icli.journal.fd);
+
+    close(icli.journal.fd);
+    icli.journal.fd = -1;
+}
+
+/* Add LINE executed in MODE to history */
+static void icli_history_add(struct icli_command *mode, const char *line)
+{
+    char mode_path[ICLI_MODE_PATH_MAX];
+    const char *path = icli_mode_path(mode, mode_path, sizeof(mode_path));
+
+    add_history(line);
+
+    icli_hist_index_init();
+    if (icli_hist_index_add(path, line))
+        icli_api_printf("Unable to index history line %s\n", line);
+
+    if (icli_hist_journal_fd() >= 0 && icli_hist_append(path, line))
+        icli_api_printf("Unable to append history to %s (%m)\n", icli.hist_file);
+}
+
+static enum icli_ret icli_history_search(char *argv[], int argc)
+{
+    char pattern[4096] = "";
+    uint32_t *ids;
+    int n_ids;
+
+    /* pattern may contain spaces, so it is split into number of arguments */
+    for (int i = 0; i < argc; ++i) {
+        if (i)
+            strncat(pattern, " ", sizeof(pattern) - strlen(pattern) - 1);
+        strncat(pattern, argv[i], sizeof(pattern) - strlen(pattern) - 1);
     }
 
-    /* Return the next name which partially matches from the
-       command list. */
-    while (list_entry) {
-        name = list_entry->name;
-        list_entry = LIST_NEXT(list_entry, cmd_list_entry);
+    char mode[ICLI_MODE_PATH_MAX];
+    const char *mode_path = icli_mode_path(icli.curr_cmd, mode, sizeof(mode));
 
-        if (strncmp(name, text, len) == 0)
-            return strdup(name);
+    icli_hist_index_init();
+    n_ids = icli_hist_index_search(mode_path, pattern, &ids);
+    if (n_ids < 0) {
+        icli_err_printf("Unable to search history\n");
+        return ICLI_ERR;
     }
 
-    /* If no names matched, then return NULL. */
-    return (char *)NULL;
+    for (int i = 0; i < n_ids && i < ICLI_HIST_SEARCH_MAX; ++i) {
+        struct icli_hist_entry *entry = &icli.hist_index.entries[ids[i]];
+        if (icli_hist_mode_eq(entry->mode, mode_path))
+            icli_printf("%5u %s\n", entry->count, entry->line);
+        else
+            icli_printf("%5u (%s) %s\n", entry->count, entry->mode ? entry->mode : "", entry->line);
+    }
+
+    icli_free(ids);
+
+    return ICLI_OK;
 }
 
-/* Attempt to complete on the contents of TEXT.  START and END
-   bound the region of rl_line_buffer that contains the word to
-   complete.  TEXT is the word to complete.  We can use the entire
-   contents of rl_line_buffer in case we want to do some simple
-   parsing.  Return the array of matches, or NULL if there aren't any. */
-static char **icli_completion(const char *text, int start, int end UNUSED)
+/* Output memory of modes in subtree of MODE, down to DEPTH levels below it */
+static void icli_memory_modes(struct icli_command *mode, int depth, char *row[])
 {
-    char **matches;
+    struct icli_mem_stats stats = {0};
+    struct icli_command *it;
+    char path[256];
 
-    static char *argv[ICLI_ARGS_MAX];
-    char *cmd;
+    icli_command_mem(&stats, mode);
+    snprintf(row[0], 256, "%s", mode->parent ? icli_mode_path(mode, path, sizeof(path)) : "(root)");
+    snprintf(row[1], 32, "%" PRIu64, stats.objects);
+    snprintf(row[2], 32, "%" PRIu64, stats.bytes);
+    icli_table_row((const char *const *)row);
 
-    static char tmp[4096];
-    memcpy(tmp, rl_line_buffer, (size_t)rl_end);
-    tmp[rl_end] = '\0';
+    if (!depth)
+        return;
 
-    int argc = icli_parse_line(tmp, &cmd, argv, array_len(argv));
+    LIST_FOREACH(it, &mode->cmd_list, cmd_list_entry)
+    {
+        if (!LIST_EMPTY(&it->cmd_list))
+            icli_memory_modes(it, depth - 1, row);
+    }
+}
 
-    /* Don't do filename completion even if our generator finds no matches. */
-    rl_attempted_completion_over = 1;
+/* Show memory in use by category, and by mode subtrees down to the given depth (1 by default) */
+static enum icli_ret icli_memory(struct icli_value argv[], int argc, void *context UNUSED)
+{
+    static const struct icli_column cat_cols[] = {
+        {"category", ICLI_COL_STR}, {"objects", ICLI_COL_NUM}, {"bytes", ICLI_COL_NUM}};
+    static const struct icli_column mode_cols[] = {
+        {"mode", ICLI_COL_STR}, {"objects", ICLI_COL_NUM}, {"bytes", ICLI_COL_NUM}};
+    char name[256], objects[32], bytes[32];
+    char *row[] = {name, objects, bytes};
+    struct icli_mem_stats total = {0};
+    int64_t depth = 1;
+
+    if (2 == argc) {
+        depth = argv[1].i;
+        if (depth < 0) {
+            icli_err_printf("depth must be a non-negative integer value\n");
+            return ICLI_ERR_ARG;
+        }
+    }
 
-    matches = (char **)NULL;
+    if (icli_table_begin(cat_cols, 3))
+        return ICLI_ERR;
 
-    icli.curr_completion_cmd = NULL;
-    icli.curr_completion_arg = 0;
+    for (int i = 0; i <= ICLI_MEM_MAX; ++i) {
+        struct icli_mem_stats stats = total;
 
-    /* If this word is at the start of the line, then it is a command
-     * to complete */
-    if (start == 0) {
-        matches = completion_matches((char *)text, icli_command_generator);
-        /* matches = rl_completion_matches (text, icli_command_generator); */
-    } else {
-        struct icli_command *command = icli_find_command(cmd);
-        if (command && command->argc != ICLI_ARGS_DYNAMIC && command->argc) {
-            if (argc <= command->argc && command->argv) {
-                icli.curr_completion_cmd = command;
-                icli.curr_completion_arg = argc;
-                matches = completion_matches((char *)text, icli_command_arg_generator);
-            }
+        if (i < ICLI_MEM_MAX) {
+            icli_get_mem_stats(i, &stats);
+            total.objects += stats.objects;
+            total.bytes += stats.bytes;
         }
+
+        snprintf(name, sizeof(name), "%s", i < ICLI_MEM_MAX ? stats.name : "total");
+        snprintf(objects, sizeof(objects), "%" PRIu64, stats.objects);
+        snprintf(bytes, sizeof(bytes), "%" PRIu64, stats.bytes);
+        icli_table_row((const char *const *)row);
     }
+    icli_table_end();
 
-    return matches;
+    icli_printf("\n");
+    if (icli_table_begin(mode_cols, 3))
+        return ICLI_ERR;
+    icli_memory_modes(icli.root_cmd, depth < INT_MAX ? (int)depth : INT_MAX, row);
+    icli_table_end();
+
+    return ICLI_OK;
 }
 
-static enum icli_ret icli_history(char *argv[] UNUSED, int argc UNUSED, void *context UNUSED)
+static enum icli_ret icli_history(char *argv[], int argc, void *context UNUSED)
 {
+    if (argc)
+        return icli_history_search(&argv[1], argc - 1);
+
     HISTORY_STATE *hist_state = history_get_history_state();
     HIST_ENTRY **mylist = history_list();
     for (int i = 0; i < hist_state->length; i++) {
@@ -555,32 +5780,23 @@ static enum icli_ret icli_history(char *argv[] UNUSED, int argc UNUSED, void *co
     return ICLI_OK;
 }
 
-static enum icli_ret icli_end(char *argv[], int argc, void *context UNUSED)
+static enum icli_ret icli_end(struct icli_value argv[], int argc, void *context UNUSED)
 {
-    if (argc > 1) {
-        icli_err_printf("end supports either 0 or 1 numeric argument\n");
-        return ICLI_ERR_ARG;
-    }
-
-    int level = 1;
+    struct icli_command *mode = icli.curr_cmd;
+    int64_t level = 1;
 
     if (1 == argc) {
-        level = atoi(argv[0]);
-        if (0 == level) {
+        level = argv[0].i;
+        if (level <= 0) {
             icli_err_printf("end argument must be a positive integer value\n");
             return ICLI_ERR_ARG;
         }
     }
 
-    for (int i = 0; i < level; ++i) {
-        icli.curr_cmd = icli.curr_cmd->parent;
-
-        if (NULL == icli.curr_cmd) {
-            icli.curr_cmd = icli.root_cmd;
-            break;
-        }
-    }
+    for (int i = 0; i < level && mode->parent; ++i)
+        mode = mode->parent;
 
+    icli_set_mode(&icli.curr_cmd, &icli.modes, mode);
     icli_build_prompt(icli.curr_cmd);
 
     return ICLI_OK;
@@ -593,18 +5809,27 @@ static enum icli_ret icli_help(char *argv[], int argc, void *context UNUSED)
     int printed = 0;
     struct icli_command *it;
 
-    if (argc > 1)
-        return ICLI_ERR_ARG;
+    icli_init_builtins(icli.curr_cmd);
 
     icli_printf("Available commands:\n");
 
-    LIST_FOREACH(it, &icli.curr_cmd->cmd_list, cmd_list_entry)
-    {
-        if (0 == argc || (strcmp(argv[0], it->name) == 0)) {
-            if (argc > 0)
-                icli_print_command_help(it);
-            else
-                icli_printf("    %-*s : %s\n", icli.curr_cmd->max_name_len, it->name, it->doc);
+    if (argc > 0) {
+        int n = icli_resolve_command(argv[0], &it);
+
+        if (it) {
+            icli_print_command_help(it);
+            printed++;
+        } else if (n > 1) {
+            char cands[256];
+
+            icli_index_list(icli_mode_names(icli.curr_cmd), argv[0], cands, sizeof(cands));
+            icli_err_printf("%s: Ambiguous command:%s\n", argv[0], cands);
+            return ICLI_ERR_ARG;
+        }
+    } else {
+        LIST_FOREACH(it, &icli.curr_cmd->cmd_list, cmd_list_entry)
+        {
+            icli_printf("    %-*s : %s\n", icli.curr_cmd->max_name_len, it->name, it->doc);
             printed++;
         }
     }
@@ -650,7 +5875,7 @@ int icli_exec_script(const char *fname)
     size_t len = 0;
     int ret = 0;
 
-    while ((read = getline(&line, &len, input)) != -1) {
+    while ((read = icli_getdelim(&line, &len, '\n', input)) != -1) {
         stripped_line = stripwhite(line);
         if (*stripped_line && *stripped_line != '#') {
             icli_printf("Executing: \"%s\"\n", stripped_line);
@@ -661,7 +5886,7 @@ int icli_exec_script(const char *fname)
     }
 
 out:
-    free(line);
+    icli_free(line);
     fclose(input);
 
     return ret;
@@ -676,56 +5901,140 @@ static enum icli_ret icli_execute(char *argv[], int argc UNUSED, void *context U
     return ICLI_OK;
 }
 
-static int icli_init_default_cmds(struct icli_command *parent)
+/* Check whether NAME is taken by a built-in command of MODE, which may not be registered yet */
+static bool icli_is_builtin_name(struct icli_command *mode, const char *name)
 {
-    struct icli_command_params params[] =
-        {{.parent = parent,
-          .name = "help",
-          .command = icli_help,
-          .argc = ICLI_ARGS_DYNAMIC,
-          .help = "Show available commands or show help of a specific command. args: [command]"},
-         {.parent = parent, .name = "?", .command = icli_help, .argc = ICLI_ARGS_DYNAMIC, .help = "Synonym for 'help'"},
-         {.parent = parent,
-          .name = "history",
-          .command = icli_history,
-          .help = "Show a list of previously run commands"}};
+    static const char *const names[] = {"help", "?", "history", "icli"};
 
-    struct icli_command *out_commands[array_len(params)];
+    for (size_t i = 0; i < array_len(names); ++i) {
+        if (strcmp(names[i], name) == 0)
+            return true;
+    }
 
-    int ret = icli_register_commands(params, out_commands, array_len(params));
-    if (ret)
-        return ret;
+    if (mode == icli.root_cmd)
+        return strcmp(name, "quit") == 0 || strcmp(name, "execute") == 0;
+
+    return strcmp(name, "end") == 0;
+}
+
+static int icli_add_command(struct icli_command_params *params, struct icli_command **out_command, bool builtin);
+
+/* Register built-in commands of MODE, the first time commands of the mode are looked up. The built-ins are listed
+   after the commands of the mode, as if they were registered first */
+static void icli_init_builtins(struct icli_command *mode)
+{
+    struct icli_command *parent = mode == icli.root_cmd ? NULL : mode;
+    struct icli_arg execute_args[] = {{.type = AT_File, .help = "File to read commands from"}};
+    struct icli_command_params params[6];
+    size_t n = 0;
+    uint64_t start;
+
+    if (!__atomic_load_n(&mode->builtins_pending, __ATOMIC_ACQUIRE))
+        return;
 
-    for (size_t i = 0; i < array_len(params); ++i) {
-        out_commands[i]->internal = true;
+    icli_write_lock();
+    if (!mode->builtins_pending) {
+        /* registered by another thread meanwhile */
+        icli_write_unlock();
+        return;
     }
 
-    return ret;
+    mode->builtins_pending = false;
+    start = icli_clock_ns();
+
+    if (!parent) {
+        params[n++] =
+            (struct icli_command_params){.name = "quit", .command = icli_quit, .help = "Quit interactive shell"};
+        params[n++] = (struct icli_command_params){.name = "execute",
+                                                   .command = icli_execute,
+                                                   .help = "Execute commands from file",
+                                                   .argc = 1,
+                                                   .argv = execute_args};
+    } else {
+        params[n++] = (struct icli_command_params){.parent = parent,
+                                                   .name = "end",
+                                                   .typed_command = icli_end,
+                                                   .argc = ICLI_ARGS_DYNAMIC,
+                                                   .grammar = "[<levels:int>]",
+                                                   .help = "Exit to upper level. args: [number of levels]"};
+    }
+
+    params[n++] = (struct icli_command_params){
+        .parent = parent,
+        .name = "help",
+        .command = icli_help,
+        .argc = ICLI_ARGS_DYNAMIC,
+        .grammar = "[<command>]",
+        .help = "Show available commands or show help of a specific command. args: [command]"};
+    params[n++] = (struct icli_command_params){.parent = parent,
+                                               .name = "?",
+                                               .command = icli_help,
+                                               .argc = ICLI_ARGS_DYNAMIC,
+                                               .grammar = "[<command>]",
+                                               .help = "Synonym for 'help'"};
+    params[n++] = (struct icli_command_params){
+        .parent = parent,
+        .name = "history",
+        .command = icli_history,
+        .argc = ICLI_ARGS_DYNAMIC,
+        .grammar = "[search <pattern>...]",
+        .help = "Show a list of previously run commands or search them. args: [search <pattern>]"};
+    params[n++] = (struct icli_command_params){.parent = parent,
+                                               .name = "icli",
+                                               .typed_command = icli_memory,
+                                               .argc = ICLI_ARGS_DYNAMIC,
+                                               .grammar = "memory [<depth:int>]",
+                                               .help = "Show memory used by icli. args: memory [depth of modes]"};
+
+    /* appended in reverse, so that they are listed in the same order as commands registered at the head */
+    for (size_t i = n; i-- > 0;) {
+        if (icli_add_command(&params[i], NULL, true)) {
+            icli_api_printf("Unable to register built-in command %s\n", params[i].name);
+            break;
+        }
+    }
+
+    icli_write_unlock();
+    icli_phase_done(ICLI_PHASE_BUILTINS, start);
 }
 
-static void icli_clean_command_argv(struct icli_command *cmd)
+static void icli_args_free(struct icli_args *args)
 {
-    if (cmd->argc && cmd->argv) {
-        for (int j = 0; j < cmd->argc; ++j) {
-            if (AT_Val == cmd->argv[j].type) {
-                for (struct icli_arg_val *val = cmd->argv[j].vals; val && val->val; ++val) {
-                    free((void *)val->val);
-                    val->val = NULL;
-                    free((void *)val->help);
-                    val->help = NULL;
-                }
+    if (!args)
+        return;
 
-                free(cmd->argv[j].vals);
-                cmd->argv[j].vals = NULL;
-            }
+    for (int i = 0; i < args->argc; ++i) {
+        if (AT_Regex == args->argv[i].type)
+            icli_free((void *)args->argv[i].regex);
 
-            free((void *)cmd->argv[j].help);
-            cmd->argv[j].help = NULL;
+        if (args->priv[i].regex) {
+            regfree(args->priv[i].regex);
+            icli_free(args->priv[i].regex);
         }
+        icli_value_set_unref(args->priv[i].set);
 
-        free(cmd->argv);
-        cmd->argv = NULL;
+        icli_free((void *)args->argv[i].help);
     }
+
+    icli_free(args);
+}
+
+int icli_get_mode_mem_stats(struct icli_command *mode, struct icli_mem_stats *stats)
+{
+    if (!stats) {
+        icli_api_printf("NULL stats specified\n");
+        return -1;
+    }
+
+    if (!mode)
+        mode = icli.root_cmd;
+
+    *stats = (struct icli_mem_stats){.name = mode->name};
+    icli_read_lock();
+    icli_command_mem(stats, mode);
+    icli_read_unlock();
+
+    return 0;
 }
 
 static void icli_clean_command(struct icli_command *cmd)
@@ -736,20 +6045,16 @@ static void icli_clean_command(struct icli_command *cmd)
         icli_clean_command(it);
     }
 
-    free(cmd->name);
-    cmd->name = NULL;
-    free(cmd->short_name);
-    cmd->short_name = NULL;
-    free(cmd->doc);
-    cmd->doc = NULL;
-    free(cmd->prompt_line);
-    cmd->prompt_line = NULL;
-
-    icli_clean_command_argv(cmd);
+    icli_args_free(cmd->args);
+    cmd->args = NULL;
+    icli_grammar_free(cmd->grammar);
+    cmd->grammar = NULL;
+    icli_index_free(cmd->names);
+    cmd->names = NULL;
 
     cmd->argc = 0;
 
-    free(cmd);
+    icli_free(cmd);
 }
 
 int icli_register_commands(struct icli_command_params *params, struct icli_command *out_commads[], int n_commands)
@@ -768,187 +6073,701 @@ int icli_register_commands(struct icli_command_params *params, struct icli_comma
     return ret;
 }
 
-static int icli_init_command_argv(struct icli_command *cmd, struct icli_arg *argv)
+/* Prepare ARGV of CMD into OUT, which is set to NULL if ARGV is not provided */
+static int icli_args_create(const struct icli_command *cmd, struct icli_arg *argv, struct icli_args **out)
 {
+    struct icli_args *args = NULL;
     int ret = 0;
 
+    if (argv && cmd->argc < 0) {
+        icli_api_printf("argv provided while argc = ICLI_ARGS_DYNAMIC in command:%s\n", cmd->name);
+        ret = -1;
+        goto out;
+    }
+
     if (argv) {
-        cmd->argv = calloc((size_t)cmd->argc, sizeof(struct icli_arg));
-        if (!cmd->argv) {
+        size_t argc = (size_t)cmd->argc;
+
+        args = icli_calloc(ICLI_MEM_ARGUMENTS, 1, sizeof(*args) + argc * (sizeof(*args->argv) + sizeof(*args->priv)));
+        if (!args) {
             icli_api_printf("Unable to allocate memory for argv in command:%s\n", cmd->name);
             ret = -1;
             goto out;
         }
 
+        args->argc = cmd->argc;
+        args->argv = (struct icli_arg *)(args + 1);
+        args->priv = (struct icli_arg_priv *)(args->argv + argc);
+
         for (int i = 0; i < cmd->argc; ++i) {
-            cmd->argv[i].type = argv[i].type;
+            args->argv[i].type = argv[i].type;
+
+            if (AT_Int == argv[i].type && argv[i].range) {
+                if (argv[i].min > argv[i].max) {
+                    icli_api_printf("Invalid range [%" PRId64 ", %" PRId64 "] for arg %d in command:%s\n",
+                                    argv[i].min,
+                                    argv[i].max,
+                                    i,
+                                    cmd->name);
+                    ret = -1;
+                    goto out;
+                }
+                args->argv[i].min = argv[i].min;
+                args->argv[i].max = argv[i].max;
+                args->argv[i].range = 1;
+            }
+
+            if (AT_Regex == argv[i].type && argv[i].regex) {
+                int err;
+
+                args->argv[i].regex = icli_strdup(ICLI_MEM_ARGUMENTS, argv[i].regex);
+                args->priv[i].regex = icli_malloc(ICLI_MEM_ARGUMENTS, sizeof(regex_t));
+                if (!args->argv[i].regex || !args->priv[i].regex) {
+                    icli_free(args->priv[i].regex);
+                    args->priv[i].regex = NULL;
+                    icli_api_printf("Unable to allocate memory for regex %s in command:%s\n", argv[i].regex, cmd->name);
+                    ret = -1;
+                    goto out;
+                }
+
+                err = regcomp(args->priv[i].regex, argv[i].regex, REG_EXTENDED | REG_NOSUB);
+                if (err) {
+                    char errbuf[128];
+
+                    regerror(err, args->priv[i].regex, errbuf, sizeof(errbuf));
+                    icli_free(args->priv[i].regex);
+                    args->priv[i].regex = NULL;
+                    icli_api_printf("Invalid regex %s for arg %d in command:%s: %s\n",
+                                    argv[i].regex,
+                                    i,
+                                    cmd->name,
+                                    errbuf);
+                    ret = -1;
+                    goto out;
+                }
+            }
 
             if (argv[i].help) {
-                cmd->argv[i].help = strdup(argv[i].help);
-                if (!cmd->argv[i].help) {
+                args->argv[i].help = icli_strdup(ICLI_MEM_ARGUMENTS, argv[i].help);
+                if (!args->argv[i].help) {
                     icli_api_printf("Unable to allocate help string for arg %d (%s)\n", i, argv[i].help);
                     ret = -1;
                     goto out;
                 }
             }
 
-            if (AT_Val == argv[i].type) {
-                int n_vals = 0;
-
-                for (struct icli_arg_val *val = argv[i].vals; val && val->val; ++val, ++n_vals)
-                    ;
+            if (argv[i].set && AT_Val != argv[i].type && AT_Enum != argv[i].type) {
+                icli_api_printf("Value set provided for arg %d of type %d in command:%s\n", i, argv[i].type, cmd->name);
+                ret = -1;
+                goto out;
+            }
 
-                if (n_vals) {
-                    struct icli_arg_val *vals = calloc((size_t)(n_vals + 1), sizeof(struct icli_arg_val));
-                    if (!vals) {
-                        icli_api_printf("Unable to allocate memory for vals of size %d in command:%s\n",
-                                        n_vals + 1,
-                                        cmd->name);
-                        ret = -1;
-                        goto out;
-                    }
+            if (argv[i].set) {
+                if (argv[i].vals) {
+                    icli_api_printf("Both vals and value set provided for arg %d in command:%s\n", i, cmd->name);
+                    ret = -1;
+                    goto out;
+                }
 
-                    cmd->argv[i].vals = vals;
-
-                    for (int j = 0; argv[i].vals[j].val; ++j) {
-                        vals[j].val = strdup(argv[i].vals[j].val);
-                        if (!vals[j].val) {
-                            icli_api_printf("Unable to allocate memory for val %s in command:%s\n",
-                                            argv[i].vals[j].val,
-                                            cmd->name);
-                            ret = -1;
-                            goto out;
-                        }
-                        if (argv[i].vals[j].help) {
-                            vals[j].help = strdup(argv[i].vals[j].help);
-                            if (!vals[j].help) {
-                                icli_api_printf("Unable to allocate memory for val %s help %s in command:%s\n",
-                                                argv[i].vals[j].val,
-                                                argv[i].vals[j].help,
-                                                cmd->name);
-                                ret = -1;
-                                goto out;
-                            }
-                        }
-                    }
+                args->priv[i].set = argv[i].set;
+                ++argv[i].set->refs;
+            } else if ((AT_Val == argv[i].type || AT_Enum == argv[i].type) && argv[i].vals && argv[i].vals->val) {
+                /* values of a single argument are kept in a set of their own */
+                args->priv[i].set = icli_value_set_new(argv[i].vals, false);
+                if (!args->priv[i].set) {
+                    icli_api_printf("Unable to allocate memory for vals of arg %d in command:%s\n", i, cmd->name);
+                    ret = -1;
+                    goto out;
                 }
             }
         }
     }
 
 out:
+    if (ret) {
+        icli_args_free(args);
+        args = NULL;
+    }
+
+    *out = args;
+    return ret;
+}
+
+/* Link CMD into commands of PARENT, at the tail if TAIL. Readers traverse the list without locking, so the link to
+   CMD is stored last. Called with writer lock held */
+static void icli_link_command(struct icli_command *parent, struct icli_command *cmd, bool tail)
+{
+    struct icli_command **link = &LIST_FIRST(&parent->cmd_list);
+
+    while (tail && *link)
+        link = &LIST_NEXT(*link, cmd_list_entry);
+
+    cmd->cmd_list_entry.le_next = *link;
+    cmd->cmd_list_entry.le_prev = link;
+    if (*link)
+        (*link)->cmd_list_entry.le_prev = &cmd->cmd_list_entry.le_next;
+    __atomic_store_n(link, cmd, __ATOMIC_RELEASE);
+}
+
+/* Register command of PARAMS. Built-in commands are internal, and are linked after the commands of the mode. Called
+   with writer lock held */
+static int icli_add_command(struct icli_command_params *params, struct icli_command **out_command, bool builtin)
+{
+    bool need_end = true;
+    struct icli_command *parent;
+    int ret = 0;
+
+    if (out_command)
+        *out_command = NULL;
+
+    if (!params) {
+        icli_api_printf("NULL params specified\n");
+        return -1;
+    }
+
+    if (!params->name || !(*params->name) || !params->help || !(*params->help)) {
+        icli_api_printf("name or help argument not provided\n");
+        return -1;
+    }
+
+    if (!params->command && !params->typed_command && params->argc != 0) {
+        icli_api_printf("command callback not provided while argc != 0 (%d)\n", params->argc);
+        return -1;
+    }
+
+    if (params->command && params->typed_command) {
+        icli_api_printf("both command and typed_command callbacks provided\n");
+        return -1;
+    }
+
+    if (params->argv && 0 == params->argc) {
+        icli_api_printf("argv provided while argc = 0\n");
+        return -1;
+    }
+
+    if (params->grammar && params->argc != ICLI_ARGS_DYNAMIC) {
+        icli_api_printf("grammar provided while argc != ICLI_ARGS_DYNAMIC (%d)\n", params->argc);
+        return -1;
+    }
+
+    parent = params->parent;
+
+    if (NULL == parent) {
+        need_end = false;
+        parent = icli.root_cmd;
+    }
+
+    if (icli_live_mode(parent) != parent) {
+        icli_api_printf("parent of command %s was unregistered\n", params->name);
+        return -1;
+    }
+
+    if ((parent->names && icli_index_find(parent->names, params->name) >= 0) ||
+        (parent->builtins_pending && icli_is_builtin_name(parent, params->name))) {
+        icli_api_printf("command %s already registered\n", params->name);
+        return -1;
+    }
+
+    size_t name_size = strlen(params->name) + 1;
+    size_t doc_size = strlen(params->help) + 1;
+    size_t short_size = params->short_name ? strlen(params->short_name) + 1 : 0;
+    struct icli_command *cmd =
+        icli_calloc(ICLI_MEM_COMMANDS, 1, sizeof(struct icli_command) + name_size + doc_size + short_size);
+    if (NULL == cmd) {
+        icli_api_printf("unable to allocate memory for command %s\n", params->name);
+        return -1;
+    }
+
+    LIST_INIT(&cmd->cmd_list);
+    cmd->name = memcpy((char *)(cmd + 1), params->name, name_size);
+    cmd->name_len = (int)name_size - 1;
+    cmd->doc = memcpy(cmd->name + name_size, params->help, doc_size);
+    cmd->func = params->command;
+    cmd->typed_func = params->typed_command;
+    cmd->parent = parent;
+    cmd->argc = params->argc;
+    cmd->internal = builtin;
+    if (params->short_name)
+        cmd->short_name = memcpy(cmd->doc + doc_size, params->short_name, short_size);
+
+    ret = icli_args_create(cmd, params->argv, &cmd->args);
+    if (ret) {
+        icli_clean_command(cmd);
+        goto out;
+    }
+
+    if (params->grammar) {
+        cmd->grammar = icli_grammar_compile(params->grammar);
+        if (!cmd->grammar) {
+            icli_api_printf("Unable to compile grammar of command:%s\n", cmd->name);
+            ret = -1;
+            icli_clean_command(cmd);
+            goto out;
+        }
+    }
+
+    if (cmd->name_len > parent->max_name_len)
+        parent->max_name_len = cmd->name_len;
+
+    ++parent->n_cmds;
+
+    /* parent becomes a mode, its built-in commands are registered once they are needed */
+    if (1 == parent->n_cmds && need_end)
+        parent->builtins_pending = true;
+
+    if (icli_names_update(parent, cmd->name, cmd)) {
+        icli_api_printf("unable to index command %s\n", params->name);
+        --parent->n_cmds;
+        icli_clean_command(cmd);
+        ret = -1;
+        goto out;
+    }
+
+    icli_link_command(parent, cmd, builtin);
+    __atomic_add_fetch(&icli.tree_gen, 1, __ATOMIC_RELEASE);
+
+    if (out_command)
+        *out_command = cmd;
+
+out:
+    return ret;
+}
+
+struct icli_value_set *icli_value_set_create(const struct icli_arg_val vals[])
+{
+    struct icli_value_set *set;
+
+    if (!vals) {
+        icli_api_printf("NULL vals specified\n");
+        return NULL;
+    }
+
+    set = icli_value_set_new(vals, true);
+    if (!set)
+        icli_api_printf("Unable to allocate memory for value set\n");
+
+    return set;
+}
+
+int icli_value_set_update(struct icli_value_set *set, const struct icli_arg_val vals[])
+{
+    struct icli_vals *fresh, *old;
+
+    if (!set || !vals) {
+        icli_api_printf("NULL set or vals specified\n");
+        return -1;
+    }
+
+    fresh = icli_vals_new(vals);
+    if (!fresh) {
+        icli_api_printf("Unable to allocate memory for values of value set\n");
+        return -1;
+    }
+
+    icli_write_lock();
+    old = set->vals;
+    __atomic_store_n(&set->vals, fresh, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&icli.tree_gen, 1, __ATOMIC_RELEASE);
+    icli_rcu_retire(icli_vals_free, old);
+    icli_write_unlock();
+
+    return 0;
+}
+
+void icli_value_set_put(struct icli_value_set *set)
+{
+    if (!set)
+        return;
+
+    icli_write_lock();
+    icli_value_set_unref(set);
+    icli_write_unlock();
+}
+
+int icli_register_command(struct icli_command_params *params, struct icli_command **out_command)
+{
+    int ret;
+
+    icli_write_lock();
+    ret = icli_add_command(params, out_command, false);
+    icli_write_unlock();
+
+    return ret;
+}
+
+/* Free unregistered command and its subtree, unless a mode in it is still in use */
+static void icli_command_retire(void *ptr)
+{
+    struct icli_command *cmd = ptr;
+
+    if (__atomic_load_n(&cmd->mode_refs, __ATOMIC_ACQUIRE) && !icli.rcu.draining) {
+        /* a mode left later can't be entered again, as the subtree is unlinked */
+        icli_rcu_retire(icli_command_retire, cmd);
+        return;
+    }
+
+    icli_clean_command(cmd);
+}
+
+int icli_unregister_command(struct icli_command *cmd)
+{
+    struct icli_command *parent;
+    int ret = 0;
+
+    if (!cmd || cmd == icli.root_cmd || cmd->internal) {
+        icli_api_printf("Unable to unregister %s command\n", cmd ? cmd->name : "NULL");
+        return -1;
+    }
+
+    icli_write_lock();
+
+    if (icli_live_mode(cmd) != cmd) {
+        icli_api_printf("command %s already unregistered\n", cmd->name);
+        ret = -1;
+        goto out;
+    }
+
+    parent = cmd->parent;
+    if (icli_names_update(parent, cmd->name, NULL)) {
+        icli_api_printf("unable to remove command %s from index\n", cmd->name);
+        ret = -1;
+        goto out;
+    }
+
+    /* readers at the command may still follow its link to the next one */
+    if (LIST_NEXT(cmd, cmd_list_entry))
+        LIST_NEXT(cmd, cmd_list_entry)->cmd_list_entry.le_prev = cmd->cmd_list_entry.le_prev;
+    __atomic_store_n(cmd->cmd_list_entry.le_prev, LIST_NEXT(cmd, cmd_list_entry), __ATOMIC_RELEASE);
+    --parent->n_cmds;
+
+    __atomic_store_n(&cmd->removed, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&icli.tree_gen, 1, __ATOMIC_RELEASE);
+
+    icli_rcu_retire(icli_command_retire, cmd);
+
+out:
+    icli_write_unlock();
     return ret;
 }
 
-int icli_register_command(struct icli_command_params *params, struct icli_command **out_command)
+static void icli_audit_push(const char *buf, size_t len)
+{
+    struct icli_audit *audit = &icli.audit;
+    size_t head = audit->head;
+    size_t tail = __atomic_load_n(&audit->tail, __ATOMIC_ACQUIRE);
+    size_t pos = head & (audit->size - 1);
+    size_t first = len < audit->size - pos ? len : audit->size - pos;
+
+    if (audit->size - (head - tail) < len) {
+        __atomic_add_fetch(&audit->dropped, len, __ATOMIC_RELAXED);
+        return;
+    }
+
+    memcpy(audit->ring + pos, buf, first);
+    memcpy(audit->ring, buf + first, len - first);
+    __atomic_store_n(&audit->head, head + len, __ATOMIC_RELEASE);
+
+    /* pairs with the writer setting waiting and re-checking head */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&audit->waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        ssize_t ret UNUSED = write(audit->efd, &one, sizeof(one));
+    }
+}
+
+static void icli_audit_write(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0 && EINTR == errno)
+            continue;
+        if (ret <= 0)
+            return;
+
+        buf += ret;
+        len -= (size_t)ret;
+    }
+}
+
+static void *icli_audit_writer(void *arg)
+{
+    struct icli_audit *audit = arg;
+
+    for (;;) {
+        size_t head = __atomic_load_n(&audit->head, __ATOMIC_ACQUIRE);
+        size_t tail = audit->tail;
+        size_t dropped;
+        uint64_t val;
+
+        if (head != tail) {
+            size_t pos = tail & (audit->size - 1);
+            size_t len = head - tail < audit->size - pos ? head - tail : audit->size - pos;
+
+            icli_audit_write(audit->fd, audit->ring + pos, len);
+            __atomic_store_n(&audit->tail, tail + len, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        dropped = __atomic_exchange_n(&audit->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped)
+            dprintf(audit->fd, "\n[%zu bytes of output dropped]\n", dropped);
+
+        if (__atomic_load_n(&audit->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        __atomic_store_n(&audit->waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&audit->head, __ATOMIC_SEQ_CST) != tail ||
+            __atomic_load_n(&audit->stop, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&audit->waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        while (read(audit->efd, &val, sizeof(val)) < 0 && EINTR == errno)
+            ;
+    }
+
+    return NULL;
+}
+
+static void icli_audit_cleanup(void)
+{
+    struct icli_audit *audit = &icli.audit;
+
+    if (audit->running) {
+        uint64_t one = 1;
+        ssize_t ret UNUSED;
+
+        __atomic_store_n(&audit->stop, 1, __ATOMIC_SEQ_CST);
+        ret = write(audit->efd, &one, sizeof(one));
+        pthread_join(audit->thread, NULL);
+    }
+
+    if (audit->fd >= 0)
+        close(audit->fd);
+    if (audit->efd >= 0)
+        close(audit->efd);
+    icli_free(audit->ring);
+
+    memset(audit, 0, sizeof(*audit));
+    audit->fd = audit->efd = -1;
+}
+
+static int icli_audit_init(const char *fname, size_t buffer_size)
 {
-    bool need_end = true;
-    struct icli_command *parent, *it;
-    int ret = 0;
+    struct icli_audit *audit = &icli.audit;
+    sigset_t all, orig;
+    int ret;
 
-    if (out_command)
-        *out_command = NULL;
+    audit->size = ICLI_AUDIT_BUFFER_SIZE;
+    while (audit->size < buffer_size)
+        audit->size *= 2;
 
-    if (!params) {
-        icli_api_printf("NULL params specified\n");
+    audit->ring = icli_malloc(ICLI_MEM_BUFFERS, audit->size);
+    if (!audit->ring) {
+        icli_api_printf("Unable to allocate memory for audit buffer\n");
         return -1;
     }
 
-    if (!params->name || !(*params->name) || !params->help || !(*params->help)) {
-        icli_api_printf("name or help argument not provided\n");
+    audit->fd = open(fname, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (audit->fd < 0) {
+        icli_api_printf("Unable to open audit file %s (%m)\n", fname);
         return -1;
     }
 
-    if (!params->command && params->argc != 0) {
-        icli_api_printf("command callback not provided while argc != 0 (%d)\n", params->argc);
+    audit->efd = eventfd(0, EFD_CLOEXEC);
+    if (audit->efd < 0) {
+        icli_api_printf("Unable to create eventfd (%m)\n");
         return -1;
     }
 
-    if (params->argv && 0 == params->argc) {
-        icli_api_printf("argv provided while argc = 0\n");
+    /* signals are handled by the interactive thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
+    ret = pthread_create(&audit->thread, NULL, icli_audit_writer, audit);
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    if (ret) {
+        icli_api_printf("Unable to create audit writer thread (%s)\n", strerror(ret));
         return -1;
     }
 
-    parent = params->parent;
+    audit->running = true;
+    return 0;
+}
 
-    if (NULL == parent) {
-        need_end = false;
-        parent = icli.root_cmd;
-    }
+int icli_notify(const char *format, ...)
+{
+    struct icli_notify *notify = &icli.notify;
+    struct icli_notice *notice;
+    va_list args;
+    int len;
 
-    LIST_FOREACH(it, &parent->cmd_list, cmd_list_entry)
-    {
-        if (strcmp(it->name, params->name) == 0) {
-            icli_api_printf("command %s already registered\n", params->name);
-            return -1;
-        }
+    if (__atomic_add_fetch(&notify->pending, 1, __ATOMIC_RELAXED) > ICLI_NOTIFY_QUEUE_MAX) {
+        __atomic_sub_fetch(&notify->pending, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&notify->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
     }
 
-    struct icli_command *cmd = calloc(1, sizeof(struct icli_command));
-    if (NULL == cmd) {
-        icli_api_printf("unable to allocate memory for command %s\n", params->name);
+    va_start(args, format);
+    len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    notice = len < 0 ? NULL : icli_malloc(ICLI_MEM_BUFFERS, sizeof(*notice) + (size_t)len + 1);
+    if (!notice) {
+        __atomic_sub_fetch(&notify->pending, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&notify->dropped, 1, __ATOMIC_RELAXED);
         return -1;
     }
 
-    LIST_INIT(&cmd->cmd_list);
-    cmd->name = strdup(params->name);
-    cmd->name_len = (int)strlen(cmd->name);
-    cmd->doc = strdup(params->help);
-    cmd->func = params->command;
-    cmd->parent = parent;
-    cmd->argc = params->argc;
-    if (params->short_name)
-        cmd->short_name = strdup(params->short_name);
+    va_start(args, format);
+    vsnprintf(notice->text, (size_t)len + 1, format, args);
+    va_end(args);
 
-    ret = icli_init_command_argv(cmd, params->argv);
-    if (ret) {
-        icli_clean_command(cmd);
-        goto out;
+    notice->next = __atomic_load_n(&notify->head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&notify->head, &notice->next, notice, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    /* pairs with the interactive thread clearing signaled before taking the stack */
+    if (!__atomic_exchange_n(&notify->signaled, 1, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        ssize_t ret UNUSED = write(notify->efd, &one, sizeof(one));
     }
 
-    if (cmd->name_len > parent->max_name_len)
-        parent->max_name_len = cmd->name_len;
+    return 0;
+}
 
-    ++parent->n_cmds;
+/* Print notifications queued by icli_notify() above the line being edited, and redisplay the line */
+static void icli_notify_drain(bool editing)
+{
+    struct icli_notify *notify = &icli.notify;
+    struct icli_notice *notice, *next, *fifo = NULL;
+    bool paging = icli.paging;
+    uint32_t n_notices = 0;
+    uint32_t dropped;
+    uint64_t val;
+
+    if (!__atomic_load_n(&notify->signaled, __ATOMIC_ACQUIRE))
+        return;
 
-    if (1 == parent->n_cmds && need_end) {
-        struct icli_command *end;
-        struct icli_command_params param = {.parent = parent,
-                                            .name = "end",
-                                            .command = icli_end,
-                                            .argc = ICLI_ARGS_DYNAMIC,
-                                            .help = "Exit to upper level. args: [number of levels]"};
-        ret = icli_register_command(&param, &end);
-        if (ret) {
-            --parent->n_cmds;
-            icli_clean_command(cmd);
-            goto out;
-        }
-        end->internal = true;
+    while (read(notify->efd, &val, sizeof(val)) < 0 && EINTR == errno)
+        ;
+    __atomic_store_n(&notify->signaled, 0, __ATOMIC_SEQ_CST);
 
-        ret = icli_init_default_cmds(parent);
-        if (ret) {
-            --parent->n_cmds;
-            icli_clean_command(cmd);
-            goto out;
-        }
+    notice = __atomic_exchange_n(&notify->head, NULL, __ATOMIC_ACQUIRE);
+    dropped = __atomic_exchange_n(&notify->dropped, 0, __ATOMIC_RELAXED);
+    if (!notice && !dropped)
+        return;
+
+    /* the stack holds the most recent notification first */
+    for (; notice; notice = next) {
+        next = notice->next;
+        notice->next = fifo;
+        fifo = notice;
+        ++n_notices;
     }
+    __atomic_sub_fetch(&notify->pending, n_notices, __ATOMIC_RELAXED);
 
-    LIST_INSERT_HEAD(&parent->cmd_list, cmd, cmd_list_entry);
+    /* notifications are not paged */
+    icli.paging = false;
+    if (editing) {
+        fputs("\r\x1b[K", stdout);
+        fflush(stdout);
+    }
 
-    if (out_command)
-        *out_command = cmd;
+    for (uint32_t i = 0; fifo; fifo = next, ++i) {
+        size_t len = strlen(fifo->text);
 
-out:
-    return ret;
+        next = fifo->next;
+        if (i < ICLI_NOTIFY_BURST)
+            icli_printf("%s%s", fifo->text, len && '\n' == fifo->text[len - 1] ? "" : "\n");
+        else
+            ++dropped;
+        icli_free(fifo);
+    }
+
+    if (dropped)
+        icli_printf("(%" PRIu32 " more notifications)\n", dropped);
+
+    icli.paging = paging;
+    fflush(stdout);
+
+    if (editing)
+        rl_forced_update_display();
+}
+
+static void icli_notify_cleanup(void)
+{
+    struct icli_notify *notify = &icli.notify;
+    struct icli_notice *notice = notify->head;
+
+    while (notice) {
+        struct icli_notice *next = notice->next;
+
+        icli_free(notice);
+        notice = next;
+    }
+
+    if (notify->efd >= 0)
+        close(notify->efd);
+
+    memset(notify, 0, sizeof(*notify));
+    notify->efd = -1;
+}
+
+/* Set up readline and load history for the interactive loop */
+static int icli_init_readline(void)
+{
+    uint64_t start = icli_clock_ns();
+
+    /* Allow conditional parsing of the ~/.inputrc file. */
+    rl_readline_name = icli.app_name;
+
+    /* Tell the completer that we want a crack first. */
+    rl_attempted_completion_function = icli_completion;
+    /* Keep the ranked order of completion candidates */
+    rl_sort_completion_matches = 0;
+
+    using_history();
+    stifle_history(icli.history_size);
+
+    icli.rl_ready = true;
+    icli_build_prompt(icli.curr_cmd);
+
+    icli_phase_done(ICLI_PHASE_READLINE, start);
+
+    if (icli_hist_init()) {
+        icli_api_printf("Unable to read history from %s (%m)\n", icli.hist_file);
+        return -1;
+    }
+
+    return 0;
 }
 
 int icli_init(struct icli_params *params)
 {
+    uint64_t start = icli_clock_ns();
+
     memset(&icli, 0, sizeof(icli));
+    icli.journal.fd = -1;
+    icli.audit.fd = icli.audit.efd = -1;
+    icli.notify.efd = -1;
+    icli.cmd_format = -1;
     int ret = 0;
 
-    icli.root_cmd = calloc(1, sizeof(struct icli_command));
+    const struct icli_allocator *hooks = &params->allocator;
+    if (!hooks->malloc != !hooks->realloc || !hooks->malloc != !hooks->free) {
+        icli_api_printf("allocator must set all of malloc, realloc and free, or none of them\n");
+        return -1;
+    }
+    icli_mem.hooks = *hooks;
+    memset(&icli_mem.stats, 0, sizeof(icli_mem.stats));
+    memset(icli_mem.categories, 0, sizeof(icli_mem.categories));
+
+    if (icli_rcu_init())
+        return -1;
+
+    icli.root_cmd = icli_calloc(ICLI_MEM_COMMANDS, 1, sizeof(struct icli_command));
     if (!icli.root_cmd) {
         icli_api_printf("Unable to allocate memory for root command\n");
         return -1;
@@ -956,12 +6775,13 @@ int icli_init(struct icli_params *params)
 
     LIST_INIT(&icli.root_cmd->cmd_list);
     icli.root_cmd->internal = true;
+    icli.root_cmd->builtins_pending = true;
 
-    icli.curr_cmd = icli.root_cmd;
+    icli_set_mode(&icli.curr_cmd, &icli.modes, icli.root_cmd);
 
     icli.user_data = params->user_data;
 
-    icli.prompt = strdup(params->prompt);
+    icli.prompt = icli_strdup(ICLI_MEM_PROMPTS, params->prompt);
     if (!icli.prompt) {
         icli_api_printf("Unable to allocate memory for prompt\n");
         ret = -1;
@@ -969,7 +6789,7 @@ int icli_init(struct icli_params *params)
     }
 
     if (params->hist_file) {
-        icli.hist_file = strdup(params->hist_file);
+        icli.hist_file = icli_strdup(ICLI_MEM_HISTORY, params->hist_file);
         if (!icli.hist_file) {
             icli_api_printf("Unable to allocate memory for hist_file\n");
             ret = -1;
@@ -980,56 +6800,43 @@ int icli_init(struct icli_params *params)
     icli.cmd_hook = params->cmd_hook;
     icli.out_hook = params->out_hook;
     icli.err_hook = params->err_hook;
+    icli.out_write_hook = params->out_write_hook;
+    icli.err_write_hook = params->err_write_hook;
 
-    /* Allow conditional parsing of the ~/.inputrc file. */
-    rl_readline_name = strdup(params->app_name);
-    if (!rl_readline_name) {
-        icli_api_printf("Unable to allocate memory for rl_readline_name\n");
-        ret = -1;
-        goto err;
-    }
-
-    /* Tell the completer that we want a crack first. */
-    rl_attempted_completion_function = icli_completion;
-
-    using_history();
-    stifle_history(params->history_size);
-
-    if (icli.hist_file) {
-        ret = read_history(icli.hist_file);
-        if (ret && ret != ENOENT) {
-            icli_api_printf("Unable to read history from %s (%d)\n", icli.hist_file, ret);
-            ret = -1;
+    if (params->audit_file) {
+        ret = icli_audit_init(params->audit_file, params->audit_buffer_size);
+        if (ret)
             goto err;
-        }
     }
 
-    rl_get_screen_size(&icli.rows, &icli.cols);
-
-    icli_build_prompt(icli.curr_cmd);
-
-    struct icli_arg execute_args[] = {{.type = AT_File, .help = "File to read commands from"}};
-    struct icli_command_params cmd_params[] = {{.name = "quit", .command = icli_quit, .help = "Quit interactive shell"},
-                                               {.name = "execute",
-                                                .command = icli_execute,
-                                                .help = "Execute commands from file",
-                                                .argc = 1,
-                                                .argv = execute_args}};
-    struct icli_command *commands[array_len(cmd_params)] = {};
-    ret = icli_register_commands(cmd_params, commands, array_len(cmd_params));
-    if (ret) {
+    icli.notify.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (icli.notify.efd < 0) {
+        icli_api_printf("Unable to create eventfd (%m)\n");
+        ret = -1;
         goto err;
     }
 
-    for (size_t i = 0; i < array_len(cmd_params); ++i) {
-        commands[i]->internal = true;
+    icli.app_name = icli_strdup(ICLI_MEM_OTHER, params->app_name);
+    if (!icli.app_name) {
+        icli_api_printf("Unable to allocate memory for app_name\n");
+        ret = -1;
+        goto err;
     }
 
-    ret = icli_init_default_cmds(NULL);
-    if (ret) {
+    icli.history_size = params->history_size;
+
+    /* readline, history and terminal are set up once they are needed */
+    icli.interactive = isatty(STDIN_FILENO);
+    icli.color = isatty(STDOUT_FILENO);
+    icli.paging = icli.interactive && icli.color;
+    if (!icli.color)
+        setvbuf(stdout, NULL, _IOFBF, ICLI_OUT_BUFFER_SIZE);
+
+    ret = icli_init_renderers();
+    if (ret)
         goto err;
-    }
 
+    icli_phase_done(ICLI_PHASE_INIT, start);
     return 0;
 err:
     icli_cleanup();
@@ -1039,69 +6846,152 @@ err:
 void icli_cleanup(void)
 {
     icli_clean_command(icli.root_cmd);
+    icli_rcu_cleanup();
+    icli_mode_stack_set(&icli.modes, NULL);
 
-    HISTORY_STATE *hist_state = history_get_history_state();
-    HIST_ENTRY **mylist = history_list();
-
-    if (mylist)
-        free(mylist[0]);
+    if (icli.rl_ready) {
+        HISTORY_STATE *hist_state = history_get_history_state();
+        HIST_ENTRY **mylist = history_list();
 
-    free(mylist);
-    free(hist_state);
+        if (mylist)
+            free(mylist[0]);
 
-    if (icli.hist_file) {
-        int ret = write_history(icli.hist_file);
-        if (ret)
-            icli_api_printf("Unable to save history to %s (%d)\n", icli.hist_file, ret);
+        free(mylist);
+        free(hist_state);
     }
 
-    clear_history();
+    icli_hist_cleanup();
+    icli_hist_index_cleanup();
 
-    rl_callback_handler_remove();
+    icli_completion_cleanup();
+    icli_cleanup_renderers();
+    icli_strbuf_free(&icli.sink_buf);
+    icli_strbuf_free(&icli.out_buf);
+    icli_audit_cleanup();
+    icli_notify_cleanup();
 
-    free(rl_readline_name);
-    rl_readline_name = "";
+    if (icli.rl_ready) {
+        clear_history();
 
-    free((void *)icli.prompt);
-    free((void *)icli.curr_prompt);
-    free((void *)icli.hist_file);
+        rl_callback_handler_remove();
+
+        rl_readline_name = "";
+    }
+
+    icli_free(icli.app_name);
+
+    icli_free((void *)icli.prompt);
+    icli_free((void *)icli.curr_prompt);
+    icli_free((void *)icli.hist_file);
 
     memset(&icli, 0, sizeof(icli));
 }
 
-void icli_run(void)
+/* Execute lines read from non-terminal stdin. Lines are not added to history and are not subject to history
+   expansion */
+static void icli_run_batch(void)
 {
-    char *line, *s;
+    char *line = NULL;
+    size_t size = 0;
+
+    icli.batch = true;
 
-    /* Loop reading and executing lines until the user quits. */
     while (!icli.done) {
-        line = readline(icli.curr_prompt);
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
 
-        if (!line)
+        /* notifications are printed between lines */
+        icli_notify_drain(false);
+
+        /* flush output before waiting for more input, so a process driving us through pipes gets the responses */
+        if (poll(&pfd, 1, 0) == 0)
+            fflush(stdout);
+
+        if (icli_getdelim(&line, &size, '\n', stdin) < 0)
             break;
 
-        /* Remove leading and trailing whitespace from the line.
-           Then, if there is anything left, add it to the history list
-           and execute it. */
-        s = stripwhite(line);
+        char *s = stripwhite(line);
+        if (*s)
+            icli_execute_line(s);
+    }
+
+    icli_free(line);
+    fflush(stdout);
+    icli.batch = false;
+}
 
-        if (*s) {
-            char *expansion;
-            int result = history_expand(s, &expansion);
+/* Handle line read by readline, NULL on end of input */
+static void icli_handle_line(char *line)
+{
+    char *s;
 
-            if (result < 0) {
-                icli_err_printf("%s\n", expansion);
-            } else if (result == 2) {
-                icli_printf("%s\n", expansion);
-            } else {
-                add_history(expansion);
-                icli_execute_line(expansion);
-            }
-            free(expansion);
+    if (!line) {
+        icli.done = true;
+        return;
+    }
+
+    /* Remove leading and trailing whitespace from the line.
+       Then, if there is anything left, add it to the history list
+       and execute it. */
+    s = stripwhite(line);
+
+    if (*s) {
+        char *expansion;
+        int result = history_expand(s, &expansion);
+
+        if (result < 0) {
+            icli_err_printf("%s\n", expansion);
+        } else if (result == 2) {
+            icli_printf("%s\n", expansion);
+        } else {
+            icli_history_add(icli.curr_cmd, expansion);
+            icli_execute_line(expansion);
+        }
+        free(expansion);
+    }
+
+    free(line);
+
+    /* show prompt of the (possibly changed) mode for the next line */
+    if (!icli.done)
+        rl_callback_handler_install(icli.curr_prompt, icli_handle_line);
+}
+
+void icli_run(void)
+{
+    struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN}, {.fd = icli.notify.efd, .events = POLLIN}};
+
+    if (!icli.interactive) {
+        icli_run_batch();
+        return;
+    }
+
+    if (!icli.rl_ready && icli_init_readline())
+        icli_api_printf("Continuing without history\n");
+
+    /* Input is read a key at a time, so that notifications can be printed while the user is typing */
+    icli_notify_drain(false);
+    rl_callback_handler_install(icli.curr_prompt, icli_handle_line);
+    /* Key bindings can be added only once line editor is initialized */
+    icli_hist_bind_keys();
+
+    /* Loop reading and executing lines until the user quits. */
+    while (!icli.done) {
+        if (poll(fds, array_len(fds), -1) < 0) {
+            if (EINTR == errno)
+                continue;
+            icli_api_printf("Unable to poll input (%m)\n");
+            break;
         }
 
-        free(line);
+        /* keys are handled first, so a flood of notifications can't starve the user */
+        if (fds[0].revents)
+            rl_callback_read_char();
+
+        if (fds[1].revents && !icli.done)
+            icli_notify_drain(true);
     }
+
+    rl_callback_handler_remove();
 }
 
 static int getch(void)
@@ -1122,7 +7012,23 @@ static int getch(void)
     return res;
 }
 
-#define MORE_STRING "--More--"
+
+/* Get size of terminal, needed only once output is paged */
+static void icli_probe_terminal(void)
+{
+    uint64_t start = icli_clock_ns();
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 2) {
+        icli.rows = ws.ws_row;
+        icli.cols = ws.ws_col;
+    } else {
+        icli.rows = 24;
+        icli.cols = 80;
+    }
+
+    icli_phase_done(ICLI_PHASE_TERMINAL, start);
+}
 
 static void icli_handle_print_line(void)
 {
@@ -1131,6 +7037,9 @@ static void icli_handle_print_line(void)
     if (icli.skip_output)
         return;
 
+    if (!icli.rows)
+        icli_probe_terminal();
+
     if (icli.curr_row == icli.rows - 2) {
         printf(MORE_STRING);
         int c = getch();
@@ -1148,58 +7057,130 @@ static void icli_handle_print_line(void)
     }
 }
 
-void icli_printf(const char *format, ...)
+/* Append formatted output to BUF */
+static int icli_strbuf_vprintf(struct icli_strbuf *buf, const char *format, va_list args)
 {
-    va_list args;
-    va_list args_hook;
+    va_list args_copy;
+    int len;
 
-    icli_handle_print_line();
+    va_copy(args_copy, args);
+    len = vsnprintf(buf->data ? buf->data + buf->len : NULL, buf->size - buf->len, format, args_copy);
+    va_end(args_copy);
 
-    if (icli.skip_output)
-        return;
+    if (len < 0)
+        return -1;
 
-    va_start(args, format);
+    if (buf->len + (size_t)len >= buf->size) {
+        if (icli_strbuf_reserve(buf, (size_t)len))
+            return -1;
 
-    if (icli.out_hook) {
-        va_copy(args_hook, args);
-        icli.out_hook(format, args_hook, icli.user_data);
-        va_end(args_hook);
+        vsnprintf(buf->data + buf->len, buf->size - buf->len, format, args);
     }
 
-    vprintf(format, args);
-    va_end(args);
+    buf->len += (size_t)len;
+    return 0;
 }
 
-void icli_err_printf(const char *format, ...)
+/* Format output into STREAM of the capture sink */
+static void icli_sink_vprintf(struct icli_sink_stream *stream, const char *format, va_list args)
 {
-    va_list args;
-    va_list args_hook;
+    struct icli_strbuf *buf = &icli.sink_buf;
+    struct icli_strbuf stream_buf;
+
+    if (!stream->write) {
+        stream_buf = (struct icli_strbuf){.data = stream->buf,
+                                          .len = stream->len,
+                                          .size = stream->size,
+                                          .caller_owned = true};
+        buf = &stream_buf;
+    } else {
+        buf->len = 0;
+    }
 
-    icli.error_printed = true;
+    if (icli_strbuf_vprintf(buf, format, args)) {
+        icli.sink_failed = true;
+        return;
+    }
+
+    if (stream->write) {
+        stream->write(buf->data, buf->len, stream->ctx);
+    } else {
+        stream->buf = buf->data;
+        stream->len = buf->len;
+        stream->size = buf->size;
+    }
+}
 
-    icli_handle_print_line();
+/* Central output path of icli_printf() and icli_err_printf() */
+static void icli_vout(bool err, const char *format, va_list args)
+{
+    va_list args_hook;
+    icli_output_hook_t hook = err ? icli.err_hook : icli.out_hook;
+    icli_write_hook_t write_hook = err ? icli.err_write_hook : icli.out_write_hook;
 
-    if (icli.skip_output)
+    if (icli.sink) {
+        icli_sink_vprintf(err ? &icli.sink->err : &icli.sink->out, format, args);
         return;
+    }
 
-    printf(ANSI_RED_NORMAL);
-    va_start(args, format);
+    if (icli.paging) {
+        icli_handle_print_line();
+
+        if (icli.skip_output)
+            return;
+    }
 
-    if (icli.err_hook) {
+    if (err && icli.color)
+        printf(ANSI_RED_NORMAL);
+
+    if (hook) {
         va_copy(args_hook, args);
-        icli.err_hook(format, args_hook, icli.user_data);
+        hook(format, args_hook, icli.user_data);
         va_end(args_hook);
     }
 
-    vprintf(format, args);
+    if (write_hook || icli.audit.running) {
+        /* format once for terminal, hook and audit log */
+        icli.out_buf.len = 0;
+        if (!icli_strbuf_vprintf(&icli.out_buf, format, args)) {
+            fwrite(icli.out_buf.data, 1, icli.out_buf.len, stdout);
+            if (write_hook)
+                write_hook(icli.out_buf.data, icli.out_buf.len, icli.user_data);
+            if (icli.audit.running)
+                icli_audit_push(icli.out_buf.data, icli.out_buf.len);
+        }
+    } else {
+        vprintf(format, args);
+    }
+
+    if (err && icli.color)
+        printf(ANSI_RESET);
+}
+
+void icli_printf(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    icli_vout(false, format, args);
+    va_end(args);
+}
+
+void icli_err_printf(const char *format, ...)
+{
+    va_list args;
+
+    icli.error_printed = true;
+
+    va_start(args, format);
+    icli_vout(true, format, args);
     va_end(args);
-    printf(ANSI_RESET);
 }
 
 void icli_set_prompt(const char *prompt)
 {
-    free((void *)icli.prompt);
-    icli.prompt = strdup(prompt);
+    icli_free((void *)icli.prompt);
+    icli.prompt = icli_strdup(ICLI_MEM_PROMPTS, prompt);
     icli_build_prompt(icli.curr_cmd);
 }
 
@@ -1262,7 +7243,9 @@ int icli_commands_to_dot(const char *fname)
         goto out;
     }
 
+    icli_read_lock();
     ret = icli_print_command_to_dot(icli.root_cmd, out);
+    icli_read_unlock();
     if (ret) {
         icli_api_printf("unable to write to file %s (%m)\n", fname);
         goto out;
@@ -1281,13 +7264,38 @@ out:
     return ret;
 }
 
+/* Free arguments replaced by icli_reset_arguments() */
+static void icli_args_retire(void *ptr)
+{
+    icli_args_free(ptr);
+}
+
 int icli_reset_arguments(struct icli_command *cmd, struct icli_arg *argv)
 {
+    struct icli_args *old, *fresh;
+    int ret;
+
     if (0 == cmd->argc || cmd->argc == ICLI_ARGS_DYNAMIC) {
         icli_api_printf("unable to reset arguments, since command %s specified argc = 0\n", cmd->name);
         return -1;
     }
 
-    icli_clean_command_argv(cmd);
-    return icli_init_command_argv(cmd, argv);
+    icli_write_lock();
+
+    /* arguments are prepared aside and published with a single pointer, the old ones are freed once no reader may
+       use them */
+    ret = icli_args_create(cmd, argv, &fresh);
+    if (ret)
+        goto out;
+
+    old = cmd->args;
+    __atomic_store_n(&cmd->args, fresh, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&icli.tree_gen, 1, __ATOMIC_RELEASE);
+
+    if (old)
+        icli_rcu_retire(icli_args_retire, old);
+
+out:
+    icli_write_unlock();
+    return ret;
 }
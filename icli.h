@@ -21,6 +21,8 @@
 #pragma once
 
 #include <stdarg.h>
+#include <stdint.h>
+#include <netinet/in.h>
 
 /**
  * @file
@@ -47,6 +49,50 @@ typedef void (*icli_cmd_hook_t)(const char *, char *[], int, void *);
  */
 typedef void (*icli_output_hook_t)(const char *, va_list, void *);
 
+/**
+ * Pre-formatted output hook callback, receives the output (not NUL terminated) and its length
+ */
+typedef void (*icli_write_hook_t)(const char *, size_t, void *);
+
+/**
+ * Writer of captured output
+ * @param buf the output (not NUL terminated)
+ * @param len length of the output
+ * @param ctx context provided in icli_sink
+ */
+typedef void (*icli_write_t)(const char *buf, size_t len, void *ctx);
+
+/**
+ * Stream of captured output. Output is passed to write callback, or appended to buf if write is NULL
+ */
+struct icli_sink_stream {
+    icli_write_t write; /**< callback receiving the output, can be NULL */
+    void *ctx; /**< context passed to write */
+    /** NUL terminated output, grown with realloc() as needed. Can be initialized to caller allocated buffer or NULL,
+     * and must be freed by the caller */
+    char *buf;
+    size_t len; /**< length of output in buf */
+    size_t size; /**< allocated size of buf */
+};
+
+/**
+ * Destination of output of icli_execute_capture()
+ */
+struct icli_sink {
+    struct icli_sink_stream out; /**< output of icli_printf() */
+    struct icli_sink_stream err; /**< output of icli_err_printf() */
+};
+
+/**
+ * Allocator of memory used internally by icli. The callbacks may be called from any thread that calls into icli
+ */
+struct icli_allocator {
+    void *(*malloc)(size_t size, void *ctx); /**< allocate size bytes, NULL on failure */
+    void *(*realloc)(void *ptr, size_t size, void *ctx); /**< resize ptr (NULL to allocate), NULL on failure */
+    void (*free)(void *ptr, void *ctx); /**< free ptr allocated by malloc or realloc */
+    void *ctx; /**< context passed to the callbacks */
+};
+
 /**
  * Structure to initialize the library instance
  * Note that library instance is global per process (readline limitation)
@@ -56,10 +102,24 @@ struct icli_params {
     int history_size; /**< how many commands to keep in history */
     const char *app_name; /**< name of application for interfacing ~/.inputrc */
     const char *prompt; /**< prompt string (will be post-fixed by "> " */
-    const char *hist_file; /**< history file to load/store history. can be NULL for not saving history */
+    /** history file to load/store history. can be NULL for not saving history. Each command is appended to the file
+     * as it is executed, so concurrent sessions can share the same file. The file is compacted to history_size entries
+     * once it grows beyond twice that size */
+    const char *hist_file;
     icli_cmd_hook_t cmd_hook; /**< hook to be called before command is executed */
     icli_output_hook_t out_hook; /**< hook to be called when there is output */
     icli_output_hook_t err_hook; /**< hook to be called when there is error print */
+    icli_write_hook_t out_write_hook; /**< hook to be called with formatted output */
+    icli_write_hook_t err_write_hook; /**< hook to be called with formatted error output */
+    /** file to append all output to, can be NULL. The file is written by a background thread, so commands are not
+     * delayed by the file I/O. Output is dropped (and the number of dropped bytes is logged) if the writer falls
+     * behind by more than audit_buffer_size bytes */
+    const char *audit_file;
+    size_t audit_buffer_size; /**< size of buffer of output not written yet to audit_file, 0 for default (64KB) */
+    /** allocator of all memory of icli, all callbacks or none must be set. If none, malloc() is used and the allocated
+     * bytes are counted, see icli_get_alloc_stats(). Memory of the line editor, internals of compiled regular
+     * expressions and captured output (icli_sink) are allocated with malloc() regardless */
+    struct icli_allocator allocator;
 };
 
 /**
@@ -80,7 +140,14 @@ typedef enum icli_ret (*icli_cmd_func_t)(char *[], int, void *);
 enum icli_arg_type {
     AT_None, /**< No argument */
     AT_Val, /**< Argument with list of values */
-    AT_File /**< File */
+    AT_File, /**< File */
+    AT_Int, /**< Signed integer, limited to [min, max] range if range is set */
+    AT_Uint64, /**< Unsigned 64 bit integer */
+    AT_IPv4, /**< IPv4 address */
+    AT_IPv6, /**< IPv6 address */
+    AT_Size, /**< Size in bytes with optional K, M, G, T (powers of 1024) suffix */
+    AT_Enum, /**< One of list of values, passed as its index */
+    AT_Regex /**< String matching POSIX extended regular expression */
 };
 
 /**
@@ -91,17 +158,51 @@ struct icli_arg_val {
     const char *help; /**< Optional help string for the argument */
 };
 
+/**
+ * Set of argument values shared by arguments of many commands @see icli_value_set_create()
+ */
+struct icli_value_set;
+
 /**
  * Argument definition
  */
 struct icli_arg {
     enum icli_arg_type type; /**< Type of the argument @see icli_arg_type() */
     union {
-        struct icli_arg_val *vals; /**< Array of possible values @see icli_arg_val() */
+        struct icli_arg_val *vals; /**< Array of possible values for AT_Val and AT_Enum @see icli_arg_val() */
+        struct {
+            int64_t min; /**< Minimal value for AT_Int */
+            int64_t max; /**< Maximal value for AT_Int */
+            int range; /**< non-zero if AT_Int is limited to [min, max] */
+        };
+        const char *regex; /**< Regular expression for AT_Regex */
     };
     const char *help; /**< Optional help string */
+    /** Shared values for AT_Val and AT_Enum, used instead of vals. The argument references the set, which is not
+     * copied, so that updates of the set apply to all of the arguments referencing it */
+    struct icli_value_set *set;
 };
 
+/**
+ * Argument value parsed according to argument type
+ */
+struct icli_value {
+    enum icli_arg_type type; /**< Type of the argument, AT_None for arguments without definition */
+    const char *str; /**< The argument as provided by user */
+    union {
+        int64_t i; /**< AT_Int */
+        uint64_t u; /**< AT_Uint64, AT_Size (in bytes) */
+        struct in_addr ipv4; /**< AT_IPv4 */
+        struct in6_addr ipv6; /**< AT_IPv6 */
+        int index; /**< AT_Val, AT_Enum - index in vals */
+    };
+};
+
+/**
+ * Command callback function receiving parsed arguments
+ */
+typedef enum icli_ret (*icli_typed_cmd_func_t)(struct icli_value[], int, void *);
+
 /**
  * Command registration parameters
  */
@@ -110,11 +211,58 @@ struct icli_command_params {
     const char *name; /**< name of the command - can't be NULL, or empty string */
     const char *short_name; /**< short version to be displayed in prompt */
     icli_cmd_func_t command; /**< the callback to call - if NULL is passed, command will not accept arguments */
+    /** callback to call with parsed arguments instead of command. Arguments are parsed according to argv types, or
+     * to value types of grammar, before the call, so invalid input is rejected before dispatch */
+    icli_typed_cmd_func_t typed_command;
     const char *help; /**< help string for the command - can't be NULL, or empty string */
     int argc; /**< number of arguments to the command @see #ICLI_ARGS_DYNAMIC */
     /** Argument value that are acceptable at each position. NULL means no validation on argument in array. argv can be
      * NULL. in such case no validation is performed */
     struct icli_arg *argv;
+    /** Grammar of arguments of #ICLI_ARGS_DYNAMIC command. Arguments are validated against it before the command is
+     * called and completed according to it. Can be NULL for no validation. The grammar is made of:
+     * - keyword - argument that must be equal to the keyword
+     * - <name> - any argument
+     * - <name:type> - argument of type int, uint64, ipv4, ipv6 or size @see icli_arg_type()
+     * - [ ... ] - optional part
+     * - ( ... ) - group
+     * - a | b - either a or b
+     * - ... - repeat the preceding keyword, argument or group one or more times
+     *
+     * e.g. "[vlan <id>] (up | down) [tag <tag>]..." */
+    const char *grammar;
+};
+
+/**
+ * Column type of structured output
+ */
+enum icli_col_type {
+    ICLI_COL_STR, /**< String */
+    ICLI_COL_NUM, /**< Number, rendered as string if it is not a valid number */
+    ICLI_COL_BOOL /**< Boolean - "true", "yes", "on" and "1" are true, anything else is false */
+};
+
+/**
+ * Column of structured output
+ */
+struct icli_column {
+    const char *name; /**< name of the column - used as header and as key of JSON object */
+    enum icli_col_type type; /**< type of the column @see icli_col_type() */
+};
+
+/**
+ * Renderer of structured output. Rows are passed to the renderer as they are emitted, so renderer should write them
+ * out (using icli_printf()) instead of collecting them
+ */
+struct icli_renderer {
+    const char *name; /**< name of the format as selected by "command | name" */
+    /** called by icli_table_begin() (can be NULL) */
+    void (*begin)(const struct icli_column cols[], int n_cols, void *ctx);
+    /** called by icli_table_row(), vals are valid only during the call. NULL value means no value */
+    void (*row)(const struct icli_column cols[], int n_cols, const char *const vals[], void *ctx);
+    /** called by icli_table_end() (can be NULL) */
+    void (*end)(const struct icli_column cols[], int n_cols, void *ctx);
+    void *ctx; /**< context passed to the callbacks */
 };
 
 /**
@@ -130,12 +278,145 @@ int icli_init(struct icli_params *params);
 void icli_cleanup(void);
 
 /**
- * Run the main cli loop
+ * Run the main cli loop. Line editor and history are set up on the first call
  */
 void icli_run(void);
 
 /**
- * Register new command
+ * Exit status of icli_main()
+ */
+enum icli_exit_status {
+    ICLI_EXIT_OK = 0, /**< command succeeded */
+    ICLI_EXIT_ERR = 1, /**< command failed */
+    ICLI_EXIT_USAGE = 2 /**< no such command, or invalid arguments */
+};
+
+/**
+ * Execute single command given by process arguments, without line editor, history or paging, e.g. "app services jobs
+ * list" enters services and jobs modes and executes list in jobs mode. Arguments beyond the number of arguments of a
+ * command select the command in the mode it enters
+ * @param argc number of arguments as passed to main()
+ * @param argv arguments as passed to main() - argv[0] is ignored
+ * @return exit status @see icli_exit_status()
+ */
+int icli_main(int argc, char *argv[]);
+
+/**
+ * Phases of start up. Only icli_init() runs eagerly, the rest run the first time they are needed
+ */
+enum icli_phase {
+    ICLI_PHASE_INIT, /**< icli_init() */
+    ICLI_PHASE_READLINE, /**< line editor set up by the first icli_run() */
+    ICLI_PHASE_HISTORY, /**< loading tail of history file into the line editor */
+    ICLI_PHASE_HISTORY_INDEX, /**< indexing history for search, on first history addition or search */
+    ICLI_PHASE_HISTORY_JOURNAL, /**< opening history file for appending, on first history addition */
+    ICLI_PHASE_BUILTINS, /**< registering built-in commands of a mode, on first lookup in the mode */
+    ICLI_PHASE_TERMINAL, /**< probing terminal size, on first paged output */
+    ICLI_PHASE_MAX
+};
+
+/**
+ * Cost of a start up phase
+ */
+struct icli_phase_stats {
+    const char *name; /**< name of the phase */
+    uint64_t count; /**< number of times the phase has run */
+    uint64_t nsec; /**< total time spent in the phase in nanoseconds */
+};
+
+/**
+ * Get cost of a start up phase
+ * @param phase the phase
+ * @param[out] stats where to store the cost
+ * @return 0 on success, -1 on invalid phase
+ */
+int icli_get_phase_stats(enum icli_phase phase, struct icli_phase_stats *stats);
+
+/**
+ * Counters of calls to the allocator of icli (icli_params.allocator), since icli_init()
+ */
+struct icli_alloc_stats {
+    uint64_t allocs; /**< number of allocations */
+    uint64_t reallocs; /**< number of resizes of allocated memory */
+    uint64_t frees; /**< number of frees, allocs - frees is the number of live allocations */
+    uint64_t failures; /**< number of failed allocations and resizes */
+    uint64_t bytes; /**< bytes in use, counted only with the default allocator */
+    uint64_t peak_bytes; /**< maximal bytes in use, counted only with the default allocator */
+};
+
+/**
+ * Get counters of calls to the allocator. Can be called after icli_cleanup(), to find leaks
+ * @param[out] stats where to store the counters
+ * @return 0 on success, -1 on NULL stats
+ */
+int icli_get_alloc_stats(struct icli_alloc_stats *stats);
+
+/**
+ * Categories of memory allocated by icli
+ */
+enum icli_mem_category {
+    ICLI_MEM_COMMANDS, /**< commands, indexes of their names and grammars */
+    ICLI_MEM_ARGUMENTS, /**< copies of argument definitions, value sets and their indexes */
+    ICLI_MEM_PROMPTS, /**< prompt strings */
+    ICLI_MEM_HISTORY, /**< history search index and history of sessions */
+    ICLI_MEM_COMPLETION, /**< completion candidates and scratch space */
+    ICLI_MEM_BUFFERS, /**< output, table and audit buffers, and pending notifications */
+    ICLI_MEM_SERVERS, /**< servers, their clients and sessions */
+    ICLI_MEM_OTHER, /**< anything else */
+    ICLI_MEM_MAX
+};
+
+/**
+ * Memory in use. Bytes include a header of 16 bytes per object, but not the overhead of the allocator
+ */
+struct icli_mem_stats {
+    const char *name; /**< name of the category, or name of the mode */
+    uint64_t objects; /**< number of allocated objects */
+    uint64_t bytes; /**< allocated bytes */
+};
+
+/**
+ * Get memory in use of a category. Can be called after icli_cleanup(), to find leaks
+ * @param category the category
+ * @param[out] stats where to store the memory in use
+ * @return 0 on success, -1 on invalid category
+ */
+int icli_get_mem_stats(enum icli_mem_category category, struct icli_mem_stats *stats);
+
+/**
+ * Get memory in use by a mode and its subtree: the commands with their names, prompts, arguments and value sets
+ * @param mode the mode, NULL for root (the whole tree)
+ * @param[out] stats where to store the memory in use
+ * @return 0 on success, -1 on NULL stats
+ */
+int icli_get_mode_mem_stats(struct icli_command *mode, struct icli_mem_stats *stats);
+
+/**
+ * Create set of argument values, to be referenced by arguments of many commands (icli_arg.set). The values are copied
+ * once, and indexed for completion and validation once. May be called from any thread
+ * @param vals values terminated by a value with NULL val, can be empty
+ * @return the set referenced by the caller, NULL on error
+ */
+struct icli_value_set *icli_value_set_create(const struct icli_arg_val vals[]);
+
+/**
+ * Replace values of a set, for all arguments referencing it. Commands being executed keep seeing the old values. May
+ * be called from any thread, also while another thread runs icli_run() or a server
+ * @param set the set
+ * @param vals values terminated by a value with NULL val, can be empty
+ * @return 0 on success, -1 on error (the set keeps its values)
+ */
+int icli_value_set_update(struct icli_value_set *set, const struct icli_arg_val vals[]);
+
+/**
+ * Release reference of the caller to a set. The set is freed once no argument references it. Must be called before
+ * icli_cleanup()
+ * @param set the set (can be NULL)
+ */
+void icli_value_set_put(struct icli_value_set *set);
+
+/**
+ * Register new command. May be called from any thread, also while another thread runs icli_run() or a server
  * @param params params to initialize with @see icli_command_params()
  * @param[out] out_command where to store resulting command (can be NULL)
  * @return 0 on success, !0 on error
@@ -151,6 +432,15 @@ int icli_register_command(struct icli_command_params *params, struct icli_comman
  */
 int icli_register_commands(struct icli_command_params *params, struct icli_command *out_commads[], int n_commands);
 
+/**
+ * Unregister command and the commands below it. May be called from any thread, also from a command. Commands
+ * executing meanwhile keep running, and the shell and sessions in the removed mode are moved to its parent before
+ * they execute the next line. The commands are freed once they are not used anymore
+ * @param cmd the command, must not be used after the call
+ * @return 0 on success, -1 on error
+ */
+int icli_unregister_command(struct icli_command *cmd);
+
 /**
  * Print output to user. This must be used instead of printf
  * @param format
@@ -165,6 +455,17 @@ void icli_printf(const char *format, ...) __attribute__((__format__(__printf__,
  */
 void icli_err_printf(const char *format, ...) __attribute__((__format__(__printf__, 1, 2)));
 
+/**
+ * Print notification to user, e.g. an alert raised by another thread while the user is typing. Can be called from any
+ * thread between icli_init() and icli_cleanup(). The notification is queued without locking, and printed by the thread
+ * running icli_run() above the line being edited, which is then redisplayed. Notifications queued together are
+ * printed at once, and a burst of more than 16 notifications is summarized in a single line
+ * @param format
+ * @param ...
+ * @return 0 on success, -1 if the notification was dropped because too many notifications are waiting
+ */
+int icli_notify(const char *format, ...) __attribute__((__format__(__printf__, 1, 2)));
+
 /**
  * Change the prompt to user
  * @param prompt the new string
@@ -179,20 +480,137 @@ void icli_set_prompt(const char *prompt);
 int icli_commands_to_dot(const char *fname);
 
 /**
- * Execute arbitrary command
- * @param line the line to execute
- * @return 0 on success, -1 on error
+ * Execute arbitrary command line.
+ * Line may contain number of commands separated by ';' (execute next command regardless of the result) or by '&&'
+ * (execute next command only if previous one succeeded), e.g. "show services; show containers". Each command may
+ * select format of its structured output with " | format" suffix, e.g. "show services | json". The suffix is taken
+ * only if it names a registered renderer, otherwise '|' is passed to the command as part of its arguments
+ * @param line the line to execute (will be modified)
+ * @return 0 on success, -1 on error. For multiple commands the result of the last executed command is returned
  */
 int icli_execute_line(char *line);
 
 /**
- * Set new argument values for a command. This assumes argc was set correctly for this command before
+ * Execute arbitrary command line, capturing its output. Output is not paged, colored or passed to output hooks
+ * @param line the line to execute (will be modified) @see icli_execute_line()
+ * @param sink where to write output and error output to. Output is appended to buffers of the sink, so buffers
+ * can be reused for the next call by resetting len to 0
+ * @return 0 on success, -1 on error (including failure to allocate memory for output)
+ */
+int icli_execute_capture(char *line, struct icli_sink *sink);
+
+/**
+ * Header of request frame sent to control server, followed by len bytes of payload: name of output format (empty for
+ * the default format), '\0' and the command line. Fields are in host byte order. Requests may be pipelined - the
+ * client does not have to wait for a response before sending the next request
+ */
+struct icli_server_request {
+    uint32_t len; /**< length of payload */
+    uint32_t id; /**< request id, echoed in the response */
+};
+
+/**
+ * Header of response frame sent by control server, followed by out_len bytes of output and err_len bytes of error
+ * output. Responses are sent in the order of requests
+ */
+struct icli_server_response {
+    uint32_t id; /**< id of the request */
+    int32_t status; /**< exit status of the command line @see icli_exit_status */
+    uint32_t out_len; /**< length of output */
+    uint32_t err_len; /**< length of error output */
+};
+
+/**
+ * Parameters of control server
+ */
+struct icli_server_params {
+    const char *path; /**< path of Unix domain socket to listen on. Existing socket is replaced */
+    int max_clients; /**< maximal number of connected clients, 0 for default (256) */
+    uint32_t max_request_size; /**< maximal length of request payload, 0 for default (64KB) */
+    /** non-zero to serve interactive terminal sessions (e.g. of icli-attach) instead of request frames. Each session
+     * has its own line editor, history, mode and pager. The client sends raw keys and reports terminal size as
+     * "ESC [ 8 ; rows ; cols t", and receives terminal output */
+    int sessions;
+};
+
+struct icli_server;
+
+/**
+ * Create control server, which executes command lines sent by clients over Unix domain socket. Each client has its own
+ * mode, and "quit" closes the connection of the client. All clients are served by a single event loop over the shared
+ * command tree, and idle clients hold no buffers. Commands are executed by the thread calling icli_server_poll(),
+ * which must not run concurrently with other icli calls
+ * @param params params of the server
+ * @return the server, NULL on error
+ */
+struct icli_server *icli_server_create(const struct icli_server_params *params);
+
+/**
+ * Get file descriptor of the server, which becomes readable when icli_server_poll() has work to do. Can be used to
+ * integrate the server into event loop of the application
+ * @param server the server
+ * @return the file descriptor
+ */
+int icli_server_fd(struct icli_server *server);
+
+/**
+ * Accept clients, execute their requests and send responses. All complete requests read from a client are executed
+ * and their responses are sent in a single write
+ * @param server the server
+ * @param timeout_ms how long to wait for events, -1 to wait forever, 0 to return immediately
+ * @return number of handled events, -1 on error
+ */
+int icli_server_poll(struct icli_server *server, int timeout_ms);
+
+/**
+ * Disconnect all clients, remove the socket and free the server
+ * @param server the server, can be NULL
+ */
+void icli_server_destroy(struct icli_server *server);
+
+/**
+ * Set new argument values for a command. This assumes argc was set correctly for this command before. May be called
+ * from any thread - commands executing meanwhile keep using the previous arguments
  * @param cmd the command to modify
  * @param argv new values. for explanation @see icli_command_params()
  * @return 0 on success, -1 on error
  */
 int icli_reset_arguments(struct icli_command *cmd, struct icli_arg *argv);
 
+/**
+ * Register renderer of structured output. Renderers "text", "json" (JSON Lines) and "csv" are built-in
+ * @param renderer the renderer (copied)
+ * @return 0 on success, -1 on error
+ */
+int icli_register_renderer(const struct icli_renderer *renderer);
+
+/**
+ * Set format of structured output for commands which don't select format with "command | format" suffix
+ * @param name name of registered renderer
+ * @return 0 on success, -1 if there is no such renderer
+ */
+int icli_set_output_format(const char *name);
+
+/**
+ * Start structured output of a command. Table not ended by the command is ended once the command returns
+ * @param cols columns of the table, must be valid until icli_table_end()
+ * @param n_cols number of columns
+ * @return 0 on success, -1 on error
+ */
+int icli_table_begin(const struct icli_column cols[], int n_cols);
+
+/**
+ * Output row of the table started by icli_table_begin(). The row is rendered immediately
+ * @param vals value for each column
+ * @return 0 on success, -1 on error
+ */
+int icli_table_row(const char *const vals[]);
+
+/**
+ * End structured output started by icli_table_begin()
+ */
+void icli_table_end(void);
+
 /**
  * Execute a script
  * @param fname the path to the script
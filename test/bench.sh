@@ -0,0 +1,43 @@
+#!/bin/bash
+#
+# Startup benchmark - average wall time of a single command executed by a fresh process
+#
+# usage: bench.sh <build dir> [runs]
+
+BUILD_DIR=${1:-.}
+RUNS=${2:-200}
+CLI=$BUILD_DIR/cli
+
+bench() {
+    local name=$1
+    shift
+
+    local start=$(date +%s%N)
+    for ((i = 0; i < RUNS; ++i)); do
+        "$@" > /dev/null || exit 1
+    done
+    local end=$(date +%s%N)
+
+    printf "%-24s %8d us/run\n" "$name" $(((end - start) / RUNS / 1000))
+}
+
+one_shot() {
+    $CLI show services
+}
+
+batch() {
+    echo "show services" | $CLI
+}
+
+cd $BUILD_DIR || exit 1
+
+bench "one-shot (icli_main)" one_shot
+bench "batch (stdin)" batch
+
+echo
+echo "phases of a single one-shot run:"
+CLI_PHASE_STATS=1 $CLI show services 2>&1 > /dev/null
+
+echo
+echo "command tree of 1M commands:"
+$BUILD_DIR/tree-bench
@@ -5,29 +5,73 @@ import pexpect
 import sys
 import time
 import os
+import subprocess
+import socket
+import struct
+import tempfile
+import shutil
+import re
+import signal
 
 
 SRC_DIR = sys.argv[1]
 BUILD_DIR = sys.argv[2]
 
 
+# seconds to wait for output of a program running under valgrind
+TIMEOUT = 60
+# seconds a test may run
+TEST_TIMEOUT = 2 * TIMEOUT
+
+
+@pytest.fixture(autouse=True)
+def time_limit(request):
+    """Fail a test running longer than TEST_TIMEOUT, so that a hang is reported by the test it happened in"""
+    def expired(signum, frame):
+        pytest.fail('Test timed out after {} seconds'.format(TEST_TIMEOUT))
+
+    handler = signal.signal(signal.SIGALRM, expired)
+    signal.alarm(TEST_TIMEOUT)
+
+    def teardown():
+        signal.alarm(0)
+        signal.signal(signal.SIGALRM, handler)
+
+    request.addfinalizer(teardown)
+
+
+def wait_for(cond):
+    """Poll COND until it returns true, for at most TIMEOUT seconds. Return whether it did"""
+    deadline = time.time() + TIMEOUT
+    while not cond():
+        if time.time() > deadline:
+            return False
+        time.sleep(.1)
+    return True
+
+
+def valgrind(args, error_exitcode=1):
+    """Command line running program with ARGS under valgrind, exiting with ERROR_EXITCODE on memory errors and leaks"""
+    return ['valgrind',
+            '--vgdb=no',
+            '--gen-suppressions=all',
+            '--error-exitcode={}'.format(error_exitcode),
+            '--leak-check=full',
+            '--show-leak-kinds=all',
+            '--errors-for-leak-kinds=all',
+            '--track-fds=yes',
+            '-v',
+            '--log-file=valgrind.log',
+            '--suppressions={}'.format(os.path.join(SRC_DIR, 'valgrind.sup'))] + args
+
+
 class iCli(object):
     _prompt = '> '
 
     def __init__(self, cmd):
-        args = ['--vgdb=no',
-                '--gen-suppressions=all',
-                '--error-exitcode=1',
-                '--leak-check=full',
-                '--show-leak-kinds=all',
-                '--errors-for-leak-kinds=all',
-                '--track-fds=yes',
-                '-v',
-                '--log-file=valgrind.log',
-                '--suppressions={}'.format(os.path.join(SRC_DIR, 'valgrind.sup')),
-                cmd]
-
-        self.icli = pexpect.spawn('valgrind', args=args, logfile=sys.stdout, echo=False)
+        args = valgrind([cmd])
+
+        self.icli = pexpect.spawn(args[0], args=args[1:], logfile=sys.stdout, echo=False)
         self.icli.expect(self._prompt)
 
     def exec_command(self, line, expect_output=None):
@@ -60,16 +104,74 @@ def icli(request):
     return icli
 
 
+def run(args=(), stdin=b'', env=None, error_exitcode=1):
+    """Run cli with ARGS under valgrind to completion. Return its exit status, output and error output"""
+    cli = subprocess.Popen(valgrind([os.path.join(BUILD_DIR, 'cli')] + list(args), error_exitcode),
+                           stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                           env=dict(os.environ, **(env or {})))
+    out, err = cli.communicate(stdin)
+    return cli.returncode, out, err
+
+
+@pytest.fixture
+def spawn(request):
+    """Start interactive cli under valgrind, with ENV added to the environment, once it shows the prompt. Check its exit
+    status at teardown"""
+    clis = []
+
+    def start(env=None):
+        args = valgrind([os.path.join(BUILD_DIR, 'cli')])
+        clis.append(pexpect.spawn(args[0], args=args[1:], env=dict(os.environ, **(env or {})), timeout=TIMEOUT))
+        clis[-1].expect_exact('my_cli> ')
+        return clis[-1]
+
+    def teardown():
+        for cli in clis:
+            cli.expect(pexpect.EOF)
+            while cli.isalive():
+                time.sleep(.1)
+            assert cli.exitstatus == 0
+
+    request.addfinalizer(teardown)
+    return start
+
+
 def test_icli(icli):
     icli.exec_command('?')
 
     icli.exec_command('show services')
     icli.exec_command('show containers')
-    icli.exec_command('show contain', 'argument invalid')
+    icli.exec_command('show xyz', 'argument invalid')
+    icli.exec_command('show servcies', 'Did you mean: services?')
+    icli.exec_command('shwo services', 'Did you mean: show?')
+    icli.exec_command('sh contain', 'container-4  busybox')
+    icli.exec_command('h', 'Ambiguous command: help history')
+
+    icli.exec_command('show services; show containers', 'container-4  busybox')
+    icli.exec_command('nosuch && show services', 'nosuch: No such command')
+    icli.exec_command('nosuch; show services', '2  db')
+    icli.exec_command('services; jobs; end 2')
+    icli.exec_command('services; jobs; end 0x2 && show services', ' 2  db    false')
+
+    icli.exec_command('show services | json', '"id":2,"name":"db","running":false')
+    icli.exec_command('show services | csv', 'id,name,running')
+    icli.exec_command('show services | xml', 'accepts exactly 1 arguments')
+    icli.exec_command('echo foo|bar', r'foo\|bar')
+    icli.exec_command('echo foo|bar | json', r'foo\|bar')
+    icli.exec_command('show containers | table', 'container-4  busybox')
+    icli.exec_command('wc show services', '3 lines')
+    icli.exec_command('sizes', r'show services +3 +\d+\s+show containers +5 +\d+')
+    icli.exec_command('sizes | table', r'show services +3 +\d+\s+show containers +5 +\d+')
 
     for i in xrange(0, 25, 5):
         icli.exec_command('interface {}'.format(i), 'Set interface {}'.format(i))
         icli.exec_command('end')
+    # leading zeros are decimal, hex needs the 0x prefix
+    for arg, num in (('010', 10), ('08', 8), ('0x10', 16)):
+        icli.exec_command('interface {}'.format(arg), 'Set interface {}'.format(num))
+        icli.exec_command('end')
+    icli.exec_command('interface 5000', 'argument invalid: 5000')
+    icli.exec_command('interface eth0', r'Expected: integer in range \[0, 1023\]')
 
     icli.exec_command('services')
     icli.exec_command('jobs')
@@ -83,6 +185,14 @@ def test_icli(icli):
     icli.exec_command('end')
 
     icli.exec_command('history')
+    icli.exec_command('history search serv', 'show services')
+    icli.exec_command('history foo', 'Expected: search')
+
+    icli.exec_command('route add 10.0.0.0/8 via 10.0.0.1 metric 5', 'Route add 10.0.0.0/8 via=10.0.0.1 metric=5')
+    icli.exec_command('route add 10.0.0.0/8 via 10.0.0.1 dev eth0', 'argument invalid: dev')
+    icli.exec_command('route del', 'missing arguments')
+    icli.exec_command('ro a 10.0.0.0/8 v 10.0.0.1', 'Route add 10.0.0.0/8 via=10.0.0.1')
+    icli.exec_command('route add 10.0.0.0/8 via 10.0.0.256', 'argument invalid: 10.0.0.256')
 
     icli.sendline('quit')
     for x in xrange(30):
@@ -93,5 +203,334 @@ def test_icli(icli):
     assert not icli.isalive()
 
 
+def test_notify(spawn):
+    cli = spawn({'CLI_NOTIFY_MS': '100'})
+
+    # notification is printed above the line being typed, which is redisplayed
+    cli.send('show serv')
+    cli.expect_exact('service db is')
+    cli.expect_exact('my_cli> show serv')
+    cli.send('ices\r')
+    cli.expect_exact(' 2  db    false')
+
+    cli.send('quit\r')
+    cli.expect(pexpect.EOF)
+
+
+def test_concurrent_register(spawn):
+    cli = spawn({'CLI_PROBES': '2000'})
+
+    # commands are looked up, completed and executed while another thread registers commands and resets arguments
+    for _ in range(20):
+        cli.send('sh\tserv\t\r')
+        cli.expect_exact(' 2  db    false')
+        cli.expect_exact('my_cli> ')
+        cli.send('probe-1\t\x15')
+
+    cli.send('\r')
+    cli.expect_exact('my_cli> ')
+    def registered():
+        cli.send('probe-1999\r')
+        found = cli.expect_exact(['No problemmo', 'No such command']) == 0
+        cli.expect_exact('my_cli> ')
+        return found
+
+    # the last command is registered eventually
+    assert wait_for(registered)
+
+    cli.send('quit\r')
+    cli.expect(pexpect.EOF)
+
+
+def test_batch():
+    status, out, _ = run(stdin=b'show services\nshow xyz\nservices\njobs\nlist\n')
+
+    assert status == 0
+    assert b' 2  db    false' in out
+    assert b'argument invalid: xyz' in out
+    assert b'199  job-199' in out
+    assert b'\x1b[' not in out
+    assert b'--More--' not in out
+
+
+def test_main():
+    # exit status of one-shot execution, valgrind errors are reported with a status cli doesn't use
+    def main(*args):
+        status, out, _ = run(args, error_exitcode=99)
+        return status, out
+
+    status, out = main('show', 'services')
+    assert status == 0
+    assert b' 2  db    false' in out
+
+    assert main('plugin', 'unload') == (1, b'Plugin is not loaded\n')
+    assert main('nosuch') == (2, b'nosuch: No such command\n')
+
+    status, out = main('show', 'xyz')
+    assert status == 2
+    assert b'argument invalid: xyz' in out
+
+    # arguments beyond those of a mode command select the command in the mode
+    status, out = main('services', 'jobs', 'list')
+    assert status == 0
+    assert b'199  job-199' in out
+    assert b'--More--' not in out
+
+    assert main('services', 'jobs', 'nosuch') == (2, b'nosuch: No such command\n')
+
+
+def test_allocator():
+    # all memory allocated by icli is freed by icli_cleanup(), with the default and with application allocator
+    for pool in (False, True):
+        env = {'CLI_ALLOC_STATS': '1'}
+        if pool:
+            env['CLI_POOL'] = '1'
+        status, out, err = run(stdin=b'show services\nservices\njobs\nlist\nend 2\nshow xyz\n', env=env)
+
+        assert status == 0
+        assert b'199  job-199' in out
+        assert b' live 0 ' in err
+        if pool:
+            assert b'pool bytes in use 0' in err
+
+
+class iCliServer(object):
+    def __init__(self, option):
+        self.dir = tempfile.mkdtemp()
+        self.path = os.path.join(self.dir, 'cli.sock')
+        self.sessions = []
+        self.cli = subprocess.Popen(valgrind([os.path.join(BUILD_DIR, 'cli'), option, self.path]),
+                                    stdin=subprocess.PIPE)
+
+        wait_for(lambda: os.path.exists(self.path) or self.cli.poll() is not None)
+
+    def connect(self):
+        sock = socket.socket(socket.AF_UNIX)
+        sock.settimeout(TIMEOUT)
+        sock.connect(self.path)
+        return sock
+
+    def attach(self, **kwargs):
+        """Start icli-attach in a session of the server, once it shows the prompt"""
+        session = pexpect.spawn(os.path.join(BUILD_DIR, 'icli-attach'), [self.path], timeout=TIMEOUT, **kwargs)
+        self.sessions.append(session)
+        session.expect_exact('my_cli> ')
+        return session
+
+    def close(self):
+        for session in self.sessions:
+            session.expect(pexpect.EOF)
+            while session.isalive():
+                time.sleep(.1)
+            assert session.exitstatus == 0
+
+        self.cli.terminate()
+        status = self.cli.wait()
+        shutil.rmtree(self.dir, ignore_errors=True)
+        assert status == 0
+
+
+@pytest.fixture
+def server(request):
+    """Start cli serving OPTION ('--listen' or '--sessions') on a socket in a temporary directory"""
+    servers = []
+
+    def start(option='--listen'):
+        servers.append(iCliServer(option))
+        return servers[-1]
+
+    def teardown():
+        for srv in servers:
+            srv.close()
+
+    request.addfinalizer(teardown)
+    return start
+
+
+def server_request(rid, line, fmt=''):
+    payload = fmt.encode() + b'\0' + line.encode()
+    return struct.pack('=II', len(payload), rid) + payload
+
+
+def server_response(sock):
+    def recv_exact(n):
+        data = b''
+        while len(data) < n:
+            chunk = sock.recv(n - len(data))
+            assert chunk
+            data += chunk
+        return data
+
+    rid, status, out_len, err_len = struct.unpack('=IiII', recv_exact(16))
+    return rid, status, recv_exact(out_len), recv_exact(err_len)
+
+
+def test_history_tab(spawn):
+    hist_dir = tempfile.mkdtemp()
+    env = {'CLI_HISTORY': os.path.join(hist_dir, 'history')}
+
+    # line containing a tab (inserted literally with ^V) is reloaded in root mode as it was typed
+    try:
+        for restart in (False, True):
+            cli = spawn(env)
+            if not restart:
+                cli.send('show\x16\tservices\r')
+                cli.expect_exact(' 2  db    false')
+                cli.expect_exact('my_cli> ')
+            cli.send('history search services\r')
+            cli.expect(r'\d+ show\tservices\r\n')
+            cli.expect_exact('my_cli> ')
+            cli.send('quit\r')
+            cli.expect(pexpect.EOF)
+    finally:
+        shutil.rmtree(hist_dir, ignore_errors=True)
+
+
+def test_value_set(spawn):
+    cli = spawn()
+    cli.send('containers\r')
+    cli.expect_exact('my_cli(containers)> ')
+
+    cli.send('start web-1\r')
+    cli.expect_exact('argument invalid: web-1')
+    cli.expect_exact('my_cli(containers)> ')
+
+    # updating the set once applies to validation and completion of all commands referencing it
+    cli.send('create web-1\r')
+    cli.expect_exact('Created web-1')
+    cli.expect_exact('my_cli(containers)> ')
+    cli.send('create web-1\r')
+    cli.expect_exact('Container web-1 already exists')
+    cli.expect_exact('my_cli(containers)> ')
+    cli.send('start w\t\r')
+    cli.expect_exact('Starting web-1')
+    cli.expect_exact('my_cli(containers)> ')
+    cli.send('stop web\r')
+    cli.expect_exact('Stopping web-1')
+    cli.expect_exact('my_cli(containers)> ')
+
+    cli.send('end\r')
+    cli.expect_exact('my_cli> ')
+    cli.send('quit\r')
+    cli.expect(pexpect.EOF)
+
+
+def test_memory():
+    status, out, _ = run(stdin=b'icli memory\nservices\nicli memory 2 | csv\n')
+
+    assert status == 0
+    assert re.search(br'commands +\d+ +\d+', out)
+    assert re.search(br'total +\d+ +\d+', out)
+    # memory of the whole tree, and of mode subtrees down to the requested depth
+    assert re.search(br'\(root\) +\d+ +\d+', out)
+    assert b'services/jobs,' in out
+    assert b'services/jobs ' not in out
+
+
+def test_server(server):
+    srv = server()
+    sock = srv.connect()
+
+    # pipelined requests, the mode is kept per client
+    sock.sendall(server_request(1, 'show services', 'json') + server_request(2, 'services') +
+                 server_request(3, 'jobs') + server_request(4, 'list | csv') + server_request(5, 'xyz') +
+                 server_request(6, 'end 2') + server_request(7, 'quit'))
+
+    assert server_response(sock) == (1, 0, b'{"id":1,"name":"web","running":true}\n'
+                                           b'{"id":2,"name":"db","running":false}\n', b'')
+    assert server_response(sock)[:2] == (2, 0)
+    assert server_response(sock)[:2] == (3, 0)
+    assert b'199,job-199,' in server_response(sock)[2]
+    assert server_response(sock) == (5, 2, b'', b'xyz: No such command\n')
+    assert server_response(sock)[:2] == (6, 0)
+    assert server_response(sock)[:2] == (7, 0)
+    assert sock.recv(1) == b''
+
+    # quit closed only the connection
+    sock = srv.connect()
+    sock.sendall(server_request(1, 'show services'))
+    assert server_response(sock)[2].startswith(b'id  name  running')
+
+
+def test_unregister(server):
+    srv = server()
+
+    first = srv.connect()
+    first.sendall(server_request(1, 'plugin load') + server_request(2, 'diag') + server_request(3, 'ping'))
+    assert server_response(first)[:2] == (1, 0)
+    assert server_response(first)[:2] == (2, 0)
+    assert server_response(first) == (3, 0, b'pong\n', b'')
+
+    # the mode of the first client is removed by the second one
+    second = srv.connect()
+    second.sendall(server_request(1, 'plugin unload') + server_request(2, 'diag'))
+    assert server_response(second)[:2] == (1, 0)
+    assert server_response(second)[3] == b'diag: No such command\n'
+
+    first.sendall(server_request(4, 'ping') + server_request(5, 'ping') + server_request(6, 'plugin load') +
+                  server_request(7, 'diag; ping'))
+    assert server_response(first)[3] == b'diag: Mode was removed\n'
+    assert server_response(first)[3] == b'ping: No such command\n'
+    assert server_response(first)[:2] == (6, 0)
+    assert server_response(first) == (7, 0, b'pong\n', b'')
+
+
+def test_session(server):
+    srv = server('--sessions')
+
+    first = srv.attach(dimensions=(10, 80))
+    first.send('services\r')
+    first.expect_exact('my_cli(svc)> ')
+
+    # each session has its own mode
+    second = srv.attach()
+    second.send('show serv\t\r')
+    second.expect_exact('show services')
+    second.expect_exact(' 2  db    false')
+    second.expect_exact('my_cli> ')
+
+    # completion, history and paging are per session
+    first.send('jo\t\r')
+    first.expect_exact('my_cli(svc)(jobs)> ')
+    first.send('list\r')
+    first.expect_exact('--More--')
+    first.send('q')
+    first.expect_exact('my_cli(svc)(jobs)> ')
+    first.send('\x1b[A')
+    first.expect_exact('list')
+    first.send('\x15end 2\r')
+    first.expect_exact('my_cli> ')
+    first.send('quit\r')
+    first.expect(pexpect.EOF)
+
+    second.send('\x04')
+    second.expect(pexpect.EOF)
+
+
+def test_session_prompt(server):
+    srv = server('--sessions')
+
+    first = srv.attach()
+    first.send('interface 5\r')
+    first.expect_exact('my_cli(intf 5)> ')
+
+    second = srv.attach()
+    second.send('interface 7\r')
+    second.expect_exact('my_cli(intf 7)> ')
+
+    # arguments of a mode belong to the session which entered it
+    first.send('\r')
+    first.expect_exact('\r\n\rmy_cli(intf 5)> ')
+    first.send('end\r')
+    first.expect_exact('my_cli> ')
+    second.send('\r')
+    second.expect_exact('\r\n\rmy_cli(intf 7)> ')
+    second.send('end\r')
+    second.expect_exact('my_cli> ')
+
+    first.send('quit\r')
+    second.send('\x04')
+
+
 if __name__ == '__main__':
     sys.exit(pytest.main(sys.argv[0] + " -s " + ' '.join(sys.argv[3:])))